@@ -1 +1,2 @@
-gcc -std=c23 -o archiver.exe .\src\main.c -Iinclude -Llib -lminizip-ng -lzstd -lbcrypt -luuid -lshell32 -lshlwapi -lcomdlg32 -lole32 -loleaut32
\ No newline at end of file
+gcc -std=c23 -o archiver.exe .\src\main.c .\src\sink.c .\src\restore.c .\src\snapshot.c -Iinclude -Llib -lminizip-ng -lzstd -lbcrypt -luuid -lshell32 -lshlwapi -lcomdlg32 -lole32 -loleaut32 -lwbemuuid -lws2_32 -lwinhttp
+gcc -std=c23 -DARCHIVER_BENCH -o bench_archiver.exe .\src\main.c .\src\sink.c .\src\restore.c .\src\snapshot.c .\src\bench.c -Iinclude -Llib -lminizip-ng -lzstd -lbcrypt -luuid -lshell32 -lshlwapi -lcomdlg32 -lole32 -loleaut32 -lwbemuuid -lws2_32 -lwinhttp -lpsapi
\ No newline at end of file
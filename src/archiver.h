@@ -0,0 +1,333 @@
+ // Types and functions shared by the archiver translation units
+ #ifndef ARCHIVER_H
+ #define ARCHIVER_H
+ 
+ #include <winsock2.h>
+ #include <ws2tcpip.h>
+ #include <windows.h>
+ #include <winhttp.h>
+ #include <shlobj.h>
+ #include <shobjidl.h>
+ #include <objbase.h>
+ #include <shellapi.h>
+ #include <wbemidl.h>
+ #include <stdio.h>
+ #include <io.h>
+ #include <stdbool.h>
+ #include <stdlib.h>
+ #include <wctype.h>
+ #include <locale.h>
+ #include <time.h>
+ #if defined(__x86_64__) || defined(__i386__)
+ #include <cpuid.h>
+ #include <immintrin.h>
+ #define CRC_CLMUL 1
+ #endif
+ 
+ #include "mz.h"
+ #include "mz_strm.h"
+ #include "mz_strm_buf.h"
+ #include "mz_strm_mem.h"
+ #include "mz_strm_os.h"
+ #include "mz_strm_split.h"
+ #include "mz_strm_zstd.h"
+ #include "mz_crypt.h"
+ #include "mz_os.h"
+ #include "mz_zip.h"
+ #include "mz_zip_rw.h"
+ 
+ #define PATH_MAX_LEN 1024
+ #define READ_CHUNK (1 << 20)
+ 
+ // Full paths are stored once in a shared pool, the relative path is a suffix of it
+ typedef struct FileEntry {
+     size_t full;      // offset of the NUL-terminated full path in EntryList.pool
+     uint16_t len;     // full path length in characters
+     uint16_t rel;     // start of the path relative to the walked root
+     int32_t prefix;   // index into EntryList.prefixes prepended to rel, -1 for none
+     uint32_t attr;    // FILE_ATTRIBUTE_* from the directory record
+     size_t name;      // offset of the UTF-8 archive name in EntryList.names, NO_NAME for directories
+     int64_t size;     // the rest is also from the directory record, so archiving
+     uint64_t mtime;   // needs no metadata calls; times are FILETIMEs
+     uint64_t atime;
+     uint64_t ctime;
+ } FileEntry;
+ 
+ #define NO_NAME ((size_t)-1)
+ 
+ struct EntryQueue;
+ 
+ typedef struct EntryList {
+     FileEntry *items;
+     int count, cap;
+     wchar_t *pool;     // packed NUL-terminated paths
+     size_t pool_len, pool_cap;
+     char *names;       // packed NUL-terminated UTF-8 archive names
+     size_t names_len, names_cap;
+     size_t *prefixes;  // pool offsets of archive folder names (link names)
+     int prefix_count, prefix_cap;
+     struct EntryQueue *queue;  // streaming: full batches are handed to this queue
+     int batch_limit;
+ } EntryList;
+ 
+ // Resolved .lnk shortcut: target tree and the folder name it gets in the archive
+ typedef struct LinkTarget {
+     wchar_t target[PATH_MAX_LEN];
+     wchar_t name[PATH_MAX_LEN];
+ } LinkTarget;
+ 
+ typedef struct ArchiveOptions {
+     int threads;             // compression workers, 1 = compress on the writer thread
+     bool stream;             // overlap directory walk and compression through a bounded queue
+     int walkers;             // directory walk threads, 1 = serial depth-first walk
+     const wchar_t *manifest; // incremental: manifest file (a directory of manifests with --split)
+     bool quiet;              // no console progress (benchmark runs)
+     bool adaptive;           // pick store or a zstd level per file
+     bool direct_io;          // unbuffered overlapped archive writes
+     bool dedup;              // content-defined chunk store instead of one entry per file
+     int64_t mt_threshold;    // files this large are compressed by multithreaded zstd
+     bool index;              // write the <archive>.idx lookup sidecar
+     bool snapshot;           // read the link targets from VSS snapshots
+     bool usn;                // incremental: find changes in the NTFS change journal
+     bool dict;               // compress small files against a trained zstd dictionary
+     bool solid;              // pack small files into shared compression blocks
+     bool resume;             // checkpoint the archive and continue an interrupted run
+     int64_t volume_size;     // spanned archive volumes of this size, 0 = a single file
+     const wchar_t *volume_cmd; // run on every finished volume, NULL = flush only
+     bool seekable;           // large entries as independent zstd frames with a seek table
+     uint16_t compress_method;
+     int16_t compress_level;
+ } ArchiveOptions;
+ 
+ // --stats/--trace spans
+ typedef enum TracePhase {
+     TRACE_LINK,      // resolve_link
+     TRACE_WALK,      // one source tree enumerated
+     TRACE_DIR,       // FindFirstFileExW, opening one directory
+     TRACE_COMPRESS,  // worker compressing a file into memory
+     TRACE_ENTRY,     // writer adding one entry
+     TRACE_WRITE,     // write or wait on the archive file
+     TRACE_PHASES
+ } TracePhase;
+ 
+ typedef struct Trace Trace;
+ extern Trace *tracer;                 // NULL unless --stats or --trace
+ 
+ static inline int64_t trace_begin(void) {
+     if (!tracer) return 0;
+     LARGE_INTEGER t;
+     QueryPerformanceCounter(&t);
+     return t.QuadPart;
+ }
+ 
+ void trace_end(TracePhase phase, int64_t start, int64_t bytes);
+ 
+ // Incremental manifest
+ typedef struct ManifestRecord {
+     size_t name;      // offset into Manifest.names
+     int64_t size;
+     uint64_t mtime;
+     uint32_t crc;
+     int64_t cd_pos;   // central directory position in the previous archive, -1 if absent
+     int64_t offset;   // local header offset, --resume journal records only (-1 otherwise)
+ } ManifestRecord;
+ 
+ typedef struct Manifest {
+     ManifestRecord *items;
+     int count, cap;
+     char *names;
+     size_t names_len, names_cap;
+     int *slots;       // open addressing over items, -1 = empty
+     int slot_cap;
+ } Manifest;
+ 
+ ManifestRecord *manifest_find(const Manifest *m, const char *name);
+ bool manifest_load(Manifest *m, const wchar_t *path);
+ void manifest_free(Manifest *m);
+ 
+ // Console progress
+ #define PROGRESS_INTERVAL_MS 250
+ 
+ typedef struct Progress {
+     volatile LONG64 files_done;
+     volatile LONG64 bytes_in;     // source bytes of finished entries
+     volatile LONG64 entry_pos;    // source bytes read so far of the entry being written
+     volatile LONG64 bytes_out;    // archive size after the last finished entry
+     int64_t files_total;          // 0 while streaming, the total is not known yet
+     int64_t bytes_total;
+     SRWLOCK name_lock;
+     wchar_t name[PATH_MAX_LEN];
+     ULONGLONG start;
+     HANDLE stop;
+     HANDLE thread;
+ } Progress;
+ 
+ Progress *progress_start(void);
+ void progress_stop(Progress **pp);
+ void progress_begin(Progress *p, const wchar_t *name);
+ void progress_end(Progress *p, int64_t size, int64_t archive_size);
+ 
+ static inline void progress_advance(Progress *p, int64_t pos) {
+     if (p) InterlockedExchange64(&p->entry_pos, pos);
+ }
+ 
+ // libzstd has no header in include/, the few declarations needed follow its stable ABI
+ typedef struct ZSTD_CCtx_s ZSTD_CCtx;
+ typedef struct { const void *src; size_t size; size_t pos; } ZSTD_inBuffer;
+ typedef struct { void *dst; size_t size; size_t pos; } ZSTD_outBuffer;
+ enum { ZSTD_e_continue = 0, ZSTD_e_end = 2 };
+ enum { ZSTD_c_compressionLevel = 100, ZSTD_c_nbWorkers = 400 };
+ ZSTD_CCtx *ZSTD_createCCtx(void);
+ size_t ZSTD_freeCCtx(ZSTD_CCtx *cctx);
+ size_t ZSTD_CCtx_setParameter(ZSTD_CCtx *cctx, int param, int value);
+ size_t ZSTD_CCtx_setPledgedSrcSize(ZSTD_CCtx *cctx, unsigned long long pledged);
+ size_t ZSTD_compressStream2(ZSTD_CCtx *cctx, ZSTD_outBuffer *output, ZSTD_inBuffer *input, int end_op);
+ unsigned ZSTD_isError(size_t code);
+ typedef struct ZSTD_CDict_s ZSTD_CDict;
+ typedef struct ZSTD_DDict_s ZSTD_DDict;
+ typedef struct ZSTD_DCtx_s ZSTD_DCtx;
+ size_t ZDICT_trainFromBuffer(void *dict, size_t dict_cap, const void *samples, const size_t *sample_sizes,
+                              unsigned count);
+ unsigned ZDICT_isError(size_t code);
+ unsigned ZDICT_getDictID(const void *dict, size_t dict_size);
+ ZSTD_CDict *ZSTD_createCDict(const void *dict, size_t dict_size, int level);
+ size_t ZSTD_freeCDict(ZSTD_CDict *cdict);
+ size_t ZSTD_compress_usingCDict(ZSTD_CCtx *cctx, void *dst, size_t dst_cap, const void *src, size_t src_size,
+                                 const ZSTD_CDict *cdict);
+ size_t ZSTD_compressBound(size_t src_size);
+ ZSTD_DDict *ZSTD_createDDict(const void *dict, size_t dict_size);
+ size_t ZSTD_freeDDict(ZSTD_DDict *ddict);
+ ZSTD_DCtx *ZSTD_createDCtx(void);
+ size_t ZSTD_freeDCtx(ZSTD_DCtx *dctx);
+ size_t ZSTD_decompress_usingDDict(ZSTD_DCtx *dctx, void *dst, size_t dst_cap, const void *src, size_t src_size,
+                                   const ZSTD_DDict *ddict);
+ enum { ZSTD_c_checksumFlag = 201 };
+ size_t ZSTD_compress2(ZSTD_CCtx *cctx, void *dst, size_t dst_cap, const void *src, size_t src_size);
+ size_t ZSTD_decompressDCtx(ZSTD_DCtx *dctx, void *dst, size_t dst_cap, const void *src, size_t src_size);
+ 
+ // Entry names and extra fields the writers leave for the readers
+ #define DICT_ENTRY "archiver.dict"
+ #define DEDUP_INDEX "archiver.dedup/index"
+ #define SOLID_PREFIX "archiver.solid/"
+ #define SOLID_BLOCK_NAME SOLID_PREFIX "block-%05d"
+ #define SOLID_INDEX SOLID_PREFIX "index"
+ #define SOLID_HEADER "# archiver solid index v1"
+ #define SEEK_FIELD 0x6b73              // extra field id: frame size and frame count
+ #define SEEK_FRAME ((int32_t)4 << 20)
+ #define SEEK_SKIPPABLE_MAGIC 0x184D2A5Eu
+ #define SEEK_TABLE_MAGIC 0x8F92EAB1u
+ #define SEEK_FOOTER 9                  // frame count, descriptor, magic
+ 
+ typedef struct SolidMember {
+     int block;
+     int64_t offset, size;
+     uint64_t mtime;
+     uint32_t attr;
+     const char *name;      // points into the index text
+ } SolidMember;
+ 
+ typedef struct TextBuf {
+     char *data;
+     size_t len, cap;
+ } TextBuf;
+ 
+ #define MT_THRESHOLD_DEFAULT ((int64_t)256 << 20)
+ 
+ struct DedupStore;
+ struct ZstdDict;
+ struct VolumeShipper;
+ 
+ // --resume checkpoint state; journal lines wait in pending until the archive data they describe is on disk
+ typedef struct Journal {
+     wchar_t path[PATH_MAX_LEN];           // <archive>.journal, empty without --resume
+     HANDLE h;                             // created at the first checkpoint, INVALID_HANDLE_VALUE = checkpoints off
+     char *pending;
+     size_t len, cap;
+     int64_t flushed;                      // archive size at the last checkpoint
+     ULONGLONG tick;                       // time of the last checkpoint
+ } Journal;
+ 
+ // Per-archive writer state
+ typedef struct ZipOutput {
+     void *zip;
+     void *stream;                         // AsyncStream under --direct-io or --resume, SinkStream when
+                                           // streaming, NULL otherwise
+     void *traced;                         // buffered output with write timing under --stats/--trace
+     const ArchiveOptions *opt;
+     wchar_t path[PATH_MAX_LEN];
+     wchar_t manifest_path[PATH_MAX_LEN];  // empty unless incremental
+     Manifest prev;                        // manifest of the previous run
+     Manifest next;                        // manifest of this run
+     wchar_t prev_path[PATH_MAX_LEN];      // previous archive moved aside, empty if none
+     void *prev_reader;
+     void *prev_zip;                       // mz_zip handle of prev_reader
+     int copied;                           // unchanged entries copied from prev
+     struct DedupStore *dedup;             // --dedup chunk store, NULL otherwise
+     Progress *progress;                   // NULL when quiet
+     bool skipped;                         // a file could not be opened and is missing from next
+     bool broken;                          // an entry was left half written, the run is abandoned
+     struct ZstdDict *dict;                // --dict dictionary or the previous archive's, NULL otherwise
+     Journal journal;
+     struct VolumeShipper *volumes;        // --volume-size background flusher, NULL otherwise
+ } ZipOutput;
+ 
+ // Archive writer (main.c)
+ bool zip_open_output(ZipOutput *out, const wchar_t *zip_path_w, const wchar_t *manifest_path,
+                      const ArchiveOptions *opt);
+ void zip_add_list(ZipOutput *out, const EntryList *list);
+ void zip_close_output(ZipOutput *out, int count);
+ 
+ // Walk, read and decode helpers (main.c)
+ HANDLE find_first(const wchar_t *dir, WIN32_FIND_DATAW *ffd);
+ void collect_entries(const wchar_t *base_dir, const wchar_t *curr_dir, EntryList *list, int32_t prefix);
+ void list_free(EntryList *list);
+ BOOL io_read(HANDLE h, void *buf, DWORD len, DWORD *got);
+ uint32_t crc32_update(uint32_t crc, const uint8_t *buf, int32_t size);
+ bool crc_clmul_supported(void);
+ void stream_chain_delete(void **stream);
+ void volume_path(const wchar_t *zip_path, int n, wchar_t *out);
+ void make_parent_dirs(wchar_t *path);
+ void text_append(TextBuf *t, const char *s, size_t len);
+ uint32_t get_u32(const uint8_t *p);
+ const uint8_t *extra_find(const mz_zip_file *fi, uint16_t id, uint16_t *len);
+ uint8_t *dict_read(void *zip, size_t *len);
+ bool dict_marked(const mz_zip_file *fi);
+ bool dict_extract(void *zip, const ZSTD_DDict *ddict, ZSTD_DCtx *dctx, HANDLE h);
+ int dedup_extract(const wchar_t *zip_path, const wchar_t *dest);
+ 
+ // Streamed output (sink.c)
+ bool sink_target(const wchar_t *path);
+ bool sink_stdout_claim(void);
+ void *sink_create(void);
+ 
+ // Reading archives back: --restore, --verify, --get, --range and the .idx sidecar (restore.c)
+ int restore_archive(const wchar_t *zip_path, const wchar_t *dest, int threads);
+ int verify_archive(const wchar_t *zip_path, const wchar_t *manifest_path, int threads);
+ int get_entry(const wchar_t *zip_path, const wchar_t *entry, const wchar_t *out_path);
+ int range_entry(const wchar_t *zip_path, const wchar_t *entry, int64_t offset, int64_t length,
+                 const wchar_t *out_path);
+ bool index_write(const wchar_t *zip_path);
+ bool restore_name_safe(const char *name);
+ bool read_at(HANDLE h, int64_t offset, void *buf, DWORD len);
+ 
+ // --snapshot (snapshot.c)
+ typedef struct Snapshot {
+     wchar_t volume[PATH_MAX_LEN];   // mount point of the original volume, e.g. "C:\\"
+     wchar_t device[PATH_MAX_LEN];   // \\?\GLOBALROOT\Device\HarddiskVolumeShadowCopyN
+     wchar_t id[64];                 // ShadowID, used to delete the copy afterwards
+ } Snapshot;
+ 
+ typedef struct SnapshotSet {
+     IWbemServices *svc;
+     Snapshot *items;
+     int count;
+     bool com;
+ } SnapshotSet;
+ 
+ void snapshot_links(SnapshotSet *set, LinkTarget *links, int count);
+ void snapshot_release(SnapshotSet *set);
+ 
+ // Benchmark harness (bench.c, -DARCHIVER_BENCH builds only)
+ int bench_main(int argc, wchar_t *argv[]);
+ 
+ #endif
@@ -0,0 +1,256 @@
+ // Benchmark harness (bench_archiver): every method/level/thread run in a child process, JSON on stdout
+ #include "archiver.h"
+ #include <psapi.h>
+ 
+ typedef struct BenchCorpus {
+     const wchar_t *name;
+     int files;
+     int64_t min_size, max_size;
+     int random_percent;  // share of incompressible files
+ } BenchCorpus;
+ 
+ static const BenchCorpus bench_corpora[] = {
+     { L"tiny",  20000, 256,              4 << 10,          10 },
+     { L"mixed", 200,   64 << 10,         8 << 20,          50 },
+     { L"huge",  2,     (int64_t)256 << 20, (int64_t)256 << 20, 50 },
+ };
+ 
+ static const struct { uint16_t method; int16_t level; } bench_codecs[] = {
+     { MZ_COMPRESS_METHOD_STORE, 0 },
+     { MZ_COMPRESS_METHOD_ZSTD, 1 },
+     { MZ_COMPRESS_METHOD_ZSTD, 3 },
+     { MZ_COMPRESS_METHOD_ZSTD, 9 },
+ };
+ 
+ static uint64_t bench_rand(uint64_t *state) {
+     uint64_t x = *state;
+     x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+     return *state = x;
+ }
+ 
+ // Text-like data from a small vocabulary, or raw random bytes
+ static void bench_fill(uint8_t *buf, size_t len, bool random, uint64_t *seed) {
+     static const char *words[] = { "backup ", "archive ", "profile ", "the ", "of ", "data ", "file ",
+                                    "config=", "true\n", "value;", "{ \"id\": ", "} ", "2024-01-01 ", "INFO " };
+     size_t i = 0;
+     if (random) {
+         for (; i + 8 <= len; i += 8) { uint64_t r = bench_rand(seed); memcpy(buf + i, &r, 8); }
+         for (; i < len; i++) buf[i] = (uint8_t)bench_rand(seed);
+         return;
+     }
+     while (i < len) {
+         const char *w = words[bench_rand(seed) % (sizeof(words) / sizeof(words[0]))];
+         for (; *w && i < len; w++) buf[i++] = (uint8_t)*w;
+     }
+ }
+ 
+ // --selftest: the carry-less multiply CRC against minizip-ng's table CRC, for every
+ // length up to a few blocks past 4 KB at every alignment, whole and chained
+ static int bench_selftest(void) {
+     enum { SELFTEST_LEN = 4096 + 256, SELFTEST_ALIGN = 16 };
+     uint8_t *buf = malloc(SELFTEST_LEN + SELFTEST_ALIGN);
+     if (!buf) return 1;
+     uint64_t seed = 0x2545F4914F6CDD1Dull;
+     bench_fill(buf, SELFTEST_LEN + SELFTEST_ALIGN, true, &seed);
+     int failures = 0;
+     for (int off = 0; off < SELFTEST_ALIGN; off++) {
+         const uint8_t *p = buf + off;
+         for (int len = 0; len <= SELFTEST_LEN; len++) {
+             uint32_t want = mz_crypt_crc32_update(0x12345678, p, len);
+             uint32_t whole = crc32_update(0x12345678, p, len);
+             // One odd split, then pieces of 67 bytes, each folded and with a table tail
+             int cut = len / 3;
+             uint32_t split = crc32_update(crc32_update(0x12345678, p, cut), p + cut, len - cut);
+             uint32_t pieces = 0x12345678;
+             for (int at = 0; at < len; at += 67) pieces = crc32_update(pieces, p + at, len - at < 67 ? len - at : 67);
+             if (whole == want && split == want && pieces == want) continue;
+             if (failures++ < 10) fwprintf(stderr, L"CRC mismatch: length %d at offset %d\n", len, off);
+         }
+     }
+     free(buf);
+ #if defined(CRC_CLMUL)
+     const char *kernel = crc_clmul_supported() ? "carry-less multiply" : "table, no PCLMULQDQ on this CPU";
+ #else
+     const char *kernel = "table, x86 only";
+ #endif
+     wprintf(L"CRC-32 self-test (%hs): %d mismatches\n", kernel, failures);
+     return failures ? 1 : 0;
+ }
+ 
+ // Delete a corpus tree, files and directories
+ static void bench_remove(const wchar_t *dir) {
+     WIN32_FIND_DATAW ffd;
+     HANDLE h = find_first(dir, &ffd);
+     if (h != INVALID_HANDLE_VALUE) {
+         do {
+             if (wcscmp(ffd.cFileName, L".") == 0 || wcscmp(ffd.cFileName, L"..") == 0) continue;
+             wchar_t path[PATH_MAX_LEN];
+             wsprintfW(path, L"%s\\%s", dir, ffd.cFileName);
+             if (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) bench_remove(path);
+             else DeleteFileW(path);
+         } while (FindNextFileW(h, &ffd));
+         FindClose(h);
+     }
+     RemoveDirectoryW(dir);
+ }
+ 
+ // A corpus is reused only if its marker says an earlier run wrote all of it
+ static bool bench_generate(const wchar_t *dir, const BenchCorpus *c, int scale) {
+     wchar_t marker[PATH_MAX_LEN];
+     wsprintfW(marker, L"%s.complete", dir);
+     if (GetFileAttributesW(marker) != INVALID_FILE_ATTRIBUTES && GetFileAttributesW(dir) != INVALID_FILE_ATTRIBUTES)
+         return true;
+     DeleteFileW(marker);
+     if (GetFileAttributesW(dir) != INVALID_FILE_ATTRIBUTES) bench_remove(dir);
+     if (!CreateDirectoryW(dir, NULL)) return false;
+     uint64_t seed = 0x9E3779B97F4A7C15ull ^ (uint64_t)c->files;
+     uint8_t *buf = malloc(READ_CHUNK);
+     int files = c->files * scale;
+     bool ok = buf != NULL;
+     for (int i = 0; i < files && ok; i++) {
+         wchar_t sub[PATH_MAX_LEN], path[PATH_MAX_LEN];
+         // spread files over directories like a real tree
+         wsprintfW(sub, L"%s\\d%03d", dir, i / 500);
+         CreateDirectoryW(sub, NULL);
+         wsprintfW(path, L"%s\\f%06d.dat", sub, i);
+         int64_t span = c->max_size - c->min_size;
+         int64_t size = c->min_size + (span > 0 ? (int64_t)(bench_rand(&seed) % (uint64_t)span) : 0);
+         bool random = (int)(bench_rand(&seed) % 100) < c->random_percent;
+         HANDLE h = CreateFileW(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+         ok = h != INVALID_HANDLE_VALUE;
+         for (int64_t left = size; ok && left > 0;) {
+             DWORD n = (DWORD)(left < READ_CHUNK ? left : READ_CHUNK), wrote = 0;
+             bench_fill(buf, n, random, &seed);
+             ok = WriteFile(h, buf, n, &wrote, NULL) && wrote == n;
+             left -= n;
+         }
+         if (h != INVALID_HANDLE_VALUE && !CloseHandle(h)) ok = false;
+     }
+     free(buf);
+     // A partial corpus would be measured by every later run, none is left behind
+     HANDLE m = ok ? CreateFileW(marker, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL)
+                   : INVALID_HANDLE_VALUE;
+     if (m != INVALID_HANDLE_VALUE) {
+         CloseHandle(m);
+         return true;
+     }
+     bench_remove(dir);
+     return false;
+ }
+ 
+ static double bench_now_ms(void) {
+     LARGE_INTEGER t, f;
+     QueryPerformanceCounter(&t);
+     QueryPerformanceFrequency(&f);
+     return (double)t.QuadPart * 1000.0 / (double)f.QuadPart;
+ }
+ 
+ // Child: one enumerate -> compress -> write cycle, prints one JSON object
+ static int bench_run(const wchar_t *corpus, uint16_t method, int16_t level, int threads) {
+     ArchiveOptions opt = { .threads = threads, .walkers = 1, .compress_method = method,
+                            .compress_level = level, .mt_threshold = MT_THRESHOLD_DEFAULT, .quiet = true };
+     wchar_t zip_path[PATH_MAX_LEN];
+     wsprintfW(zip_path, L"%s.bench.zip", corpus);
+ 
+     double t0 = bench_now_ms();
+     EntryList list = {0};
+     collect_entries(corpus, corpus, &list, -1);
+     double t1 = bench_now_ms();
+     ZipOutput out;
+     if (!zip_open_output(&out, zip_path, NULL, &opt)) return 1;
+     zip_add_list(&out, &list);
+     double t2 = bench_now_ms();
+     zip_close_output(&out, list.count);
+     double t3 = bench_now_ms();
+ 
+     // synthetic files are never empty, so size separates them from directories
+     int64_t in_bytes = 0;
+     int files = 0;
+     for (int i = 0; i < list.count; i++) {
+         if (list.items[i].size > 0) {
+             in_bytes += list.items[i].size;
+             files++;
+         }
+     }
+     WIN32_FILE_ATTRIBUTE_DATA fad;
+     int64_t out_bytes = 0;
+     if (GetFileAttributesExW(zip_path, GetFileExInfoStandard, &fad))
+         out_bytes = ((int64_t)fad.nFileSizeHigh << 32) | fad.nFileSizeLow;
+     DeleteFileW(zip_path);
+     PROCESS_MEMORY_COUNTERS pmc = { .cb = sizeof(pmc) };
+     GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc));
+ 
+     double total_s = (t3 - t0) / 1000.0;
+     const wchar_t *name = wcsrchr(corpus, L'\\');
+     char utf[PATH_MAX_LEN], corpus_utf[PATH_MAX_LEN * 6];
+     WideCharToMultiByte(CP_UTF8, 0, name ? name + 1 : corpus, -1, utf, PATH_MAX_LEN, NULL, NULL);
+     // A JSON string: quote, backslash and control characters escaped
+     size_t at = 0;
+     for (const unsigned char *p = (const unsigned char *)utf; *p; p++) {
+         if (*p == '"' || *p == '\\') at += sprintf(corpus_utf + at, "\\%c", *p);
+         else if (*p < 0x20) at += sprintf(corpus_utf + at, "\\u%04x", *p);
+         else corpus_utf[at++] = (char)*p;
+     }
+     corpus_utf[at] = '\0';
+     printf("{\"corpus\": \"%s\", \"method\": \"%s\", \"level\": %d, \"threads\": %d, "
+            "\"files\": %d, \"input_bytes\": %lld, \"output_bytes\": %lld, "
+            "\"enumerate_ms\": %.1f, \"compress_ms\": %.1f, \"write_ms\": %.1f, "
+            "\"files_per_s\": %.1f, \"mb_per_s\": %.2f, \"peak_rss_bytes\": %llu}",
+            corpus_utf, mz_zip_get_compression_method_string(method), level, threads,
+            files, (long long)in_bytes, (long long)out_bytes,
+            t1 - t0, t2 - t1, t3 - t2,
+            total_s > 0 ? files / total_s : 0.0, total_s > 0 ? in_bytes / 1048576.0 / total_s : 0.0,
+            (unsigned long long)pmc.PeakWorkingSetSize);
+     list_free(&list);
+     return 0;
+ }
+ 
+ int bench_main(int argc, wchar_t *argv[]) {
+     if (argc == 6 && wcscmp(argv[1], L"--run") == 0)
+         return bench_run(argv[2], (uint16_t)_wtoi(argv[3]), (int16_t)_wtoi(argv[4]), _wtoi(argv[5]));
+     if (argc == 2 && wcscmp(argv[1], L"--selftest") == 0) return bench_selftest();
+ 
+     wchar_t root[PATH_MAX_LEN];
+     GetTempPathW(PATH_MAX_LEN, root);
+     wcscat(root, L"archiver_bench");
+     int scale = 1;
+     for (int i = 1; i + 1 < argc; i += 2) {
+         if (wcscmp(argv[i], L"--root") == 0) wcscpy(root, argv[i + 1]);
+         else if (wcscmp(argv[i], L"--scale") == 0) scale = _wtoi(argv[i + 1]) > 0 ? _wtoi(argv[i + 1]) : 1;
+     }
+     CreateDirectoryW(root, NULL);
+     int cpus = (int)GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+     int thread_counts[] = { 1, 2, 4, cpus };
+     wchar_t self[PATH_MAX_LEN];
+     GetModuleFileNameW(NULL, self, PATH_MAX_LEN);
+ 
+     bool first = true;
+     printf("[\n");
+     for (size_t c = 0; c < sizeof(bench_corpora) / sizeof(bench_corpora[0]); c++) {
+         wchar_t dir[PATH_MAX_LEN];
+         wsprintfW(dir, L"%s\\%s_x%d", root, bench_corpora[c].name, scale);
+         if (!bench_generate(dir, &bench_corpora[c], scale)) {
+             fwprintf(stderr, L"Cannot generate corpus %s\n", dir);
+             continue;
+         }
+         for (size_t m = 0; m < sizeof(bench_codecs) / sizeof(bench_codecs[0]); m++) {
+             for (size_t t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); t++) {
+                 if (t == 3 && cpus <= 4) break;  // already covered
+                 wchar_t cmd[PATH_MAX_LEN * 2];
+                 wsprintfW(cmd, L"\"\"%s\" --run \"%s\" %d %d %d\"", self, dir,
+                           bench_codecs[m].method, bench_codecs[m].level, thread_counts[t]);
+                 FILE *child = _wpopen(cmd, L"r");
+                 if (!child) continue;
+                 char line[4096];
+                 if (fgets(line, sizeof(line), child)) {
+                     printf("%s  %s", first ? "" : ",\n", line);
+                     first = false;
+                 }
+                 _pclose(child);
+                 fflush(stdout);
+             }
+         }
+     }
+     printf("\n]\n");
+     return 0;
+ }
@@ -2,224 +2,4513 @@
  * backup_with_minizip_split.c
  *
  * Backup utility for Windows with optional split behavior:
- * - Resolves .lnk shortcuts via COM
+ * - Resolves .lnk shortcuts via COM, skipping links into a tree another link already covers
  * - Recursively collects files, preserves structure, metadata, Unicode filenames
  * - Creates a single ZIP or separate ZIPs per link via --split
  * - Excludes hidden, system files and desktop.ini
- * - Displays console progress with fixed-width percentages
+ * - Displays console progress (byte-weighted percentage, MB/s, ETA) from a reporter thread
+ * - Optional worker pool (--threads N) compressing entries in parallel
+ * - Optional streaming mode (--stream) overlapping enumeration and compression
+ * - Optional incremental mode (--incremental) reusing unchanged entries
+ * - Optional streamed output to stdout, a named pipe or a TCP/HTTP(S) endpoint
  *
  * Requirements:
  *  - Windows OS
  *  - GCC (MinGW-w64)
  *  - minizip-ng library with zstd, bcrypt
  *  - Link: -lminizip-ng -lzstd -lbcrypt -luuid -lshell32 -lshlwapi -lcomdlg32 -lole32 -loleaut32
+ *          -lws2_32 -lwinhttp
  *
  * Build:
- * gcc -std=c23 -o backup_with_minizip_split.exe main.c \
+ * gcc -std=c23 -o backup_with_minizip_split.exe main.c sink.c restore.c snapshot.c \
  *   -Iinclude -Llib \
  *   -lminizip-ng -lzstd -lbcrypt -luuid -lshell32 \
- *   -lshlwapi -lcomdlg32 -lole32 -loleaut32
+ *   -lshlwapi -lcomdlg32 -lole32 -loleaut32 -lws2_32 -lwinhttp
+ *
+ * Benchmark: same command with bench.c, -DARCHIVER_BENCH -o bench_archiver.exe and -lpsapi
  *
  * Usage:
  *  Single archive: backup_with_minizip_split.exe <source_folder> <output_zip>
  *  Split archives:  backup_with_minizip_split.exe --split <source_folder> <output_dir>
+ *  Streamed archive: <output_zip> is - (standard output, console messages go to stderr),
+ *                  \\.\pipe\<name>, tcp://<host>:<port> or http(s)://<url> (chunked PUT);
+ *                  nothing is staged on disk and no .idx is written
+ *  Options:
+ *   --threads N   compress with N worker threads (0 = one per logical CPU)
+ *   --stream      start compressing while the source trees are still being walked
+ *   --walkers N   enumerate directories with N threads (0 = one per logical CPU)
+ *   --adaptive    store already-compressed files, pick the zstd level by file size
+ *   --direct-io   write the archive unbuffered with overlapped I/O, bypassing the cache
+ *   --dedup       store content-defined chunks once, in a pack entry with an index
+ *   --dict        train a zstd dictionary on the small files, store it once and compress
+ *                 every file up to 64 KB against it
+ *   --solid       pack files up to 1 MB, grouped by extension, into shared 64 MB zstd blocks
+ *                 with a member index (--restore and --get read them)
+ *   --seekable    write files from 64 MB up as independent 4 MB zstd frames with a seek table
+ *                 (zstd seekable format), so --range decodes only the frames it needs
+ *   --resume      checkpoint the archive every 256 MB or minute; rerun after a crash or reboot,
+ *                 the checkpointed entries are copied from the interrupted archive
+ *   --volume-size MB
+ *                 write a spanned ZIP: <archive>.z01, .z02, ... of MB each and <archive> last;
+ *                 finished volumes are flushed to disk by a background thread
+ *   --volume-cmd <command>
+ *                 with --volume-size, also run <command> "<volume>" on every finished volume
+ *                 (e.g. an upload script); the writer goes on with the next volume meanwhile
+ *   --snapshot    read from VSS shadow copies of the source volumes (elevated prompt)
+ *   --stats       print per-phase span counts, bytes and latency percentiles at the end
+ *   --trace <file.json>
+ *                 also save every span as a Chrome trace event file (Perfetto, chrome://tracing)
+ *   --io-rate MB  read sources and write the archive at no more than MB per second in total
+ *   --background  read the sources at low I/O priority and run below normal CPU priority
+ *                 (with either option, I/O also slows down while source reads queue on the disk)
+ *   --no-index    do not write the <archive>.idx sidecar used by --get
+ *   --get <zip> <entry> <output_file>
+ *                 extract one entry, found by binary search in <archive>.idx
+ *   --range <zip> <entry> <offset> <length> <output_file>
+ *                 extract length bytes (0 = to the end) from offset of a --seekable entry,
+ *                 decoding the frames they touch in parallel
+ *   --restore <zip> <dest_dir>
+ *                 extract an archive in parallel (--threads N, default one per CPU)
+ *   --verify <zip> [<manifest>]
+ *                 decode every entry in parallel and check its CRC without writing anything;
+ *                 with a manifest, also check sizes and CRCs against it and that nothing is missing
+ *   --undedup <zip> <dest_dir>
+ *                 rebuild the files of a --dedup archive
+ *   --mt-threshold MB
+ *                 compress files from this size up with multithreaded zstd (default 256, 0 = off)
+ *   --jobs N      with --split, archive up to N links at once, biggest tree first
+ *   --volume-jobs N
+ *                 with --jobs, at most N links per source volume at a time (default 1)
+ *   --incremental <manifest>
+ *                 copy files unchanged since the last run (size + write time) from the
+ *                 previous archive; with --split <manifest> is a directory of per-link manifests
+ *   --usn         with --incremental, find the changes in the NTFS change journal instead of
+ *                 walking the trees (elevated prompt; the first run walks and records the position)
  */
 
- #include <windows.h>
- #include <shlobj.h>
- #include <shobjidl.h>
- #include <objbase.h>
- #include <shellapi.h>
- #include <stdio.h>
- #include <stdbool.h>
- #include <stdlib.h>
- #include <locale.h>
- 
- #include "mz.h"
- #include "mz_strm.h"
- #include "mz_strm_buf.h"
- #include "mz_strm_os.h"
- #include "mz_zip.h"
- #include "mz_zip_rw.h"
- 
- #define PATH_MAX_LEN 1024
- 
- typedef struct FileEntry {
-     wchar_t full[PATH_MAX_LEN];
-     wchar_t rel[PATH_MAX_LEN];
- } FileEntry;
+ #include "archiver.h"
+ 
+ // Files above this size are not buffered in memory by workers, they spill to a temp file
+ #define POOL_ENTRY_MAX ((int64_t)32 << 20)
+ // Streaming mode: entries per batch and batches buffered between walker and writer
+ #define STREAM_BATCH 4096
+ #define STREAM_DEPTH 8
+ 
+ // Append a string to the path pool, returns its offset
+ static size_t pool_add(EntryList *list, const wchar_t *str, size_t len) {
+     if (list->pool_len + len + 1 > list->pool_cap) {
+         size_t cap = list->pool_cap ? list->pool_cap : 64 * 1024;
+         while (list->pool_len + len + 1 > cap) cap *= 2;
+         list->pool = realloc(list->pool, cap * sizeof(wchar_t));
+         list->pool_cap = cap;
+     }
+     size_t off = list->pool_len;
+     wmemcpy(list->pool + off, str, len);
+     list->pool[off + len] = L'\0';
+     list->pool_len += len + 1;
+     return off;
+ }
+ 
+ // Append the UTF-8 form of a wide string to the name pool, returns its offset
+ static size_t names_add(EntryList *list, const wchar_t *str, size_t len) {
+     // 3 bytes per UTF-16 unit covers every code point, surrogate pairs included
+     if (list->names_len + len * 3 + 1 > list->names_cap) {
+         size_t cap = list->names_cap ? list->names_cap : 64 * 1024;
+         while (list->names_len + len * 3 + 1 > cap) cap *= 2;
+         list->names = realloc(list->names, cap);
+         list->names_cap = cap;
+     }
+     size_t off = list->names_len;
+     int n = len ? WideCharToMultiByte(CP_UTF8, 0, str, (int)len, list->names + off, (int)(len * 3), NULL, NULL) : 0;
+     list->names[off + n] = '\0';
+     list->names_len += n + 1;
+     return off;
+ }
+ 
+ // Register an archive folder name that prefixes the relative paths of following entries
+ static int32_t list_add_prefix(EntryList *list, const wchar_t *name) {
+     if (list->prefix_count >= list->prefix_cap) {
+         list->prefix_cap = list->prefix_cap ? list->prefix_cap * 2 : 16;
+         list->prefixes = realloc(list->prefixes, list->prefix_cap * sizeof(size_t));
+     }
+     list->prefixes[list->prefix_count] = pool_add(list, name, wcslen(name));
+     return list->prefix_count++;
+ }
+ 
+ void list_free(EntryList *list) {
+     free(list->items);
+     free(list->pool);
+     free(list->names);
+     free(list->prefixes);
+     memset(list, 0, sizeof(*list));
+ }
+ 
+ static inline const wchar_t *entry_full(const EntryList *list, const FileEntry *e) {
+     return list->pool + e->full;
+ }
+ 
+ // Build the in-archive relative name of an entry into out
+ static const wchar_t *entry_rel(const EntryList *list, const FileEntry *e, wchar_t *out) {
+     const wchar_t *rel = list->pool + e->full + e->rel;
+     if (e->prefix < 0) return rel;
+     wsprintfW(out, L"%s\\%s", list->pool + list->prefixes[e->prefix], rel);
+     return out;
+ }
+ 
+ static inline const char *entry_name(const EntryList *list, const FileEntry *e) {
+     return e->name == NO_NAME ? "" : list->names + e->name;
+ }
+ 
+ // --stats/--trace: per-phase latency histograms of the hot paths, plus Chrome trace events with --trace
+ #define TRACE_BUCKETS 48              // bucket b counts spans of 2^b up to 2^(b+1) ns
+ #define TRACE_MAX_EVENTS (1 << 20)
+ 
+ static const char *const trace_names[TRACE_PHASES] = {
+     "resolve_link", "walk", "dir_open", "compress", "entry", "output_write",
+ };
+ 
+ typedef struct TraceHist {
+     volatile LONG64 count, bytes, ticks, max;
+     volatile LONG64 buckets[TRACE_BUCKETS];
+ } TraceHist;
+ 
+ typedef struct TraceEvent {
+     int64_t start, ticks, bytes;
+     DWORD tid;
+     int phase;
+ } TraceEvent;
+ 
+ struct Trace {
+     double ns_per_tick;
+     int64_t origin;
+     TraceHist hist[TRACE_PHASES];
+     TraceEvent *events;               // --trace only
+     volatile LONG next_event;
+ };
+ 
+ Trace *tracer;
+ 
+ void trace_end(TracePhase phase, int64_t start, int64_t bytes) {
+     if (!tracer) return;
+     LARGE_INTEGER t;
+     QueryPerformanceCounter(&t);
+     int64_t ticks = t.QuadPart - start;
+     TraceHist *h = &tracer->hist[phase];
+     InterlockedIncrement64(&h->count);
+     InterlockedAdd64(&h->bytes, bytes);
+     InterlockedAdd64(&h->ticks, ticks);
+     uint64_t ns = (uint64_t)(ticks * tracer->ns_per_tick);
+     int b = ns ? 63 - __builtin_clzll(ns) : 0;
+     InterlockedIncrement64(&h->buckets[b < TRACE_BUCKETS ? b : TRACE_BUCKETS - 1]);
+     for (LONG64 m = h->max; ticks > m; m = h->max)
+         if (InterlockedCompareExchange64(&h->max, ticks, m) == m) break;
+     if (tracer->events) {
+         LONG i = InterlockedIncrement(&tracer->next_event) - 1;
+         if (i < TRACE_MAX_EVENTS)
+             tracer->events[i] = (TraceEvent){ start, ticks, bytes, GetCurrentThreadId(), phase };
+     }
+ }
+ 
+ static void trace_start(bool events) {
+     LARGE_INTEGER freq, now;
+     QueryPerformanceFrequency(&freq);
+     QueryPerformanceCounter(&now);
+     tracer = calloc(1, sizeof(Trace));
+     if (!tracer) return;
+     tracer->ns_per_tick = 1e9 / (double)freq.QuadPart;
+     tracer->origin = now.QuadPart;
+     if (events) tracer->events = malloc((size_t)TRACE_MAX_EVENTS * sizeof(TraceEvent));
+ }
+ 
+ // Upper bound of the bucket holding the given fraction of the spans, in microseconds
+ static double trace_percentile(const TraceHist *h, double fraction) {
+     LONG64 want = (LONG64)(h->count * fraction), seen = 0;
+     for (int b = 0; b < TRACE_BUCKETS; b++) {
+         seen += h->buckets[b];
+         if (seen > want) return (double)((uint64_t)2 << b) / 1000.0;
+     }
+     return (double)((uint64_t)1 << TRACE_BUCKETS) / 1000.0;
+ }
+ 
+ static void trace_report(void) {
+     wprintf(L"%-14s %10s %10s %10s %10s %10s %10s %10s\n", L"phase", L"count", L"total s", L"MB",
+             L"p50 us", L"p90 us", L"p99 us", L"max us");
+     for (int p = 0; p < TRACE_PHASES; p++) {
+         const TraceHist *h = &tracer->hist[p];
+         if (h->count == 0) continue;
+         wprintf(L"%-14hs %10lld %10.2f %10.1f %10.1f %10.1f %10.1f %10.1f\n", trace_names[p], (long long)h->count,
+                 h->ticks * tracer->ns_per_tick / 1e9, h->bytes / 1048576.0, trace_percentile(h, 0.50),
+                 trace_percentile(h, 0.90), trace_percentile(h, 0.99), h->max * tracer->ns_per_tick / 1000.0);
+     }
+ }
+ 
+ // Chrome trace event format, timestamps in microseconds from start
+ static bool trace_write(const wchar_t *path) {
+     FILE *f = _wfopen(path, L"wb");
+     if (!f) return false;
+     LONG count = tracer->next_event < TRACE_MAX_EVENTS ? tracer->next_event : TRACE_MAX_EVENTS;
+     double us = tracer->ns_per_tick / 1000.0;
+     fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+     for (LONG i = 0; i < count; i++) {
+         const TraceEvent *ev = &tracer->events[i];
+         fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%lu,\"ts\":%.3f,\"dur\":%.3f,"
+                 "\"args\":{\"bytes\":%lld}}\n", i ? "," : "", trace_names[ev->phase], (unsigned long)ev->tid,
+                 (ev->start - tracer->origin) * us, ev->ticks * us, (long long)ev->bytes);
+     }
+     fprintf(f, "]}\n");
+     if (tracer->next_event > TRACE_MAX_EVENTS)
+         fwprintf(stderr, L"Trace kept the first %d of %ld spans\n", TRACE_MAX_EVENTS, tracer->next_event);
+     return fclose(f) == 0;
+ }
+ 
+ // --io-rate/--background: a token bucket paces source reads and archive writes, its rate halves while
+ // source reads queue on the disk (LEDBAT style)
+ #define IO_TARGET_US 25000.0          // queueing delay tolerated above the floor, per MB read
+ #define IO_SAMPLE_MIN (256 << 10)     // shorter reads are mostly seek time, not sampled
+ #define IO_CUT_MS 200
+ #define IO_RATE_MIN (1 << 20)         // bytes per second the rate is never cut below
+ #define IO_STEP (256 << 10)           // added to the rate after each read near the floor
+ 
+ typedef struct IoGovernor {
+     SRWLOCK lock;
+     double ticks_per_sec;
+     double ceiling;                   // --io-rate in bytes per second, 0 = none
+     double rate;                      // current rate, 0 = unlimited
+     double tokens;                    // negative while callers owe
+     int64_t refill;                   // tick of the last refill
+     double floor_us;                  // per-MB latency of the fastest recent read
+     double recent_us;                 // smoothed per-MB read latency
+     int64_t last_cut;
+     int64_t window_start, window_bytes;
+     double throughput;                // bytes per second over the last full second
+     bool low_priority;                // --background
+     volatile LONG64 slept_ms;
+     volatile LONG cuts;
+ } IoGovernor;
+ 
+ static IoGovernor *governor;          // NULL unless --io-rate or --background
+ 
+ static inline int64_t io_now(void) {
+     LARGE_INTEGER t;
+     QueryPerformanceCounter(&t);
+     return t.QuadPart;
+ }
+ 
+ static void governor_start(int64_t rate, bool background) {
+     LARGE_INTEGER freq;
+     QueryPerformanceFrequency(&freq);
+     governor = calloc(1, sizeof(IoGovernor));
+     if (!governor) return;
+     InitializeSRWLock(&governor->lock);
+     governor->ticks_per_sec = (double)freq.QuadPart;
+     governor->ceiling = governor->rate = (double)rate;
+     governor->refill = governor->window_start = governor->last_cut = io_now();
+     governor->low_priority = background;
+     if (background) SetPriorityClass(GetCurrentProcess(), BELOW_NORMAL_PRIORITY_CLASS);
+ }
+ 
+ // Take bytes from the bucket, sleeping while the balance is negative
+ static void io_charge(int64_t bytes) {
+     IoGovernor *g = governor;
+     if (!g || bytes <= 0) return;
+     int64_t now = io_now();
+     DWORD wait = 0;
+     AcquireSRWLockExclusive(&g->lock);
+     double elapsed = (now - g->refill) / g->ticks_per_sec;
+     g->refill = now;
+     g->window_bytes += bytes;
+     if (now - g->window_start >= (int64_t)g->ticks_per_sec) {
+         g->throughput = g->window_bytes * g->ticks_per_sec / (double)(now - g->window_start);
+         g->window_start = now;
+         g->window_bytes = 0;
+     }
+     if (g->rate > 0) {
+         // A quarter second of burst, one chunk at the least
+         double burst = g->rate / 4 > READ_CHUNK ? g->rate / 4 : READ_CHUNK;
+         g->tokens += elapsed * g->rate;
+         if (g->tokens > burst) g->tokens = burst;
+         g->tokens -= bytes;
+         if (g->tokens < 0) wait = (DWORD)(-g->tokens * 1000 / g->rate);
+     }
+     ReleaseSRWLockExclusive(&g->lock);
+     if (wait) {
+         InterlockedAdd64(&g->slept_ms, wait);
+         Sleep(wait);
+     }
+ }
+ 
+ // Feed the latency of one source read to the rate
+ static void io_sample(int64_t start, int64_t end, DWORD len) {
+     IoGovernor *g = governor;
+     if (len < IO_SAMPLE_MIN) return;
+     double us = (end - start) * 1e6 / g->ticks_per_sec * READ_CHUNK / len;
+     AcquireSRWLockExclusive(&g->lock);
+     // The floor drifts up slowly, a cache-hot start does not pin it forever
+     g->floor_us = g->floor_us == 0 || us < g->floor_us ? us : g->floor_us + (us - g->floor_us) / 1024;
+     g->recent_us = g->recent_us == 0 ? us : g->recent_us * 0.875 + us * 0.125;
+     if (g->recent_us > g->floor_us + IO_TARGET_US) {
+         if ((end - g->last_cut) * 1000.0 >= IO_CUT_MS * g->ticks_per_sec) {
+             double from = g->rate;
+             if (from == 0)
+                 from = g->throughput > 0 ? g->throughput
+                                          : g->window_bytes * g->ticks_per_sec / (double)(end - g->window_start + 1);
+             g->rate = from / 2 > IO_RATE_MIN ? from / 2 : IO_RATE_MIN;
+             if (g->tokens > 0) g->tokens = 0;
+             g->last_cut = end;
+             InterlockedIncrement(&g->cuts);
+         }
+     } else if (g->rate > 0) {
+         g->rate += IO_STEP;
+         if (g->ceiling > 0 && g->rate > g->ceiling) g->rate = g->ceiling;
+         // Without --io-rate the limit goes once it is well above what the disk delivers
+         else if (g->ceiling == 0 && g->throughput > 0 && g->rate > 2 * g->throughput) g->rate = 0;
+     }
+     ReleaseSRWLockExclusive(&g->lock);
+ }
+ 
+ // ReadFile for the sources, timed and paced when the governor is on
+ BOOL io_read(HANDLE h, void *buf, DWORD len, DWORD *got) {
+     if (!governor) return ReadFile(h, buf, len, got, NULL);
+     int64_t start = io_now();
+     BOOL ok = ReadFile(h, buf, len, got, NULL);
+     if (ok) {
+         io_sample(start, io_now(), *got);
+         io_charge(*got);
+     }
+     return ok;
+ }
+ 
+ // Open a source file for reading, at low I/O priority under --background
+ static HANDLE source_open(const wchar_t *path, DWORD flags) {
+     HANDLE h = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                            NULL, OPEN_EXISTING, flags, NULL);
+     if (h != INVALID_HANDLE_VALUE && governor && governor->low_priority) {
+         FILE_IO_PRIORITY_HINT_INFO hint = { IoPriorityHintLow };
+         SetFileInformationByHandle(h, FileIoPriorityHintInfo, &hint, sizeof(hint));
+     }
+     return h;
+ }
+ 
+ static void governor_stop(void) {
+     if (!governor) return;
+     wprintf(L"I/O governor: paused %.1f s, rate lowered %ld times\n", governor->slept_ms / 1000.0, governor->cuts);
+     free(governor);
+     governor = NULL;
+ }
+ 
+ // Pass-through stream timing the writes that reach the OS file stream, the I/O governor charges them here
+ static int32_t trace_stream_open(void *stream, const char *path, int32_t mode) {
+     return mz_stream_open(((mz_stream *)stream)->base, path, mode);
+ }
+ 
+ static int32_t trace_stream_is_open(void *stream) {
+     return mz_stream_is_open(((mz_stream *)stream)->base);
+ }
+ 
+ static int32_t trace_stream_read(void *stream, void *buf, int32_t size) {
+     return mz_stream_read(((mz_stream *)stream)->base, buf, size);
+ }
+ 
+ static int32_t trace_stream_write(void *stream, const void *buf, int32_t size) {
+     int64_t start = trace_begin();
+     int32_t n = mz_stream_write(((mz_stream *)stream)->base, buf, size);
+     trace_end(TRACE_WRITE, start, n > 0 ? n : 0);
+     io_charge(n);
+     return n;
+ }
+ 
+ static int64_t trace_stream_tell(void *stream) {
+     return mz_stream_tell(((mz_stream *)stream)->base);
+ }
+ 
+ static int32_t trace_stream_seek(void *stream, int64_t offset, int32_t origin) {
+     return mz_stream_seek(((mz_stream *)stream)->base, offset, origin);
+ }
+ 
+ static int32_t trace_stream_close(void *stream) {
+     return mz_stream_close(((mz_stream *)stream)->base);
+ }
+ 
+ static int32_t trace_stream_error(void *stream) {
+     return mz_stream_error(((mz_stream *)stream)->base);
+ }
+ 
+ static int32_t trace_stream_get_prop(void *stream, int32_t prop, int64_t *value) {
+     return mz_stream_get_prop_int64(((mz_stream *)stream)->base, prop, value);
+ }
+ 
+ static int32_t trace_stream_set_prop(void *stream, int32_t prop, int64_t value) {
+     return mz_stream_set_prop_int64(((mz_stream *)stream)->base, prop, value);
+ }
+ 
+ static void *trace_stream_create(void);
+ 
+ static void trace_stream_destroy(void **stream) {
+     free(*stream);
+     *stream = NULL;
+ }
+ 
+ static mz_stream_vtbl trace_stream_vtbl = {
+     trace_stream_open, trace_stream_is_open, trace_stream_read, trace_stream_write, trace_stream_tell,
+     trace_stream_seek, trace_stream_close, trace_stream_error, trace_stream_create, trace_stream_destroy,
+     trace_stream_get_prop, trace_stream_set_prop,
+ };
+ 
+ static void *trace_stream_create(void) {
+     mz_stream *s = calloc(1, sizeof(*s));
+     if (s) s->vtbl = &trace_stream_vtbl;
+     return s;
+ }
+ 
+ // Delete a stack of streams from the top down, each layer through its own vtbl
+ void stream_chain_delete(void **stream) {
+     mz_stream *s = *stream;
+     while (s) {
+         mz_stream *base = s->base;
+         void *layer = s;
+         mz_stream_delete(&layer);
+         s = base;
+     }
+     *stream = NULL;
+ }
+ 
+ // The stack mz_zip_writer_open_file builds (split over buffered over file) with the timing
+ // layer under the buffer; returns the top stream or NULL
+ static void *trace_output_open(const char *path, int64_t disk_size) {
+     void *file = mz_stream_os_create();
+     void *timed = trace_stream_create();
+     void *buffered = mz_stream_buffered_create();
+     void *split = mz_stream_split_create();
+     if (file && timed && buffered && split) {
+         mz_stream_set_base(timed, file);
+         mz_stream_set_base(buffered, timed);
+         mz_stream_set_base(split, buffered);
+         mz_stream_set_prop_int64(split, MZ_STREAM_PROP_DISK_SIZE, disk_size);
+         if (mz_stream_open(split, path, MZ_OPEN_MODE_READWRITE | MZ_OPEN_MODE_CREATE) == MZ_OK) return split;
+     }
+     if (split) mz_stream_delete(&split);
+     if (buffered) mz_stream_delete(&buffered);
+     if (timed) mz_stream_delete(&timed);
+     if (file) mz_stream_delete(&file);
+     return NULL;
+ }
+ 
+ // Bounded batch queue between the directory walker and the archive writer, at most STREAM_DEPTH batches
+ typedef struct EntryQueue {
+     SRWLOCK lock;
+     CONDITION_VARIABLE not_empty;
+     CONDITION_VARIABLE not_full;
+     EntryList *slots[STREAM_DEPTH];
+     int head, count;
+     bool closed;
+ } EntryQueue;
+ 
+ static void queue_init(EntryQueue *q) {
+     memset(q, 0, sizeof(*q));
+     InitializeSRWLock(&q->lock);
+     InitializeConditionVariable(&q->not_empty);
+     InitializeConditionVariable(&q->not_full);
+ }
+ 
+ static void queue_push(EntryQueue *q, EntryList *batch) {
+     AcquireSRWLockExclusive(&q->lock);
+     while (q->count == STREAM_DEPTH)
+         SleepConditionVariableSRW(&q->not_full, &q->lock, INFINITE, 0);
+     q->slots[(q->head + q->count) % STREAM_DEPTH] = batch;
+     q->count++;
+     WakeConditionVariable(&q->not_empty);
+     ReleaseSRWLockExclusive(&q->lock);
+ }
+ 
+ // Returns NULL once the queue is closed and drained
+ static EntryList *queue_pop(EntryQueue *q) {
+     AcquireSRWLockExclusive(&q->lock);
+     while (q->count == 0 && !q->closed)
+         SleepConditionVariableSRW(&q->not_empty, &q->lock, INFINITE, 0);
+     EntryList *batch = NULL;
+     if (q->count > 0) {
+         batch = q->slots[q->head];
+         q->head = (q->head + 1) % STREAM_DEPTH;
+         q->count--;
+         WakeConditionVariable(&q->not_full);
+     }
+     ReleaseSRWLockExclusive(&q->lock);
+     return batch;
+ }
+ 
+ static void queue_close(EntryQueue *q) {
+     AcquireSRWLockExclusive(&q->lock);
+     q->closed = true;
+     WakeAllConditionVariable(&q->not_empty);
+     ReleaseSRWLockExclusive(&q->lock);
+ }
+ 
+ // Hand the collected entries to the queue and restart the list with the same prefixes
+ static void list_flush(EntryList *list) {
+     EntryQueue *q = list->queue;
+     EntryList *batch = malloc(sizeof(EntryList));
+     *batch = *list;
+     batch->queue = NULL;
+     memset(list, 0, sizeof(*list));
+     list->queue = q;
+     list->batch_limit = batch->batch_limit;
+     for (int i = 0; i < batch->prefix_count; i++)
+         list_add_prefix(list, batch->pool + batch->prefixes[i]);
+     queue_push(q, batch);
+ }
+ 
+ // Basic info level skips the 8.3 name lookup, large fetch batches the directory reads
+ HANDLE find_first(const wchar_t *dir, WIN32_FIND_DATAW *ffd) {
+     wchar_t pattern[PATH_MAX_LEN];
+     wsprintfW(pattern, L"%s\\*", dir);
+     int64_t start = trace_begin();
+     HANDLE h = FindFirstFileExW(pattern, FindExInfoBasic, ffd, FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+     trace_end(TRACE_DIR, start, 0);
+     return h;
+ }
+ 
+ // Filter one directory record and append it, full_path receives its path; NULL if excluded.
+ // Prefix folder names are looked up in names_from, which may be another list.
+ static FileEntry *list_append_found(EntryList *list, const EntryList *names_from, const wchar_t *base_dir,
+                                     size_t base_len, const wchar_t *curr_dir, const WIN32_FIND_DATAW *ffd,
+                                     int32_t prefix, wchar_t *full_path) {
+     // Skip . and ..
+     if (wcscmp(ffd->cFileName, L".") == 0 || wcscmp(ffd->cFileName, L"..") == 0)
+         return NULL;
+     // Skip hidden and system
+     if (ffd->dwFileAttributes & (FILE_ATTRIBUTE_HIDDEN | FILE_ATTRIBUTE_SYSTEM))
+         return NULL;
+     // Skip desktop.ini
+     if (_wcsicmp(ffd->cFileName, L"desktop.ini") == 0)
+         return NULL;
+     int full_len = wsprintfW(full_path, L"%s\\%s", curr_dir, ffd->cFileName);
+     // resize array if needed
+     if (list->count >= list->cap) {
+         list->cap = list->cap ? list->cap * 2 : 16;
+         list->items = realloc(list->items, list->cap * sizeof(FileEntry));
+     }
+     FileEntry *e = &list->items[list->count++];
+     e->full = pool_add(list, full_path, full_len);
+     e->len = (uint16_t)full_len;
+     // relative path is a suffix of the full path
+     if (wcsncmp(full_path, base_dir, base_len) == 0 && full_path[base_len] == L'\\')
+         e->rel = (uint16_t)(base_len + 1);
+     else
+         e->rel = (uint16_t)(full_len - wcslen(ffd->cFileName));
+     e->prefix = prefix;
+     e->attr = ffd->dwFileAttributes;
+     e->size = ((int64_t)ffd->nFileSizeHigh << 32) | ffd->nFileSizeLow;
+     e->mtime = ((uint64_t)ffd->ftLastWriteTime.dwHighDateTime << 32) | ffd->ftLastWriteTime.dwLowDateTime;
+     e->atime = ((uint64_t)ffd->ftLastAccessTime.dwHighDateTime << 32) | ffd->ftLastAccessTime.dwLowDateTime;
+     e->ctime = ((uint64_t)ffd->ftCreationTime.dwHighDateTime << 32) | ffd->ftCreationTime.dwLowDateTime;
+     // Directories are walked, not archived, so only files get an archive name
+     e->name = NO_NAME;
+     if (!(e->attr & FILE_ATTRIBUTE_DIRECTORY)) {
+         const wchar_t *rel = full_path + e->rel;
+         if (prefix >= 0) {
+             wchar_t name[PATH_MAX_LEN];
+             int name_len = wsprintfW(name, L"%s\\%s", names_from->pool + names_from->prefixes[prefix], rel);
+             e->name = names_add(list, name, name_len);
+         } else {
+             e->name = names_add(list, rel, full_len - e->rel);
+         }
+     }
+     return e;
+ }
+ 
+ // Recursively collect file paths under base_dir, excluding hidden/system and desktop.ini
+ void collect_entries(const wchar_t *base_dir, const wchar_t *curr_dir, EntryList *list, int32_t prefix) {
+     WIN32_FIND_DATAW ffd;
+     HANDLE hFind = find_first(curr_dir, &ffd);
+     if (hFind == INVALID_HANDLE_VALUE) return;
+     size_t base_len = wcslen(base_dir);
+     do {
+         wchar_t full_path[PATH_MAX_LEN];
+         if (!list_append_found(list, list, base_dir, base_len, curr_dir, &ffd, prefix, full_path))
+             continue;
+         if (list->queue && list->count >= list->batch_limit)
+             list_flush(list);
+         if (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+             collect_entries(base_dir, full_path, list, prefix);
+     } while (FindNextFileW(hFind, &ffd));
+     FindClose(hFind);
+ }
+ 
+ // Parallel directory walk: per-walker deques popped LIFO, idle walkers steal the oldest task, results sorted
+ typedef struct WalkTask {
+     wchar_t *dir;
+     const wchar_t *base;
+     int32_t prefix;
+ } WalkTask;
+ 
+ typedef struct WalkDeque {
+     SRWLOCK lock;
+     WalkTask *tasks;
+     int top, bottom, cap;  // live tasks are [top, bottom)
+ } WalkDeque;
+ 
+ typedef struct ParallelWalk {
+     int walkers;
+     WalkDeque *deques;
+     EntryList *lists;
+     const EntryList *out;   // holds the prefix folder names, not written during the walk
+     volatile LONG pending;  // tasks queued or running
+ } ParallelWalk;
+ 
+ typedef struct WalkerArg {
+     ParallelWalk *walk;
+     int id;
+ } WalkerArg;
+ 
+ static void walk_push(ParallelWalk *w, int id, const wchar_t *dir, const wchar_t *base, int32_t prefix) {
+     WalkDeque *d = &w->deques[id];
+     InterlockedIncrement(&w->pending);
+     AcquireSRWLockExclusive(&d->lock);
+     if (d->bottom >= d->cap) {
+         // compact before growing
+         int live = d->bottom - d->top;
+         memmove(d->tasks, d->tasks + d->top, live * sizeof(WalkTask));
+         d->top = 0;
+         d->bottom = live;
+         if (live >= d->cap) {
+             d->cap = d->cap ? d->cap * 2 : 64;
+             d->tasks = realloc(d->tasks, d->cap * sizeof(WalkTask));
+         }
+     }
+     d->tasks[d->bottom++] = (WalkTask){ _wcsdup(dir), base, prefix };
+     ReleaseSRWLockExclusive(&d->lock);
+ }
+ 
+ // Owner pops the newest task, thieves take the oldest
+ static bool walk_take(WalkDeque *d, bool steal, WalkTask *out) {
+     bool ok = false;
+     AcquireSRWLockExclusive(&d->lock);
+     if (d->bottom > d->top) {
+         *out = steal ? d->tasks[d->top++] : d->tasks[--d->bottom];
+         ok = true;
+     }
+     ReleaseSRWLockExclusive(&d->lock);
+     return ok;
+ }
+ 
+ static DWORD WINAPI walker_thread(LPVOID param) {
+     WalkerArg *arg = param;
+     ParallelWalk *w = arg->walk;
+     EntryList *list = &w->lists[arg->id];
+     int idle = 0;
+     for (;;) {
+         WalkTask task;
+         bool found = walk_take(&w->deques[arg->id], false, &task);
+         for (int k = 1; !found && k < w->walkers; k++)
+             found = walk_take(&w->deques[(arg->id + k) % w->walkers], true, &task);
+         if (!found) {
+             if (InterlockedCompareExchange(&w->pending, 0, 0) == 0) break;
+             Sleep(idle++ < 64 ? 0 : 1);
+             continue;
+         }
+         idle = 0;
+         WIN32_FIND_DATAW ffd;
+         HANDLE hFind = find_first(task.dir, &ffd);
+         if (hFind != INVALID_HANDLE_VALUE) {
+             size_t base_len = wcslen(task.base);
+             do {
+                 wchar_t full_path[PATH_MAX_LEN];
+                 if (list_append_found(list, w->out, task.base, base_len, task.dir, &ffd, task.prefix, full_path) &&
+                     (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+                     walk_push(w, arg->id, full_path, task.base, task.prefix);
+             } while (FindNextFileW(hFind, &ffd));
+             FindClose(hFind);
+         }
+         free(task.dir);
+         InterlockedDecrement(&w->pending);
+     }
+     return 0;
+ }
+ 
+ typedef struct SortItem {
+     const wchar_t *path;
+     FileEntry e;
+ } SortItem;
+ 
+ // Order by walk root, then path with '\\' below every other character so
+ // a directory's children directly follow it, like the serial depth-first walk
+ static int sort_item_cmp(const void *a, const void *b) {
+     const SortItem *x = a, *y = b;
+     if (x->e.prefix != y->e.prefix) return x->e.prefix < y->e.prefix ? -1 : 1;
+     const wchar_t *p = x->path, *q = y->path;
+     for (;; p++, q++) {
+         wchar_t c = *p == L'\\' ? 1 : towupper(*p);
+         wchar_t d = *q == L'\\' ? 1 : towupper(*q);
+         if (c != d) return c < d ? -1 : 1;
+         if (c == 0) return wcscmp(x->path, y->path);
+     }
+ }
+ 
+ // Walk several roots with N threads, appending the sorted result to out
+ static void collect_entries_parallel(const LinkTarget *roots, const int32_t *prefixes, int count,
+                                      EntryList *out, int walkers) {
+     ParallelWalk w = {0};
+     w.walkers = walkers;
+     w.out = out;
+     w.deques = calloc(walkers, sizeof(WalkDeque));
+     w.lists = calloc(walkers, sizeof(EntryList));
+     WalkerArg *args = calloc(walkers, sizeof(WalkerArg));
+     HANDLE *threads = calloc(walkers, sizeof(HANDLE));
+     for (int t = 0; t < walkers; t++) InitializeSRWLock(&w.deques[t].lock);
+     for (int i = 0; i < count; i++)
+         walk_push(&w, i % walkers, roots[i].target, roots[i].target, prefixes[i]);
+ 
+     int started = 0;
+     for (int t = 0; t < walkers; t++) {
+         args[t] = (WalkerArg){ &w, t };
+         threads[started] = CreateThread(NULL, 0, walker_thread, &args[t], 0, NULL);
+         if (threads[started]) started++;
+     }
+     // Without extra threads the calling thread drains every deque itself
+     if (started == 0) walker_thread(&args[0]);
+     WaitForMultipleObjects(started, threads, TRUE, INFINITE);
+     for (int t = 0; t < started; t++) CloseHandle(threads[t]);
+ 
+     // Concatenate the walker pools and shift their entries' offsets
+     int total = 0;
+     for (int t = 0; t < walkers; t++) total += w.lists[t].count;
+     SortItem *items = malloc((size_t)total * sizeof(SortItem) + 1);
+     int n = 0;
+     for (int t = 0; t < walkers; t++) {
+         EntryList *l = &w.lists[t];
+         if (l->count > 0) {
+             size_t base = pool_add(out, l->pool, l->pool_len - 1);
+             size_t names_base = out->names_len;
+             if (l->names_len > 0) {
+                 if (out->names_len + l->names_len > out->names_cap) {
+                     out->names_cap = out->names_len + l->names_len;
+                     out->names = realloc(out->names, out->names_cap);
+                 }
+                 memcpy(out->names + out->names_len, l->names, l->names_len);
+                 out->names_len += l->names_len;
+             }
+             for (int i = 0; i < l->count; i++) {
+                 items[n].e = l->items[i];
+                 items[n].e.full += base;
+                 if (items[n].e.name != NO_NAME) items[n].e.name += names_base;
+                 n++;
+             }
+         }
+         list_free(l);
+         free(w.deques[t].tasks);
+     }
+     for (int i = 0; i < n; i++) items[i].path = out->pool + items[i].e.full;
+     qsort(items, n, sizeof(SortItem), sort_item_cmp);
+     if (out->count + n > out->cap) {
+         out->cap = out->count + n;
+         out->items = realloc(out->items, out->cap * sizeof(FileEntry));
+     }
+     for (int i = 0; i < n; i++) out->items[out->count++] = items[i].e;
+     free(items);
+     free(threads);
+     free(args);
+     free(w.lists);
+     free(w.deques);
+ }
+ 
+ // Shortcut resolution on a few MTA threads, each reloading one IShellLinkW/IPersistFile pair per .lnk
+ #define LINK_PARALLEL_MIN 16   // below this, starting threads costs more than it saves
+ #define LINK_WORKERS_MAX 8
+ 
+ typedef struct LinkResolver {
+     IShellLinkW *psl;
+     IPersistFile *ppf;
+     bool com;                  // CoInitializeEx succeeded on this thread and is balanced on free
+ } LinkResolver;
+ 
+ static bool link_resolver_init(LinkResolver *r) {
+     memset(r, 0, sizeof(*r));
+     HRESULT hr = CoInitializeEx(NULL, COINIT_MULTITHREADED);
+     // A thread already in an STA works too, ShellLink lives in either apartment
+     if (SUCCEEDED(hr)) r->com = true;
+     else if (hr != RPC_E_CHANGED_MODE) return false;
+     hr = CoCreateInstance(&CLSID_ShellLink, NULL, CLSCTX_INPROC_SERVER, &IID_IShellLinkW, (void **)&r->psl);
+     if (SUCCEEDED(hr)) hr = r->psl->lpVtbl->QueryInterface(r->psl, &IID_IPersistFile, (void **)&r->ppf);
+     return SUCCEEDED(hr);
+ }
+ 
+ static void link_resolver_free(LinkResolver *r) {
+     if (r->ppf) r->ppf->lpVtbl->Release(r->ppf);
+     if (r->psl) r->psl->lpVtbl->Release(r->psl);
+     if (r->com) CoUninitialize();
+     memset(r, 0, sizeof(*r));
+ }
+ 
+ // Resolve .lnk shortcut to target path
+ static BOOL resolve_link(LinkResolver *r, LPCWSTR link_path, LPWSTR out_path, size_t max_len) {
+     HRESULT hr = r->ppf->lpVtbl->Load(r->ppf, link_path, STGM_READ);
+     if (SUCCEEDED(hr)) hr = r->psl->lpVtbl->GetPath(r->psl, out_path, (int)max_len, NULL, SLGP_RAWPATH);
+     return SUCCEEDED(hr);
+ }
+ 
+ // Shortcuts of one folder; name holds the .lnk file name until it is resolved
+ typedef struct LinkBatch {
+     const wchar_t *folder;
+     LinkTarget *links;
+     bool *resolved;
+     int count;
+     volatile LONG next;
+ } LinkBatch;
+ 
+ static void link_batch_run(LinkBatch *b) {
+     LinkResolver r;
+     if (link_resolver_init(&r)) {
+         LONG i;
+         while ((i = InterlockedIncrement(&b->next) - 1) < b->count) {
+             wchar_t link_path[PATH_MAX_LEN];
+             wsprintfW(link_path, L"%s\\%s", b->folder, b->links[i].name);
+             int64_t start = trace_begin();
+             b->resolved[i] = resolve_link(&r, link_path, b->links[i].target, PATH_MAX_LEN);
+             trace_end(TRACE_LINK, start, 0);
+         }
+     }
+     link_resolver_free(&r);
+ }
+ 
+ static DWORD WINAPI link_worker(LPVOID param) {
+     link_batch_run(param);
+     return 0;
+ }
+ 
+ // Same tree or inside it, ignoring case and a trailing backslash
+ static bool link_covers(const wchar_t *outer, const wchar_t *inner) {
+     size_t len = wcslen(outer);
+     if (len > 0 && outer[len - 1] == L'\\') len--;
+     return len > 0 && _wcsnicmp(outer, inner, len) == 0 && (inner[len] == L'\0' || inner[len] == L'\\');
+ }
+ 
+ // Convert a FILETIME to unix time for mz_zip_file dates
+ static time_t filetime_to_unix(uint64_t ft) {
+     time_t t = 0;
+     mz_zip_ntfs_to_unix_time(ft, &t);
+     return t;
+ }
+ 
+ // Describe an entry for the writer from what enumeration recorded
+ static void entry_file_info(const FileEntry *e, const char *name, uint16_t method, mz_zip_file *fi) {
+     memset(fi, 0, sizeof(*fi));
+     fi->version_madeby = MZ_VERSION_MADEBY;
+     fi->compression_method = method;
+     fi->flag = MZ_ZIP_FLAG_UTF8;
+     fi->filename = name;
+     fi->uncompressed_size = e->size;
+     fi->external_fa = e->attr;
+     fi->modified_date = filetime_to_unix(e->mtime);
+     fi->accessed_date = filetime_to_unix(e->atime);
+     fi->creation_date = filetime_to_unix(e->ctime);
+ }
+ 
+ static void writer_apply_options(void *zip, const ArchiveOptions *opt) {
+     mz_zip_writer_set_compress_method(zip, opt->compress_method);
+     mz_zip_writer_set_compress_level(zip, opt->compress_level);
+ }
+ 
+ // CRC-32 of entry data, folded 64 bytes at a time with PCLMULQDQ when the CPU has it, by table otherwise
+ #if defined(CRC_CLMUL)
+ // Bit-reflected fold constants for 0xEDB88320: x^(4*128+32), x^(4*128-32), x^(128+32), x^(128-32),
+ // x^64, then the polynomial and its Barrett constant
+ static const uint64_t crc_k1k2[2] __attribute__((aligned(16))) = { 0x0154442bd4, 0x01c6e41596 };
+ static const uint64_t crc_k3k4[2] __attribute__((aligned(16))) = { 0x01751997d0, 0x00ccaa009e };
+ static const uint64_t crc_k5k0[2] __attribute__((aligned(16))) = { 0x0163cd6124, 0x0000000000 };
+ static const uint64_t crc_poly[2] __attribute__((aligned(16))) = { 0x01db710641, 0x01f7011641 };
+ 
+ // len is at least 64 and a multiple of 16, crc is the inverted running value
+ __attribute__((target("pclmul,sse4.1")))
+ static uint32_t crc32_clmul(const uint8_t *buf, size_t len, uint32_t crc) {
+     __m128i x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+     __m128i x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+     __m128i x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+     __m128i x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+     x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+     __m128i k = _mm_load_si128((const __m128i *)crc_k1k2);
+     buf += 64;
+     len -= 64;
+     // Four independent lanes keep the multiplier busy
+     while (len >= 64) {
+         __m128i x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+         __m128i x6 = _mm_clmulepi64_si128(x2, k, 0x00);
+         __m128i x7 = _mm_clmulepi64_si128(x3, k, 0x00);
+         __m128i x8 = _mm_clmulepi64_si128(x4, k, 0x00);
+         x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+         x2 = _mm_clmulepi64_si128(x2, k, 0x11);
+         x3 = _mm_clmulepi64_si128(x3, k, 0x11);
+         x4 = _mm_clmulepi64_si128(x4, k, 0x11);
+         x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *)(buf + 0x00)));
+         x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *)(buf + 0x10)));
+         x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *)(buf + 0x20)));
+         x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *)(buf + 0x30)));
+         buf += 64;
+         len -= 64;
+     }
+     // Fold the lanes into one, then the remaining 16 byte blocks
+     k = _mm_load_si128((const __m128i *)crc_k3k4);
+     __m128i next[3] = { x2, x3, x4 };
+     for (int i = 0; i < 3; i++) {
+         __m128i lo = _mm_clmulepi64_si128(x1, k, 0x00);
+         x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k, 0x11), next[i]), lo);
+     }
+     for (; len >= 16; buf += 16, len -= 16) {
+         __m128i lo = _mm_clmulepi64_si128(x1, k, 0x00);
+         x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k, 0x11), _mm_loadu_si128((const __m128i *)buf)), lo);
+     }
+     // 128 bits to 64, then Barrett reduction to 32
+     __m128i mask = _mm_setr_epi32(~0, 0, ~0, 0);
+     x2 = _mm_clmulepi64_si128(x1, k, 0x10);
+     x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+     k = _mm_loadl_epi64((const __m128i *)crc_k5k0);
+     x2 = _mm_srli_si128(x1, 4);
+     x1 = _mm_xor_si128(_mm_clmulepi64_si128(_mm_and_si128(x1, mask), k, 0x00), x2);
+     k = _mm_load_si128((const __m128i *)crc_poly);
+     x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask), k, 0x10);
+     x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, mask), k, 0x00);
+     return (uint32_t)_mm_extract_epi32(_mm_xor_si128(x1, x2), 1);
+ }
+ 
+ bool crc_clmul_supported(void) {
+     static volatile LONG state;  // 0 = not checked yet, 1 = table, 2 = carry-less multiply
+     if (state == 0) {
+         unsigned a, b, c, d;
+         bool ok = __get_cpuid(1, &a, &b, &c, &d) && (c & bit_PCLMUL) && (c & bit_SSE4_1);
+         InterlockedExchange(&state, ok ? 2 : 1);
+     }
+     return state == 2;
+ }
+ #endif
+ 
+ // Drop-in for mz_crypt_crc32_update
+ uint32_t crc32_update(uint32_t crc, const uint8_t *buf, int32_t size) {
+ #if defined(CRC_CLMUL)
+     if (size >= 64 && crc_clmul_supported()) {
+         int32_t bulk = size & ~15;
+         crc = ~crc32_clmul(buf, (size_t)bulk, ~crc);
+         buf += bulk;
+         size -= bulk;
+     }
+ #endif
+     return size > 0 ? mz_crypt_crc32_update(crc, buf, size) : crc;
+ }
+ 
+ // Adaptive method selection: store what is already compressed or does not shrink, zstd levels drop with size
+ #define ADAPTIVE_SAMPLE (64 * 1024)
+ #define ADAPTIVE_MIN_SAMPLE 4096   // smaller files are cheap, just compress them
+ 
+ static const wchar_t *const compressed_exts[] = {
+     L"jpg", L"jpeg", L"png", L"gif", L"webp", L"heic", L"avif",
+     L"mp4", L"m4v", L"mkv", L"mov", L"avi", L"wmv", L"webm",
+     L"mp3", L"m4a", L"aac", L"ogg", L"opus", L"flac", L"wma",
+     L"zip", L"7z", L"rar", L"gz", L"tgz", L"bz2", L"xz", L"zst", L"lz4", L"cab", L"msi",
+     L"docx", L"xlsx", L"pptx", L"odt", L"jar", L"apk", L"nupkg", L"whl",
+ };
+ 
+ static bool has_compressed_ext(const wchar_t *path) {
+     const wchar_t *dot = wcsrchr(path, L'.');
+     if (!dot || wcschr(dot, L'\\')) return false;
+     for (size_t i = 0; i < sizeof(compressed_exts) / sizeof(compressed_exts[0]); i++)
+         if (_wcsicmp(dot + 1, compressed_exts[i]) == 0) return true;
+     return false;
+ }
+ 
+ // Compress the sample at zstd level 1, true if it saves at least 5%
+ static bool sample_compresses(const uint8_t *sample, int32_t len) {
+     void *mem = mz_stream_mem_create();
+     mz_stream_mem_set_grow_size(mem, len + 1024);
+     mz_stream_mem_open(mem, NULL, MZ_OPEN_MODE_CREATE);
+     void *zs = mz_stream_zstd_create();
+     mz_stream_set_base(zs, mem);
+     mz_stream_set_prop_int64(zs, MZ_STREAM_PROP_COMPRESS_LEVEL, 1);
+     bool ok = mz_stream_open(zs, NULL, MZ_OPEN_MODE_WRITE) == MZ_OK &&
+               mz_stream_write(zs, sample, len) == len && mz_stream_close(zs) == MZ_OK;
+     int32_t out_len = len;
+     mz_stream_mem_get_buffer_length(mem, &out_len);
+     mz_stream_zstd_delete(&zs);
+     mz_stream_mem_delete(&mem);
+     return !ok || (int64_t)out_len * 100 < (int64_t)len * 95;
+ }
+ 
+ // sample may be NULL when the caller has not read the file yet, it is then read here
+ static void choose_method(const ArchiveOptions *opt, const wchar_t *full, int64_t size,
+                           const uint8_t *sample, int32_t sample_len, uint16_t *method, int16_t *level) {
+     *method = opt->compress_method;
+     *level = opt->compress_level;
+     if (!opt->adaptive) return;
+     if (has_compressed_ext(full)) {
+         *method = MZ_COMPRESS_METHOD_STORE;
+         *level = 0;
+         return;
+     }
+     *method = MZ_COMPRESS_METHOD_ZSTD;
+     *level = size <= (1 << 20) ? 9 : size <= (64 << 20) ? 6 : 3;
+     if (size < ADAPTIVE_MIN_SAMPLE) return;
+     uint8_t *own = NULL;
+     if (!sample) {
+         HANDLE h = source_open(full, FILE_FLAG_SEQUENTIAL_SCAN);
+         if (h == INVALID_HANDLE_VALUE) return;
+         own = malloc(ADAPTIVE_SAMPLE);
+         DWORD got = 0;
+         if (own && io_read(h, own, ADAPTIVE_SAMPLE, &got)) sample_len = (int32_t)got;
+         else sample_len = 0;
+         CloseHandle(h);
+         sample = own;
+     }
+     if (sample_len > ADAPTIVE_SAMPLE) sample_len = ADAPTIVE_SAMPLE;
+     if (sample_len >= ADAPTIVE_MIN_SAMPLE && !sample_compresses(sample, sample_len)) {
+         *method = MZ_COMPRESS_METHOD_STORE;
+         *level = 0;
+     }
+     free(own);
+ }
+ 
+ // Incremental manifest: size, write time and CRC-32 per file; unchanged files are copied raw on the next run
+ #define MANIFEST_HEADER "# archiver manifest v1"
+ 
+ // Names match with \ and / as one separator: the walk's names (split on \ by --usn) are kept,
+ // minizip-ng writes / into the archive and recovery and the central directory read that back
+ static inline uint8_t name_char(char c) {
+     return c == '\\' ? '/' : (uint8_t)c;
+ }
+ 
+ static uint32_t name_hash(const char *s) {
+     uint32_t h = 2166136261u;
+     while (*s) h = (h ^ name_char(*s++)) * 16777619u;
+     return h;
+ }
+ 
+ static bool name_equal(const char *a, const char *b) {
+     while (*a && name_char(*a) == name_char(*b)) a++, b++;
+     return name_char(*a) == name_char(*b);
+ }
+ 
+ static void manifest_insert_slot(Manifest *m, int idx) {
+     uint32_t i = name_hash(m->names + m->items[idx].name) & (m->slot_cap - 1);
+     while (m->slots[i] >= 0) i = (i + 1) & (m->slot_cap - 1);
+     m->slots[i] = idx;
+ }
+ 
+ ManifestRecord *manifest_find(const Manifest *m, const char *name) {
+     if (m->slot_cap == 0) return NULL;
+     uint32_t i = name_hash(name) & (m->slot_cap - 1);
+     for (; m->slots[i] >= 0; i = (i + 1) & (m->slot_cap - 1)) {
+         ManifestRecord *r = &m->items[m->slots[i]];
+         if (name_equal(m->names + r->name, name)) return r;
+     }
+     return NULL;
+ }
+ 
+ static ManifestRecord *manifest_add(Manifest *m, const char *name, int64_t size, uint64_t mtime, uint32_t crc) {
+     if (m->count >= m->cap) {
+         m->cap = m->cap ? m->cap * 2 : 1024;
+         m->items = realloc(m->items, m->cap * sizeof(ManifestRecord));
+     }
+     // keep the table at most half full
+     if ((m->count + 1) * 2 > m->slot_cap) {
+         free(m->slots);
+         m->slot_cap = m->slot_cap ? m->slot_cap * 2 : 2048;
+         m->slots = malloc(m->slot_cap * sizeof(int));
+         memset(m->slots, 0xff, m->slot_cap * sizeof(int));
+         for (int i = 0; i < m->count; i++) manifest_insert_slot(m, i);
+     }
+     size_t len = strlen(name) + 1;
+     if (m->names_len + len > m->names_cap) {
+         m->names_cap = m->names_cap ? m->names_cap * 2 : 64 * 1024;
+         while (m->names_len + len > m->names_cap) m->names_cap *= 2;
+         m->names = realloc(m->names, m->names_cap);
+     }
+     memcpy(m->names + m->names_len, name, len);
+     ManifestRecord *r = &m->items[m->count];
+     *r = (ManifestRecord){ m->names_len, size, mtime, crc, -1, -1 };
+     m->names_len += len;
+     manifest_insert_slot(m, m->count++);
+     return r;
+ }
+ 
+ void manifest_free(Manifest *m) {
+     free(m->items);
+     free(m->names);
+     free(m->slots);
+     memset(m, 0, sizeof(*m));
+ }
+ 
+ bool manifest_load(Manifest *m, const wchar_t *path) {
+     FILE *f = _wfopen(path, L"rb");
+     if (!f) return false;
+     char line[PATH_MAX_LEN * 4];
+     bool ok = fgets(line, sizeof(line), f) && strncmp(line, MANIFEST_HEADER, strlen(MANIFEST_HEADER)) == 0;
+     while (ok && fgets(line, sizeof(line), f)) {
+         long long size;
+         unsigned long long mtime;
+         unsigned int crc;
+         int name_at = 0;
+         if (sscanf(line, "%lld\t%llu\t%x\t%n", &size, &mtime, &crc, &name_at) != 3 || name_at == 0)
+             continue;
+         line[strcspn(line, "\r\n")] = '\0';
+         manifest_add(m, line + name_at, size, mtime, crc);
+     }
+     fclose(f);
+     return ok;
+ }
+ 
+ static bool manifest_save(const Manifest *m, const wchar_t *path) {
+     FILE *f = _wfopen(path, L"wb");
+     if (!f) return false;
+     fprintf(f, "%s\n", MANIFEST_HEADER);
+     for (int i = 0; i < m->count; i++) {
+         const ManifestRecord *r = &m->items[i];
+         fprintf(f, "%lld\t%llu\t%08x\t%s\n", (long long)r->size, (unsigned long long)r->mtime,
+                 (unsigned int)r->crc, m->names + r->name);
+     }
+     return fclose(f) == 0;
+ }
+ 
+ // --usn: the changes since the last run come from the NTFS change journal, the links are walked whenever it
+ // cannot vouch for the manifest (first run, journal recreated or wrapped, no admin rights)
+ #define USN_STATE_HEADER "# archiver usn v1"
+ #define USN_READ_BUF (1 << 20)
+ 
+ typedef struct UsnVolume {
+     DWORD serial;
+     HANDLE volume;        // \\?\Volume{...} opened for FSCTL_READ_USN_JOURNAL
+     HANDLE hint;          // a directory on the volume, for OpenFileById
+     uint64_t journal_id;
+     int64_t next_usn;     // journal position before this run's discovery
+     int64_t first_usn;    // oldest record still in the journal
+     int64_t since;        // position recorded by the previous run, -1 if none
+ } UsnVolume;
+ 
+ // Directory paths relative to a link target, "" is the target itself
+ typedef struct UsnPaths {
+     wchar_t **items;
+     int count, cap;
+ } UsnPaths;
+ 
+ typedef struct UsnRoot {
+     int volume;
+     wchar_t path[PATH_MAX_LEN];   // target as a volume relative path without trailing '\\'
+     size_t path_len;
+     UsnPaths dirty;               // something inside changed: list its files again
+     UsnPaths fresh;               // created, renamed in or re-attributed: walk the subtree
+     UsnPaths gone;                // deleted or renamed away: drop the manifest entries below
+ } UsnRoot;
+ 
+ enum { USN_DIRTY, USN_FRESH, USN_GONE };
+ 
+ typedef struct UsnRef {
+     int volume;
+     int kind;
+     uint64_t frn;      // directory to resolve
+     wchar_t *name;     // USN_GONE: leaf name below frn
+ } UsnRef;
+ 
+ typedef struct UsnRefs {
+     UsnRef *items;
+     int count, cap;
+ } UsnRefs;
+ 
+ static void usn_paths_add(UsnPaths *s, const wchar_t *path) {
+     if (s->count >= s->cap) {
+         s->cap = s->cap ? s->cap * 2 : 64;
+         s->items = realloc(s->items, s->cap * sizeof(wchar_t *));
+     }
+     s->items[s->count++] = _wcsdup(path);
+ }
+ 
+ static int usn_path_cmp(const void *a, const void *b) {
+     return _wcsicmp(*(wchar_t *const *)a, *(wchar_t *const *)b);
+ }
+ 
+ static void usn_paths_sort(UsnPaths *s) {
+     qsort(s->items, s->count, sizeof(wchar_t *), usn_path_cmp);
+     int n = 0;
+     for (int i = 0; i < s->count; i++) {
+         if (n > 0 && _wcsicmp(s->items[n - 1], s->items[i]) == 0) free(s->items[i]);
+         else s->items[n++] = s->items[i];
+     }
+     s->count = n;
+ }
+ 
+ static bool usn_paths_has(const UsnPaths *s, const wchar_t *path) {
+     return s->count > 0 && bsearch(&path, s->items, s->count, sizeof(wchar_t *), usn_path_cmp) != NULL;
+ }
+ 
+ // The path itself or one of its parent directories is in the set
+ static bool usn_paths_covers(const UsnPaths *s, const wchar_t *path) {
+     if (s->count == 0) return false;
+     wchar_t buf[PATH_MAX_LEN];
+     wcscpy(buf, path);
+     for (;;) {
+         if (usn_paths_has(s, buf)) return true;
+         if (!buf[0]) return false;
+         wchar_t *cut = wcsrchr(buf, L'\\');
+         if (cut) *cut = L'\0';
+         else buf[0] = L'\0';
+     }
+ }
+ 
+ static void usn_paths_free(UsnPaths *s) {
+     for (int i = 0; i < s->count; i++) free(s->items[i]);
+     free(s->items);
+     memset(s, 0, sizeof(*s));
+ }
+ 
+ static void usn_ref_add(UsnRefs *refs, int volume, int kind, uint64_t frn, const wchar_t *name, size_t name_len) {
+     // Records of one file come in runs, one ref per run is enough
+     if (!name && refs->count > 0) {
+         const UsnRef *last = &refs->items[refs->count - 1];
+         if (last->volume == volume && last->kind == kind && last->frn == frn) return;
+     }
+     if (refs->count >= refs->cap) {
+         refs->cap = refs->cap ? refs->cap * 2 : 1024;
+         refs->items = realloc(refs->items, refs->cap * sizeof(UsnRef));
+     }
+     UsnRef *r = &refs->items[refs->count++];
+     *r = (UsnRef){ volume, kind, frn, NULL };
+     if (name) {
+         r->name = malloc((name_len + 1) * sizeof(wchar_t));
+         wmemcpy(r->name, name, name_len);
+         r->name[name_len] = L'\0';
+     }
+ }
+ 
+ static int usn_ref_cmp(const void *a, const void *b) {
+     const UsnRef *x = a, *y = b;
+     if (x->volume != y->volume) return x->volume < y->volume ? -1 : 1;
+     if (x->frn != y->frn) return x->frn < y->frn ? -1 : 1;
+     return x->kind - y->kind;
+ }
+ 
+ // Open the volume of a link target unless an earlier link shares it, returns its index or -1
+ static int usn_open_volume(UsnVolume *vols, int *count, const wchar_t *target, UsnRoot *root) {
+     HANDLE dir = CreateFileW(target, FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                              NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+     if (dir == INVALID_HANDLE_VALUE) return -1;
+     DWORD serial = 0;
+     DWORD n = GetFinalPathNameByHandleW(dir, root->path, PATH_MAX_LEN, FILE_NAME_NORMALIZED | VOLUME_NAME_NONE);
+     if (n == 0 || n >= PATH_MAX_LEN || !GetVolumeInformationByHandleW(dir, NULL, 0, &serial, NULL, NULL, NULL, 0)) {
+         CloseHandle(dir);
+         return -1;
+     }
+     root->path_len = n;
+     if (root->path[n - 1] == L'\\') root->path[--root->path_len] = L'\0';
+     for (int i = 0; i < *count; i++) {
+         if (vols[i].serial == serial) {
+             CloseHandle(dir);
+             return i;
+         }
+     }
+     // \\?\Volume{guid}\ without its trailing backslash opens the volume itself
+     wchar_t mount[PATH_MAX_LEN], name[64];
+     HANDLE volume = INVALID_HANDLE_VALUE;
+     if (GetVolumePathNameW(target, mount, PATH_MAX_LEN) && GetVolumeNameForVolumeMountPointW(mount, name, 64)) {
+         name[wcslen(name) - 1] = L'\0';
+         volume = CreateFileW(name, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+     }
+     USN_JOURNAL_DATA_V0 journal;
+     DWORD got = 0;
+     if (volume == INVALID_HANDLE_VALUE ||
+         !DeviceIoControl(volume, FSCTL_QUERY_USN_JOURNAL, NULL, 0, &journal, sizeof(journal), &got, NULL)) {
+         if (volume != INVALID_HANDLE_VALUE) CloseHandle(volume);
+         CloseHandle(dir);
+         return -1;
+     }
+     vols[*count] = (UsnVolume){ serial, volume, dir, journal.UsnJournalID, journal.NextUsn, journal.FirstUsn, -1 };
+     return (*count)++;
+ }
+ 
+ // Recorded positions of the previous run, volumes are matched by serial and journal id
+ static bool usn_state_load(UsnVolume *vols, int count, const wchar_t *path) {
+     FILE *f = _wfopen(path, L"rb");
+     if (!f) return false;
+     char line[128];
+     bool ok = fgets(line, sizeof(line), f) && strncmp(line, USN_STATE_HEADER, strlen(USN_STATE_HEADER)) == 0;
+     while (ok && fgets(line, sizeof(line), f)) {
+         unsigned long serial;
+         unsigned long long journal_id;
+         long long usn;
+         if (sscanf(line, "%lx\t%llx\t%lld", &serial, &journal_id, &usn) != 3) continue;
+         for (int i = 0; i < count; i++) {
+             if (vols[i].serial == serial && vols[i].journal_id == journal_id) vols[i].since = usn;
+         }
+     }
+     fclose(f);
+     return ok;
+ }
+ 
+ static bool usn_state_save(const UsnVolume *vols, int count, const wchar_t *path) {
+     FILE *f = _wfopen(path, L"wb");
+     if (!f) return false;
+     fprintf(f, "%s\n", USN_STATE_HEADER);
+     for (int i = 0; i < count; i++)
+         fprintf(f, "%08lx\t%llx\t%lld\n", (unsigned long)vols[i].serial, (unsigned long long)vols[i].journal_id,
+                 (long long)vols[i].next_usn);
+     return fclose(f) == 0;
+ }
+ 
+ // Collect the directories touched on one volume between the previous run and this one
+ static bool usn_read_volume(const UsnVolume *v, int index, UsnRefs *refs) {
+     READ_USN_JOURNAL_DATA_V0 rd = { v->since, 0xFFFFFFFF, 0, 0, 0, v->journal_id };
+     uint8_t *buf = malloc(USN_READ_BUF);
+     bool ok = true, done = false;
+     while (!done && rd.StartUsn < v->next_usn) {
+         DWORD got = 0;
+         if (!DeviceIoControl(v->volume, FSCTL_READ_USN_JOURNAL, &rd, sizeof(rd), buf, USN_READ_BUF, &got, NULL)) {
+             ok = false;
+             break;
+         }
+         if (got <= sizeof(USN)) break;
+         for (DWORD at = sizeof(USN); at < got && !done;) {
+             const USN_RECORD_V2 *rec = (const USN_RECORD_V2 *)(buf + at);
+             at += rec->RecordLength;
+             // Later records belong to the next run, which starts from next_usn
+             if (rec->Usn >= v->next_usn) {
+                 done = true;
+                 break;
+             }
+             if (rec->MajorVersion != 2) continue;
+             usn_ref_add(refs, index, USN_DIRTY, rec->ParentFileReferenceNumber, NULL, 0);
+             if (!(rec->FileAttributes & FILE_ATTRIBUTE_DIRECTORY)) continue;
+             if (rec->Reason & (USN_REASON_FILE_CREATE | USN_REASON_RENAME_NEW_NAME | USN_REASON_BASIC_INFO_CHANGE))
+                 usn_ref_add(refs, index, USN_FRESH, rec->FileReferenceNumber, NULL, 0);
+             if (rec->Reason & (USN_REASON_FILE_DELETE | USN_REASON_RENAME_OLD_NAME))
+                 usn_ref_add(refs, index, USN_GONE, rec->ParentFileReferenceNumber,
+                             (const wchar_t *)((const uint8_t *)rec + rec->FileNameOffset),
+                             rec->FileNameLength / sizeof(wchar_t));
+         }
+         rd.StartUsn = *(USN *)buf;
+     }
+     free(buf);
+     return ok;
+ }
+ 
+ // Current volume relative path of a file reference, false once it is deleted
+ static bool usn_resolve(const UsnVolume *v, uint64_t frn, wchar_t *out) {
+     FILE_ID_DESCRIPTOR id = { .dwSize = sizeof(id), .Type = FileIdType };
+     id.FileId.QuadPart = (LONGLONG)frn;
+     HANDLE h = OpenFileById(v->hint, &id, FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                             NULL, FILE_FLAG_BACKUP_SEMANTICS);
+     if (h == INVALID_HANDLE_VALUE) return false;
+     DWORD n = GetFinalPathNameByHandleW(h, out, PATH_MAX_LEN, FILE_NAME_NORMALIZED | VOLUME_NAME_NONE);
+     CloseHandle(h);
+     return n > 0 && n < PATH_MAX_LEN;
+ }
+ 
+ // Relative path of a volume path below a root, NULL when outside it
+ static const wchar_t *usn_below(const UsnRoot *r, const wchar_t *path) {
+     if (_wcsnicmp(path, r->path, r->path_len) != 0) return NULL;
+     if (path[r->path_len] == L'\0') return path + r->path_len;
+     return path[r->path_len] == L'\\' ? path + r->path_len + 1 : NULL;
+ }
+ 
+ // The walk skips hidden and system directories, so every level below the target is checked
+ static bool usn_visible(const wchar_t *target, const wchar_t *rel) {
+     wchar_t path[PATH_MAX_LEN];
+     size_t n = wcslen(target);
+     wcscpy(path, target);
+     for (const wchar_t *p = rel; *p;) {
+         size_t len = wcscspn(p, L"\\");
+         path[n++] = L'\\';
+         wmemcpy(path + n, p, len);
+         n += len;
+         path[n] = L'\0';
+         DWORD attr = GetFileAttributesW(path);
+         if (attr == INVALID_FILE_ATTRIBUTES || (attr & (FILE_ATTRIBUTE_HIDDEN | FILE_ATTRIBUTE_SYSTEM))) return false;
+         p += len;
+         if (*p) p++;
+     }
+     return true;
+ }
+ 
+ // Entry for a file the journal shows untouched, taken from the manifest without touching the disk
+ static void list_append_known(EntryList *list, const wchar_t *target, const wchar_t *rel, const wchar_t *name,
+                               int32_t prefix, const ManifestRecord *r) {
+     wchar_t full[PATH_MAX_LEN];
+     int full_len = wsprintfW(full, L"%s\\%s", target, rel);
+     if (list->count >= list->cap) {
+         list->cap = list->cap ? list->cap * 2 : 16;
+         list->items = realloc(list->items, list->cap * sizeof(FileEntry));
+     }
+     FileEntry *e = &list->items[list->count++];
+     e->full = pool_add(list, full, full_len);
+     e->len = (uint16_t)full_len;
+     e->rel = (uint16_t)(wcslen(target) + 1);
+     e->prefix = prefix;
+     // Matches the manifest, so the entry is copied from the previous archive with its own metadata
+     e->attr = FILE_ATTRIBUTE_ARCHIVE;
+     e->size = r->size;
+     e->mtime = e->atime = e->ctime = r->mtime;
+     e->name = names_add(list, name, wcslen(name));
+ }
+ 
+ // Files of one changed directory, its subdirectories are covered by their own records
+ static void usn_list_dir(EntryList *list, const wchar_t *target, const wchar_t *rel, int32_t prefix) {
+     wchar_t dir[PATH_MAX_LEN];
+     if (rel[0]) wsprintfW(dir, L"%s\\%s", target, rel);
+     else wcscpy(dir, target);
+     WIN32_FIND_DATAW ffd;
+     HANDLE hFind = find_first(dir, &ffd);
+     if (hFind == INVALID_HANDLE_VALUE) return;
+     size_t base_len = wcslen(target);
+     do {
+         if (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) continue;
+         wchar_t full_path[PATH_MAX_LEN];
+         list_append_found(list, list, target, base_len, dir, &ffd, prefix, full_path);
+     } while (FindNextFileW(hFind, &ffd));
+     FindClose(hFind);
+ }
+ 
+ // Build the entry list of the links from the previous manifest and the change journal.
+ // Returns false, with the list untouched, when the links have to be walked instead.
+ static bool usn_collect(const LinkTarget *links, const int32_t *prefixes, int count, const wchar_t *manifest_path,
+                         const wchar_t *zip_path, EntryList *list, bool quiet) {
+     UsnRoot *roots = calloc(count, sizeof(UsnRoot));
+     UsnVolume *vols = calloc(count, sizeof(UsnVolume));
+     UsnRefs refs = {0};
+     Manifest prev = {0};
+     int vol_count = 0;
+     bool ok = true;
+     for (int i = 0; i < count && ok; i++) {
+         if ((roots[i].volume = usn_open_volume(vols, &vol_count, links[i].target, &roots[i])) < 0) {
+             fwprintf(stderr, L"No change journal for %s (NTFS and an elevated prompt needed), walking\n",
+                      links[i].target);
+             ok = false;
+         }
+     }
+     // The mark is promoted next to the manifest once this run's archive is complete
+     wchar_t state_path[PATH_MAX_LEN], next_path[PATH_MAX_LEN];
+     wsprintfW(state_path, L"%s.usn", manifest_path);
+     wsprintfW(next_path, L"%s.usn.next", manifest_path);
+     if (ok && !usn_state_save(vols, vol_count, next_path)) {
+         fwprintf(stderr, L"Cannot write %s\n", next_path);
+         ok = false;
+     }
+     if (ok) {
+         ok = usn_state_load(vols, vol_count, state_path) && manifest_load(&prev, manifest_path) &&
+              GetFileAttributesW(zip_path) != INVALID_FILE_ATTRIBUTES;
+         for (int v = 0; v < vol_count && ok; v++)
+             ok = vols[v].since >= vols[v].first_usn && vols[v].since <= vols[v].next_usn;
+         if (!ok && !quiet) wprintf(L"Change journal: no usable position from the last run, walking\n");
+     }
+     for (int v = 0; v < vol_count && ok; v++) {
+         if (!(ok = usn_read_volume(&vols[v], v, &refs)))
+             fwprintf(stderr, L"Cannot read the change journal, walking\n");
+     }
+ 
+     int changed = 0, known = 0;
+     if (ok) {
+         qsort(refs.items, refs.count, sizeof(UsnRef), usn_ref_cmp);
+         wchar_t path[PATH_MAX_LEN];
+         bool resolved = false;
+         for (int i = 0; i < refs.count; i++) {
+             const UsnRef *r = &refs.items[i];
+             // A directory that no longer exists has its own delete record further up
+             if (i == 0 || r->volume != r[-1].volume || r->frn != r[-1].frn)
+                 resolved = usn_resolve(&vols[r->volume], r->frn, path);
+             if (!resolved) continue;
+             wchar_t gone[PATH_MAX_LEN];
+             const wchar_t *full = path;
+             if (r->name) {
+                 wsprintfW(gone, L"%s\\%s", path, r->name);
+                 full = gone;
+             }
+             for (int k = 0; k < count; k++) {
+                 const wchar_t *rel;
+                 if (roots[k].volume != r->volume || (rel = usn_below(&roots[k], full)) == NULL) continue;
+                 usn_paths_add(r->kind == USN_DIRTY ? &roots[k].dirty : r->kind == USN_FRESH ? &roots[k].fresh
+                                                                                             : &roots[k].gone, rel);
+             }
+         }
+         for (int k = 0; k < count; k++) {
+             usn_paths_sort(&roots[k].dirty);
+             usn_paths_sort(&roots[k].fresh);
+             usn_paths_sort(&roots[k].gone);
+         }
+ 
+         // Unchanged directories: their files as the manifest knows them
+         for (int m = 0; m < prev.count; m++) {
+             const ManifestRecord *r = &prev.items[m];
+             wchar_t name[PATH_MAX_LEN], dir[PATH_MAX_LEN];
+             if (!MultiByteToWideChar(CP_UTF8, 0, prev.names + r->name, -1, name, PATH_MAX_LEN)) continue;
+             for (int k = 0; k < count; k++) {
+                 const wchar_t *rel = name;
+                 if (prefixes[k] >= 0) {
+                     const wchar_t *folder = list->pool + list->prefixes[prefixes[k]];
+                     size_t folder_len = wcslen(folder);
+                     if (_wcsnicmp(name, folder, folder_len) != 0 || name[folder_len] != L'\\') continue;
+                     rel += folder_len + 1;
+                 }
+                 const wchar_t *slash = wcsrchr(rel, L'\\');
+                 size_t dir_len = slash ? (size_t)(slash - rel) : 0;
+                 wmemcpy(dir, rel, dir_len);
+                 dir[dir_len] = L'\0';
+                 if (!usn_paths_has(&roots[k].dirty, dir) && !usn_paths_covers(&roots[k].fresh, dir) &&
+                     !usn_paths_covers(&roots[k].gone, dir)) {
+                     list_append_known(list, links[k].target, rel, name, prefixes[k], r);
+                     known++;
+                 }
+                 break;
+             }
+         }
+         // Changed directories are listed again, new and moved ones walked
+         for (int k = 0; k < count; k++) {
+             const UsnRoot *root = &roots[k];
+             for (int i = 0; i < root->dirty.count; i++) {
+                 const wchar_t *rel = root->dirty.items[i];
+                 if (usn_paths_covers(&root->fresh, rel) || !usn_visible(links[k].target, rel)) continue;
+                 usn_list_dir(list, links[k].target, rel, prefixes[k]);
+                 changed++;
+             }
+             for (int i = 0; i < root->fresh.count; i++) {
+                 const wchar_t *rel = root->fresh.items[i];
+                 // Skip subtrees a fresh parent's walk already covers
+                 if (rel[0]) {
+                     wchar_t parent[PATH_MAX_LEN];
+                     wcscpy(parent, rel);
+                     wchar_t *cut = wcsrchr(parent, L'\\');
+                     if (cut) *cut = L'\0';
+                     else parent[0] = L'\0';
+                     if (usn_paths_covers(&root->fresh, parent)) continue;
+                 }
+                 if (!usn_visible(links[k].target, rel)) continue;
+                 wchar_t dir[PATH_MAX_LEN];
+                 if (rel[0]) wsprintfW(dir, L"%s\\%s", links[k].target, rel);
+                 else wcscpy(dir, links[k].target);
+                 collect_entries(links[k].target, dir, list, prefixes[k]);
+                 changed++;
+             }
+         }
+         if (!quiet)
+             wprintf(L"Change journal: %d directories changed, %d entries taken from the manifest\n", changed, known);
+     }
+ 
+     for (int i = 0; i < refs.count; i++) free(refs.items[i].name);
+     free(refs.items);
+     for (int k = 0; k < count; k++) {
+         usn_paths_free(&roots[k].dirty);
+         usn_paths_free(&roots[k].fresh);
+         usn_paths_free(&roots[k].gone);
+     }
+     for (int v = 0; v < vol_count; v++) {
+         CloseHandle(vols[v].volume);
+         CloseHandle(vols[v].hint);
+     }
+     manifest_free(&prev);
+     free(vols);
+     free(roots);
+     return ok;
+ }
+ 
+ // Walk the link targets, with --usn read only what changed since the last run instead
+ static void collect_links(const LinkTarget *links, const int32_t *prefixes, int count, EntryList *list,
+                           const ArchiveOptions *opt, const wchar_t *manifest_path, const wchar_t *zip_path) {
+     if (opt->usn && manifest_path && count > 0 &&
+         usn_collect(links, prefixes, count, manifest_path, zip_path, list, opt->quiet))
+         return;
+     if (opt->walkers > 1 && count > 0) {
+         int64_t start = trace_begin();
+         collect_entries_parallel(links, prefixes, count, list, opt->walkers);
+         trace_end(TRACE_WALK, start, 0);
+     } else {
+         for (int i = 0; i < count; i++) {
+             int64_t start = trace_begin();
+             collect_entries(links[i].target, links[i].target, list, prefixes[i]);
+             trace_end(TRACE_WALK, start, 0);
+         }
+     }
+ }
+ 
+ // Unbuffered overlapped output stream over a ring of sector aligned buffers, writes behind it read-modify-write
+ #define ASYNC_BUF ((int32_t)4 << 20)
+ #define ASYNC_RING 3
+ #define ASYNC_SECTOR 4096          // covers both 512 and 4K sector disks
+ #define ASYNC_PATCH (ASYNC_SECTOR * 16)
+ 
+ typedef struct AsyncStream {
+     mz_stream stream;
+     HANDLE h;
+     uint8_t *ring[ASYNC_RING];
+     OVERLAPPED ov[ASYNC_RING];
+     bool busy[ASYNC_RING];
+     int cur;
+     int64_t cur_base;   // file offset of ring[cur], multiple of ASYNC_BUF
+     int32_t cur_fill;   // bytes of ring[cur] holding data
+     uint8_t *scratch;   // ASYNC_PATCH bytes for patches
+     int64_t pos;
+     int64_t size;
+     int32_t error;
+ } AsyncStream;
+ 
+ static bool async_wait(AsyncStream *as, int slot) {
+     if (!as->busy[slot]) return true;
+     as->busy[slot] = false;
+     DWORD done;
+     int64_t start = trace_begin();
+     if (!GetOverlappedResult(as->h, &as->ov[slot], &done, TRUE)) {
+         as->error = MZ_WRITE_ERROR;
+         return false;
+     }
+     trace_end(TRACE_WRITE, start, done);
+     return true;
+ }
+ 
+ static bool async_start(AsyncStream *as, int slot, bool write, void *buf, int64_t offset, int32_t len) {
+     OVERLAPPED *ov = &as->ov[slot];
+     HANDLE ev = ov->hEvent;
+     memset(ov, 0, sizeof(*ov));
+     ov->hEvent = ev;
+     ov->Offset = (DWORD)offset;
+     ov->OffsetHigh = (DWORD)(offset >> 32);
+     if (write) io_charge(len);
+     BOOL ok = write ? WriteFile(as->h, buf, len, NULL, ov) : ReadFile(as->h, buf, len, NULL, ov);
+     if (!ok && GetLastError() != ERROR_IO_PENDING) {
+         as->error = write ? MZ_WRITE_ERROR : MZ_READ_ERROR;
+         return false;
+     }
+     as->busy[slot] = true;
+     return true;
+ }
+ 
+ // Hand the full current buffer to the disk and wait for the oldest one to come back
+ static bool async_rotate(AsyncStream *as) {
+     if (!async_start(as, as->cur, true, as->ring[as->cur], as->cur_base, ASYNC_BUF)) return false;
+     as->cur = (as->cur + 1) % ASYNC_RING;
+     as->cur_base += ASYNC_BUF;
+     as->cur_fill = 0;
+     return async_wait(as, as->cur);
+ }
+ 
+ // Write below cur_base, all of it already handed to the disk
+ static bool async_patch(AsyncStream *as, int64_t at, const uint8_t *buf, int32_t len) {
+     for (int i = 0; i < ASYNC_RING; i++)
+         if (!async_wait(as, i)) return false;
+     while (len > 0) {
+         int64_t start = at & ~(int64_t)(ASYNC_SECTOR - 1);
+         int32_t n = len;
+         if (at + n > start + ASYNC_PATCH) n = (int32_t)(start + ASYNC_PATCH - at);
+         int32_t span = (int32_t)((at + n - start + ASYNC_SECTOR - 1) & ~(int64_t)(ASYNC_SECTOR - 1));
+         // The current slot is idle, borrow its event for the synchronous round trip
+         if (!async_start(as, as->cur, false, as->scratch, start, span) || !async_wait(as, as->cur)) return false;
+         memcpy(as->scratch + (at - start), buf, n);
+         if (!async_start(as, as->cur, true, as->scratch, start, span) || !async_wait(as, as->cur)) return false;
+         at += n;
+         buf += n;
+         len -= n;
+     }
+     return true;
+ }
+ 
+ static int32_t async_open(void *stream, const char *path, int32_t mode) {
+     AsyncStream *as = stream;
+     // Only fresh archives, reading and appending stay on mz_stream_os
+     if (!(mode & MZ_OPEN_MODE_CREATE) || (mode & MZ_OPEN_MODE_APPEND)) return MZ_SUPPORT_ERROR;
+     wchar_t wpath[PATH_MAX_LEN];
+     MultiByteToWideChar(CP_UTF8, 0, path, -1, wpath, PATH_MAX_LEN);
+     as->h = CreateFileW(wpath, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS,
+                         FILE_FLAG_OVERLAPPED | FILE_FLAG_NO_BUFFERING, NULL);
+     if (as->h == INVALID_HANDLE_VALUE) return MZ_OPEN_ERROR;
+     as->cur = 0;
+     as->cur_base = as->pos = as->size = 0;
+     as->cur_fill = 0;
+     as->error = MZ_OK;
+     return MZ_OK;
+ }
+ 
+ static int32_t async_is_open(void *stream) {
+     return ((AsyncStream *)stream)->h != INVALID_HANDLE_VALUE ? MZ_OK : MZ_OPEN_ERROR;
+ }
+ 
+ static int32_t async_read(void *stream, void *buf, int32_t size) {
+     return MZ_SUPPORT_ERROR;
+ }
+ 
+ static int32_t async_write(void *stream, const void *buf, int32_t size) {
+     AsyncStream *as = stream;
+     const uint8_t *src = buf;
+     if (as->error != MZ_OK) return as->error;
+     int32_t written = 0;
+     while (written < size) {
+         int32_t n = size - written;
+         if (as->pos < as->cur_base) {
+             if (as->pos + n > as->cur_base) n = (int32_t)(as->cur_base - as->pos);
+             if (!async_patch(as, as->pos, src + written, n)) return as->error;
+         } else {
+             int32_t off = (int32_t)(as->pos - as->cur_base);
+             if (n > ASYNC_BUF - off) n = ASYNC_BUF - off;
+             memcpy(as->ring[as->cur] + off, src + written, n);
+             if (off + n > as->cur_fill) as->cur_fill = off + n;
+             if (as->cur_fill == ASYNC_BUF && !async_rotate(as)) return as->error;
+         }
+         written += n;
+         as->pos += n;
+         if (as->pos > as->size) as->size = as->pos;
+     }
+     return written;
+ }
+ 
+ static int64_t async_tell(void *stream) {
+     return ((AsyncStream *)stream)->pos;
+ }
+ 
+ static int32_t async_seek(void *stream, int64_t offset, int32_t origin) {
+     AsyncStream *as = stream;
+     int64_t pos = origin == MZ_SEEK_SET ? offset : origin == MZ_SEEK_CUR ? as->pos + offset : as->size + offset;
+     // No holes, the zip writer only ever seeks back into what it wrote
+     if (pos < 0 || pos > as->size) return MZ_SEEK_ERROR;
+     as->pos = pos;
+     return MZ_OK;
+ }
+ 
+ static int32_t async_close(void *stream) {
+     AsyncStream *as = stream;
+     if (as->h == INVALID_HANDLE_VALUE) return MZ_OK;
+     if (as->error == MZ_OK && as->cur_fill > 0) {
+         // Unbuffered writes are whole sectors, the tail is trimmed below
+         int32_t len = (as->cur_fill + ASYNC_SECTOR - 1) & ~(ASYNC_SECTOR - 1);
+         memset(as->ring[as->cur] + as->cur_fill, 0, len - as->cur_fill);
+         async_start(as, as->cur, true, as->ring[as->cur], as->cur_base, len);
+     }
+     for (int i = 0; i < ASYNC_RING; i++)
+         async_wait(as, i);
+     int32_t err = as->error;
+     FILE_END_OF_FILE_INFO eof = { 0 };
+     eof.EndOfFile.QuadPart = as->size;
+     if (!SetFileInformationByHandle(as->h, FileEndOfFileInfo, &eof, sizeof(eof)) && err == MZ_OK)
+         err = MZ_CLOSE_ERROR;
+     CloseHandle(as->h);
+     as->h = INVALID_HANDLE_VALUE;
+     return err;
+ }
+ 
+ // Put everything written so far on disk. The current buffer goes out padded to whole
+ // sectors and stays current, it is written again once it fills.
+ static bool async_flush(void *stream) {
+     AsyncStream *as = stream;
+     if (as->error != MZ_OK) return false;
+     if (as->cur_fill > 0) {
+         int32_t len = (as->cur_fill + ASYNC_SECTOR - 1) & ~(ASYNC_SECTOR - 1);
+         memset(as->ring[as->cur] + as->cur_fill, 0, len - as->cur_fill);
+         if (!async_start(as, as->cur, true, as->ring[as->cur], as->cur_base, len)) return false;
+     }
+     for (int i = 0; i < ASYNC_RING; i++)
+         if (!async_wait(as, i)) return false;
+     if (!FlushFileBuffers(as->h)) as->error = MZ_WRITE_ERROR;
+     return as->error == MZ_OK;
+ }
+ 
+ static int32_t async_error(void *stream) {
+     return ((AsyncStream *)stream)->error;
+ }
+ 
+ static void async_destroy(void **stream) {
+     AsyncStream *as = *stream;
+     if (!as) return;
+     async_close(as);
+     for (int i = 0; i < ASYNC_RING; i++)
+         if (as->ov[i].hEvent) CloseHandle(as->ov[i].hEvent);
+     if (as->ring[0]) VirtualFree(as->ring[0], 0, MEM_RELEASE);
+     free(as);
+     *stream = NULL;
+ }
+ 
+ static int32_t async_get_prop(void *stream, int32_t prop, int64_t *value) {
+     return MZ_EXIST_ERROR;
+ }
+ 
+ static int32_t async_set_prop(void *stream, int32_t prop, int64_t value) {
+     return MZ_EXIST_ERROR;
+ }
+ 
+ static void *async_create(void);
+ 
+ static mz_stream_vtbl async_stream_vtbl = {
+     async_open, async_is_open, async_read, async_write, async_tell, async_seek,
+     async_close, async_error, async_create, async_destroy, async_get_prop, async_set_prop,
+ };
+ 
+ static void *async_create(void) {
+     AsyncStream *as = calloc(1, sizeof(*as));
+     if (!as) return NULL;
+     as->stream.vtbl = &async_stream_vtbl;
+     as->h = INVALID_HANDLE_VALUE;
+     // VirtualAlloc is page aligned, which satisfies the sector alignment of unbuffered I/O
+     uint8_t *mem = VirtualAlloc(NULL, (SIZE_T)ASYNC_BUF * ASYNC_RING + ASYNC_PATCH,
+                                 MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+     bool ok = mem != NULL;
+     for (int i = 0; i < ASYNC_RING; i++) {
+         as->ring[i] = mem ? mem + (SIZE_T)ASYNC_BUF * i : NULL;
+         as->ov[i].hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+         if (!as->ov[i].hEvent) ok = false;
+     }
+     as->scratch = mem ? mem + (SIZE_T)ASYNC_BUF * ASYNC_RING : NULL;
+     if (!ok) {
+         void *p = as;
+         async_destroy(&p);
+         return NULL;
+     }
+     return as;
+ }
+ 
+ // Console progress: the hot paths only bump counters, a reporter thread renders them a few times a second
+ static void progress_render(Progress *p, bool final) {
+     int64_t files = InterlockedCompareExchange64(&p->files_done, 0, 0);
+     int64_t done = InterlockedCompareExchange64(&p->bytes_in, 0, 0) +
+                    (final ? 0 : InterlockedCompareExchange64(&p->entry_pos, 0, 0));
+     int64_t written = InterlockedCompareExchange64(&p->bytes_out, 0, 0);
+     double secs = (GetTickCount64() - p->start) / 1000.0;
+     double rate = secs > 0 ? done / secs / (1 << 20) : 0;
+     wchar_t name[64];
+     AcquireSRWLockShared(&p->name_lock);
+     // Keep the tail of long names, it is the part that changes
+     size_t len = wcslen(p->name);
+     wcsncpy(name, p->name + (len > 48 ? len - 48 : 0), 63);
+     name[63] = L'\0';
+     ReleaseSRWLockShared(&p->name_lock);
+     // Restores have no archive growing, leave the output size out
+     wchar_t out[32] = L"";
+     if (written > 0) swprintf(out, 32, L", %.1f MB out", written / (double)(1 << 20));
+ 
+     if (p->bytes_total > 0) {
+         int pct = (int)(done * 100 / p->bytes_total);
+         if (pct > 100) pct = 100;
+         int64_t eta = rate > 0 && done < p->bytes_total ? (int64_t)((p->bytes_total - done) / (rate * (1 << 20))) : 0;
+         wprintf(L"[%3d%%] %lld/%lld files, %.1f MB/s%s, ETA %lld:%02lld:%02lld  %-48s\r", pct,
+                 (long long)files, (long long)p->files_total, rate, out,
+                 (long long)(eta / 3600), (long long)(eta / 60 % 60), (long long)(eta % 60), name);
+     } else {
+         wprintf(L"[%6lld] %.1f MB/s%s  %-48s\r", (long long)files, rate, out, name);
+     }
+ }
+ 
+ static DWORD WINAPI progress_thread(LPVOID param) {
+     Progress *p = param;
+     while (WaitForSingleObject(p->stop, PROGRESS_INTERVAL_MS) == WAIT_TIMEOUT)
+         progress_render(p, false);
+     return 0;
+ }
+ 
+ // NULL when the reporter cannot run; every progress_* call accepts NULL
+ Progress *progress_start(void) {
+     Progress *p = calloc(1, sizeof(*p));
+     if (!p) return NULL;
+     InitializeSRWLock(&p->name_lock);
+     p->start = GetTickCount64();
+     p->stop = CreateEventW(NULL, TRUE, FALSE, NULL);
+     p->thread = p->stop ? CreateThread(NULL, 0, progress_thread, p, 0, NULL) : NULL;
+     if (!p->thread) {
+         if (p->stop) CloseHandle(p->stop);
+         free(p);
+         return NULL;
+     }
+     return p;
+ }
+ 
+ void progress_stop(Progress **pp) {
+     Progress *p = *pp;
+     if (!p) return;
+     SetEvent(p->stop);
+     WaitForSingleObject(p->thread, INFINITE);
+     CloseHandle(p->thread);
+     CloseHandle(p->stop);
+     progress_render(p, true);
+     wprintf(L"\n");
+     free(p);
+     *pp = NULL;
+ }
+ 
+ void progress_begin(Progress *p, const wchar_t *name) {
+     if (!p) return;
+     AcquireSRWLockExclusive(&p->name_lock);
+     wcsncpy(p->name, name, PATH_MAX_LEN - 1);
+     ReleaseSRWLockExclusive(&p->name_lock);
+     InterlockedExchange64(&p->entry_pos, 0);
+ }
+ 
+ void progress_end(Progress *p, int64_t size, int64_t archive_size) {
+     if (!p) return;
+     InterlockedIncrement64(&p->files_done);
+     InterlockedAdd64(&p->bytes_in, size);
+     InterlockedExchange64(&p->entry_pos, 0);
+     InterlockedExchange64(&p->bytes_out, archive_size);
+ }
+ 
+ // Writer callback for entries it reads itself, position is the source offset
+ static int32_t progress_writer_cb(void *handle, void *userdata, mz_zip_file *file_info, int64_t position) {
+     progress_advance(userdata, position);
+     return MZ_OK;
+ }
+ 
+ static int64_t output_size(ZipOutput *out) {
+     void *zip = NULL, *stream = NULL;
+     mz_zip_writer_get_zip_handle(out->zip, &zip);
+     if (!zip || mz_zip_get_stream(zip, &stream) != MZ_OK || !stream) return 0;
+     // The split stream tells the position in the current volume
+     int64_t total = 0;
+     if (out->volumes && mz_stream_get_prop_int64(stream, MZ_STREAM_PROP_TOTAL_OUT, &total) == MZ_OK) return total;
+     return mz_stream_tell(stream);
+ }
+ 
+ // Record where each manifest entry sits in the previous archive's central directory
+ static bool prev_open(ZipOutput *out) {
+     char prevUtf[PATH_MAX_LEN];
+     WideCharToMultiByte(CP_UTF8, 0, out->prev_path, -1, prevUtf, PATH_MAX_LEN, NULL, NULL);
+     out->prev_reader = mz_zip_reader_create();
+     // An interrupted run left no central directory, rebuild it from the local headers
+     if (out->journal.path[0]) mz_zip_reader_set_recover(out->prev_reader, 1);
+     if (mz_zip_reader_open_file(out->prev_reader, prevUtf) != MZ_OK ||
+         mz_zip_reader_get_zip_handle(out->prev_reader, &out->prev_zip) != MZ_OK) {
+         mz_zip_reader_delete(&out->prev_reader);
+         out->prev_zip = NULL;
+         return false;
+     }
+     for (int32_t err = mz_zip_goto_first_entry(out->prev_zip); err == MZ_OK;
+          err = mz_zip_goto_next_entry(out->prev_zip)) {
+         mz_zip_file *fi = NULL;
+         if (mz_zip_entry_get_info(out->prev_zip, &fi) != MZ_OK) continue;
+         ManifestRecord *r = manifest_find(&out->prev, fi->filename);
+         // Journal records only vouch for the entry they were written for
+         if (r && (r->offset < 0 || (r->offset == fi->disk_offset && r->crc == fi->crc)))
+             r->cd_pos = mz_zip_get_entry(out->prev_zip);
+     }
+     return true;
+ }
+ 
+ // Unchanged since the previous run and still present in the previous archive
+ static const ManifestRecord *incremental_match(const ZipOutput *out, const FileEntry *e, const char *name) {
+     if (!out->prev_zip) return NULL;
+     const ManifestRecord *r = manifest_find(&out->prev, name);
+     if (!r || r->cd_pos < 0 || r->size != e->size || r->mtime != e->mtime) return NULL;
+     return r;
+ }
+ 
+ // Copy an entry's compressed bytes from the previous archive without recompressing
+ static int32_t copy_prev_entry(ZipOutput *out, const ManifestRecord *r) {
+     mz_zip_file *fi = NULL;
+     int32_t err = mz_zip_goto_entry(out->prev_zip, r->cd_pos);
+     if (err == MZ_OK) err = mz_zip_entry_get_info(out->prev_zip, &fi);
+     if (err == MZ_OK) err = mz_zip_entry_read_open(out->prev_zip, 1, NULL);
+     if (err != MZ_OK) return err;
+     mz_zip_writer_set_raw(out->zip, 1);
+     err = mz_zip_writer_entry_open(out->zip, fi);
+     bool opened = err == MZ_OK;
+     uint8_t buf[64 * 1024];
+     int32_t n = 0;
+     int64_t copied = 0;
+     while (err == MZ_OK && (n = mz_zip_entry_read(out->prev_zip, buf, sizeof(buf))) > 0) {
+         if (mz_zip_writer_entry_write(out->zip, buf, n) != n) err = MZ_WRITE_ERROR;
+         copied += n;
+     }
+     // Raw reads check no CRC, a short copy is only seen by its length
+     if (err == MZ_OK && (n < 0 || copied != fi->compressed_size)) err = MZ_READ_ERROR;
+     if (opened && mz_zip_writer_entry_close(out->zip) != MZ_OK && err == MZ_OK) err = MZ_CLOSE_ERROR;
+     mz_zip_writer_set_raw(out->zip, 0);
+     mz_zip_entry_close(out->prev_zip);
+     if (err == MZ_OK) {
+         out->copied++;
+     } else if (opened) {
+         // The closed entry is in the central directory and cannot be taken back, adding the
+         // file again would put a second entry of that name next to the broken one
+         fwprintf(stderr, L"Cannot copy %hs from the previous archive (%d)\n", fi->filename, err);
+         out->broken = true;
+     }
+     return err;
+ }
+ 
+ // --resume: checkpoints flush the archive and journal the entries finished since, a rerun copies them back
+ #define JOURNAL_HEADER "# archiver journal v1"
+ #define CHECKPOINT_BYTES ((int64_t)256 << 20)
+ #define CHECKPOINT_MS 60000
+ 
+ static bool journal_load(Manifest *m, const wchar_t *path) {
+     FILE *f = _wfopen(path, L"rb");
+     if (!f) return false;
+     char line[PATH_MAX_LEN * 4];
+     bool ok = fgets(line, sizeof(line), f) && strncmp(line, JOURNAL_HEADER, strlen(JOURNAL_HEADER)) == 0;
+     while (ok && fgets(line, sizeof(line), f)) {
+         long long offset, size;
+         unsigned long long mtime;
+         unsigned int crc;
+         int name_at = 0;
+         // A line cut short by the crash has no newline
+         size_t len = strcspn(line, "\r\n");
+         if (line[len] == '\0') break;
+         line[len] = '\0';
+         if (sscanf(line, "%lld\t%lld\t%llu\t%x\t%n", &offset, &size, &mtime, &crc, &name_at) != 4 || name_at == 0)
+             continue;
+         manifest_add(m, line + name_at, size, mtime, crc)->offset = offset;
+     }
+     fclose(f);
+     return ok;
+ }
+ 
+ // Put the archive written so far on disk, then the journal lines describing it
+ static void journal_checkpoint(ZipOutput *out) {
+     Journal *j = &out->journal;
+     j->flushed = output_size(out);
+     j->tick = GetTickCount64();
+     DWORD done = 0;
+     bool ok = async_flush(out->stream);
+     if (ok && !j->h) {
+         j->h = CreateFileW(j->path, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, 0, NULL);
+         // sizeof counts the terminator, which is where the newline goes
+         ok = j->h != INVALID_HANDLE_VALUE && WriteFile(j->h, JOURNAL_HEADER "\n", sizeof(JOURNAL_HEADER), &done, NULL);
+     }
+     if (ok) ok = WriteFile(j->h, j->pending, (DWORD)j->len, &done, NULL) && done == j->len && FlushFileBuffers(j->h);
+     j->len = 0;
+     if (!ok) {
+         fwprintf(stderr, L"Cannot checkpoint %s, --resume will start over\n", out->path);
+         if (j->h && j->h != INVALID_HANDLE_VALUE) CloseHandle(j->h);
+         j->h = INVALID_HANDLE_VALUE;
+     }
+ }
+ 
+ // Journal the entry just written from start on, checkpoint when one is due
+ static void journal_note(ZipOutput *out, const FileEntry *e, const char *name, int64_t start) {
+     Journal *j = &out->journal;
+     if (!j->path[0] || j->h == INVALID_HANDLE_VALUE) return;
+     int64_t end = output_size(out);
+     if (end == start) return;
+     void *zip = NULL;
+     mz_zip_file *fi = NULL;
+     mz_zip_writer_get_zip_handle(out->zip, &zip);
+     uint32_t crc = zip && mz_zip_entry_get_info(zip, &fi) == MZ_OK ? fi->crc : 0;
+     char line[PATH_MAX_LEN * 4];
+     int n = snprintf(line, sizeof(line), "%lld\t%lld\t%llu\t%08x\t%s\n", (long long)start, (long long)e->size,
+                      (unsigned long long)e->mtime, (unsigned int)crc, name);
+     if (n <= 0 || n >= (int)sizeof(line)) return;
+     // The name as the local header holds it, recovery reads that one back
+     for (char *p = line + n - 1 - strlen(name); *p; p++) if (*p == '\\') *p = '/';
+     if (j->len + n > j->cap) {
+         j->cap = j->cap ? j->cap * 2 : 64 * 1024;
+         j->pending = realloc(j->pending, j->cap);
+     }
+     memcpy(j->pending + j->len, line, n);
+     j->len += n;
+     if (end - j->flushed >= CHECKPOINT_BYTES || GetTickCount64() - j->tick >= CHECKPOINT_MS)
+         journal_checkpoint(out);
+ }
+ 
+ // Pick up the interrupted run: the archive and its journal, or the pair a resumed
+ // run moved aside before dying ahead of its own first checkpoint
+ static void journal_resume(ZipOutput *out, const wchar_t *zip_path_w) {
+     wchar_t partial_journal[PATH_MAX_LEN];
+     wsprintfW(out->journal.path, L"%s.journal", zip_path_w);
+     wsprintfW(out->prev_path, L"%s.partial", zip_path_w);
+     wsprintfW(partial_journal, L"%s.partial.journal", zip_path_w);
+     if (journal_load(&out->prev, out->journal.path) && GetFileAttributesW(zip_path_w) != INVALID_FILE_ATTRIBUTES) {
+         if (!MoveFileExW(zip_path_w, out->prev_path, MOVEFILE_REPLACE_EXISTING)) out->prev_path[0] = L'\0';
+         else MoveFileExW(out->journal.path, partial_journal, MOVEFILE_REPLACE_EXISTING);
+     } else {
+         manifest_free(&out->prev);
+         if (!journal_load(&out->prev, partial_journal) || GetFileAttributesW(out->prev_path) == INVALID_FILE_ATTRIBUTES)
+             out->prev_path[0] = L'\0';
+     }
+     if (!out->prev_path[0] || out->prev.count == 0) return;
+     if (!prev_open(out))
+         fwprintf(stderr, L"Cannot read interrupted archive %s, starting over\n", out->prev_path);
+     else if (!out->opt->quiet)
+         wprintf(L"Resuming: %d checkpointed entries in %s\n", out->prev.count, out->prev_path);
+ }
+ 
+ // After a clean close the checkpoints are no longer needed, otherwise they stay for the next --resume
+ static void journal_finish(ZipOutput *out, bool complete) {
+     Journal *j = &out->journal;
+     if (j->h && j->h != INVALID_HANDLE_VALUE) CloseHandle(j->h);
+     free(j->pending);
+     if (complete) {
+         wchar_t partial_journal[PATH_MAX_LEN];
+         wsprintfW(partial_journal, L"%s.partial.journal", out->path);
+         DeleteFileW(j->path);
+         DeleteFileW(partial_journal);
+         if (out->prev_zip)
+             wprintf(L"Resumed: %d entries copied from the interrupted run\n", out->copied);
+     }
+ }
+ 
+ // --volume-size: spanned output, finished volumes are flushed and passed to --volume-cmd on a background thread
+ typedef struct VolumeShipper {
+     wchar_t zip_path[PATH_MAX_LEN];
+     const wchar_t *command;
+     SRWLOCK lock;
+     CONDITION_VARIABLE ready;
+     int queued;        // volumes .z01 up to .z<queued> are final
+     bool closing;      // the archive is closed, <archive> itself goes last
+     int failed;
+     HANDLE thread;
+ } VolumeShipper;
+ 
+ // Volume n (from 1) of a spanned archive: the extension becomes .zNN, as mz_stream_split names them
+ void volume_path(const wchar_t *zip_path, int n, wchar_t *out) {
+     wcscpy(out, zip_path);
+     wchar_t *dot = wcsrchr(out, L'.');
+     if (dot) wsprintfW(dot, L".z%02d", n);
+ }
+ 
+ static void volume_ship(VolumeShipper *v, const wchar_t *path) {
+     HANDLE h = CreateFileW(path, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+     bool ok = h != INVALID_HANDLE_VALUE && FlushFileBuffers(h);
+     if (h != INVALID_HANDLE_VALUE) CloseHandle(h);
+     if (!ok) {
+         fwprintf(stderr, L"Cannot flush volume %s\n", path);
+         v->failed++;
+         return;
+     }
+     if (!v->command) return;
+     wchar_t cmdline[PATH_MAX_LEN * 2 + 4];
+     wsprintfW(cmdline, L"%s \"%s\"", v->command, path);
+     STARTUPINFOW si = { .cb = sizeof(si) };
+     PROCESS_INFORMATION pi;
+     DWORD code = 1;
+     if (CreateProcessW(NULL, cmdline, NULL, NULL, FALSE, 0, NULL, NULL, &si, &pi)) {
+         WaitForSingleObject(pi.hProcess, INFINITE);
+         GetExitCodeProcess(pi.hProcess, &code);
+         CloseHandle(pi.hThread);
+         CloseHandle(pi.hProcess);
+     }
+     if (code != 0) {
+         fwprintf(stderr, L"Volume command failed (%lu) on %s\n", (unsigned long)code, path);
+         v->failed++;
+     }
+ }
+ 
+ static DWORD WINAPI volume_worker(LPVOID param) {
+     VolumeShipper *v = param;
+     int shipped = 0;
+     for (;;) {
+         AcquireSRWLockExclusive(&v->lock);
+         while (shipped == v->queued && !v->closing)
+             SleepConditionVariableSRW(&v->ready, &v->lock, INFINITE, 0);
+         int queued = v->queued;
+         bool closing = v->closing;
+         ReleaseSRWLockExclusive(&v->lock);
+         while (shipped < queued) {
+             wchar_t path[PATH_MAX_LEN];
+             volume_path(v->zip_path, ++shipped, path);
+             volume_ship(v, path);
+         }
+         if (closing) break;
+     }
+     volume_ship(v, v->zip_path);
+     return 0;
+ }
+ 
+ static void volume_queue(VolumeShipper *v, int queued, bool closing) {
+     AcquireSRWLockExclusive(&v->lock);
+     if (queued > v->queued) v->queued = queued;
+     v->closing = closing;
+     WakeConditionVariable(&v->ready);
+     ReleaseSRWLockExclusive(&v->lock);
+ }
+ 
+ // Volumes left over from an earlier, longer run would be taken for this one's
+ static void volume_clear(const wchar_t *zip_path) {
+     wchar_t path[PATH_MAX_LEN];
+     for (int n = 1;; n++) {
+         volume_path(zip_path, n, path);
+         if (!DeleteFileW(path)) break;
+     }
+ }
+ 
+ static VolumeShipper *volume_start(const wchar_t *zip_path, const wchar_t *command) {
+     VolumeShipper *v = calloc(1, sizeof(*v));
+     if (!v) return NULL;
+     wcscpy(v->zip_path, zip_path);
+     v->command = command;
+     InitializeSRWLock(&v->lock);
+     InitializeConditionVariable(&v->ready);
+     if (!(v->thread = CreateThread(NULL, 0, volume_worker, v, 0, NULL))) {
+         free(v);
+         return NULL;
+     }
+     return v;
+ }
+ 
+ // Hand off every volume before the current one; an open entry may still patch its own start
+ static void volume_check(ZipOutput *out) {
+     void *zip = NULL, *stream = NULL;
+     int64_t disk = 0;
+     if (!out->volumes || out->dedup) return;
+     mz_zip_writer_get_zip_handle(out->zip, &zip);
+     if (zip && mz_zip_get_stream(zip, &stream) == MZ_OK && stream &&
+         mz_stream_get_prop_int64(stream, MZ_STREAM_PROP_DISK_NUMBER, &disk) == MZ_OK && disk > out->volumes->queued)
+         volume_queue(out->volumes, (int)disk, false);
+ }
+ 
+ // After the archive is closed every volume is final, wait until all of them are shipped
+ static void volume_finish(ZipOutput *out) {
+     VolumeShipper *v = out->volumes;
+     int last = v->queued;
+     for (wchar_t path[PATH_MAX_LEN];; last++) {
+         volume_path(out->path, last + 1, path);
+         if (GetFileAttributesW(path) == INVALID_FILE_ATTRIBUTES) break;
+     }
+     volume_queue(v, last, true);
+     WaitForSingleObject(v->thread, INFINITE);
+     CloseHandle(v->thread);
+     if (!out->opt->quiet) wprintf(L"Volumes: %d + %s\n", last, out->path);
+     if (v->failed) fwprintf(stderr, L"%d volumes of %s could not be flushed or shipped\n", v->failed, out->path);
+     free(v);
+     out->volumes = NULL;
+ }
+ 
+ // Bookkeeping after each entry the writer finished
+ static void entry_written(ZipOutput *out, const FileEntry *e, const char *name, int64_t start, int64_t began) {
+     trace_end(TRACE_ENTRY, began, e->size);
+     journal_note(out, e, name, start);
+     volume_check(out);
+ }
+ 
+ // Large files are compressed straight from sliding mapped views, skipping the read buffer copy
+ #define MAP_MIN_SIZE POOL_ENTRY_MAX
+ #define MAP_WINDOW ((SIZE_T)64 << 20)   // multiple of the 64 KB allocation granularity
+ 
+ // Returns MZ_EXIST_ERROR when the file could not be mapped and nothing was written
+ static int32_t add_mapped_file(void *zip, const FileEntry *e, const wchar_t *full, const char *relUtf,
+                                uint16_t method, Progress *progress) {
+     HANDLE h = source_open(full, FILE_FLAG_SEQUENTIAL_SCAN);
+     if (h == INVALID_HANDLE_VALUE) return MZ_EXIST_ERROR;
+     HANDLE map = CreateFileMappingW(h, NULL, PAGE_READONLY, 0, 0, NULL);
+     if (!map) {
+         CloseHandle(h);
+         return MZ_EXIST_ERROR;
+     }
+     int64_t size = e->size;
+     mz_zip_file file_info;
+     entry_file_info(e, relUtf, method, &file_info);
+ 
+     int32_t err = mz_zip_writer_entry_open(zip, &file_info);
+     bool opened = err == MZ_OK;
+     for (int64_t offset = 0; err == MZ_OK && offset < size;) {
+         SIZE_T len = size - offset < (int64_t)MAP_WINDOW ? (SIZE_T)(size - offset) : MAP_WINDOW;
+         uint8_t *view = MapViewOfFile(map, FILE_MAP_READ, (DWORD)(offset >> 32), (DWORD)offset, len);
+         if (!view) {
+             err = MZ_READ_ERROR;
+             break;
+         }
+         // Start paging the whole window in while the compressor works on its head
+         io_charge((int64_t)len);
+         WIN32_MEMORY_RANGE_ENTRY range = { view, len };
+         PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+         for (SIZE_T pos = 0; pos < len && err == MZ_OK;) {
+             int32_t chunk = len - pos < READ_CHUNK ? (int32_t)(len - pos) : READ_CHUNK;
+             if (mz_zip_writer_entry_write(zip, view + pos, chunk) != chunk) err = MZ_WRITE_ERROR;
+             pos += chunk;
+             progress_advance(progress, offset + pos);
+         }
+         UnmapViewOfFile(view);
+         offset += len;
+     }
+     if (opened && mz_zip_writer_entry_close(zip) != MZ_OK && err == MZ_OK)
+         err = MZ_CLOSE_ERROR;
+     CloseHandle(map);
+     CloseHandle(h);
+     if (err != MZ_OK) fwprintf(stderr, L"Compression failed for %s (%d)\n", full, err);
+     return err;
+ }
+ 
+ // Entries above mt_threshold are compressed by libzstd's own worker threads and written as raw entries
+ // Returns MZ_EXIST_ERROR when nothing was written and the caller should add the file itself
+ static int32_t add_zstd_mt(void *writer, const FileEntry *e, const wchar_t *full, const char *relUtf, int16_t level,
+                            Progress *progress) {
+     void *zip = NULL;
+     mz_zip_writer_get_zip_handle(writer, &zip);
+     ZSTD_CCtx *cctx = zip ? ZSTD_createCCtx() : NULL;
+     if (!cctx) return MZ_EXIST_ERROR;
+     int workers = (int)GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+     if (level == MZ_COMPRESS_LEVEL_DEFAULT) level = 3;
+     // A libzstd built without threads rejects nbWorkers, the caller's single threaded path
+     // does as well then
+     if (ZSTD_isError(ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level)) ||
+         ZSTD_isError(ZSTD_CCtx_setParameter(cctx, ZSTD_c_nbWorkers, workers)) ||
+         ZSTD_isError(ZSTD_CCtx_setPledgedSrcSize(cctx, (unsigned long long)e->size))) {
+         ZSTD_freeCCtx(cctx);
+         return MZ_EXIST_ERROR;
+     }
+ 
+     HANDLE h = source_open(full, FILE_FLAG_SEQUENTIAL_SCAN);
+     uint8_t *in = malloc(READ_CHUNK), *outbuf = malloc(READ_CHUNK);
+     if (h == INVALID_HANDLE_VALUE || !in || !outbuf) {
+         if (h != INVALID_HANDLE_VALUE) CloseHandle(h);
+         free(in);
+         free(outbuf);
+         ZSTD_freeCCtx(cctx);
+         return MZ_EXIST_ERROR;
+     }
+ 
+     mz_zip_file file_info;
+     entry_file_info(e, relUtf, MZ_COMPRESS_METHOD_ZSTD, &file_info);
+     int32_t err = mz_zip_entry_write_open(zip, &file_info, level, 1, NULL);
+     bool opened = err == MZ_OK;
+     uint32_t crc = 0;
+     int64_t total = 0;
+     bool eof = false;
+     while (err == MZ_OK && !eof) {
+         DWORD got = 0;
+         if (!io_read(h, in, READ_CHUNK, &got)) {
+             err = MZ_READ_ERROR;
+             break;
+         }
+         eof = got == 0;
+         crc = crc32_update(crc, in, (int32_t)got);
+         total += got;
+         progress_advance(progress, total);
+         ZSTD_inBuffer input = { in, got, 0 };
+         size_t remaining;
+         do {
+             ZSTD_outBuffer output = { outbuf, READ_CHUNK, 0 };
+             remaining = ZSTD_compressStream2(cctx, &output, &input, eof ? ZSTD_e_end : ZSTD_e_continue);
+             if (ZSTD_isError(remaining)) {
+                 err = MZ_STREAM_ERROR;
+                 break;
+             }
+             if (output.pos && mz_zip_entry_write(zip, outbuf, (int32_t)output.pos) != (int32_t)output.pos)
+                 err = MZ_WRITE_ERROR;
+         } while (err == MZ_OK && (eof ? remaining != 0 : input.pos < input.size));
+     }
+     // A size different from the pledge fails ZSTD_e_end, the entry is then incomplete
+     if (opened && mz_zip_entry_close_raw(zip, total, crc) != MZ_OK && err == MZ_OK)
+         err = MZ_CLOSE_ERROR;
+     CloseHandle(h);
+     free(in);
+     free(outbuf);
+     ZSTD_freeCCtx(cctx);
+     if (err != MZ_OK) fwprintf(stderr, L"Compression failed for %s (%d)\n", full, err);
+     return err;
+ }
+ 
+ // --dict: files up to DICT_MAX_FILE are compressed against a dictionary trained on the small files
+ #define DICT_FIELD 0x6472              // extra field id of dictionary compressed entries
+ #define DICT_MAX_FILE (64 * 1024)
+ #define DICT_CAPACITY (112 * 1024)
+ #define DICT_SAMPLES 8192
+ #define DICT_SAMPLE_BYTES ((size_t)DICT_CAPACITY * 100)
+ #define DICT_MIN_SAMPLES 64            // fewer and training fails or does not pay off
+ 
+ typedef struct ZstdDict {
+     uint8_t *data;
+     size_t len;
+     bool compress;         // false when only carried over for entries copied from the previous archive
+     ZSTD_CDict *cdict;
+     ZSTD_CCtx *cctx;       // the writer thread's context, compress workers have their own
+     uint8_t *buf;          // the writer thread's read buffer, DICT_MAX_FILE bytes
+     uint8_t extra[8];      // DICT_FIELD header and the dictionary id, little endian
+ } ZstdDict;
+ 
+ // One level for the whole dictionary; --adaptive would pick 9 for files this small
+ static int dict_level(const ArchiveOptions *opt) {
+     if (opt->adaptive) return 9;
+     return opt->compress_level > 0 ? opt->compress_level : 3;
+ }
+ 
+ // Takes ownership of data
+ static ZstdDict *dict_create(uint8_t *data, size_t len, int level, bool compress) {
+     ZstdDict *d = calloc(1, sizeof(ZstdDict));
+     d->data = data;
+     d->len = len;
+     uint32_t id = ZDICT_getDictID(data, len);
+     const uint8_t extra[8] = { DICT_FIELD & 0xff, DICT_FIELD >> 8, 4, 0,
+                                (uint8_t)id, (uint8_t)(id >> 8), (uint8_t)(id >> 16), (uint8_t)(id >> 24) };
+     memcpy(d->extra, extra, sizeof(extra));
+     if (compress) {
+         d->cdict = ZSTD_createCDict(data, len, level);
+         d->cctx = ZSTD_createCCtx();
+         d->buf = malloc(DICT_MAX_FILE);
+         d->compress = d->cdict && d->cctx && d->buf;
+     }
+     return d;
+ }
+ 
+ static void dict_free(ZstdDict **dp) {
+     ZstdDict *d = *dp;
+     if (!d) return;
+     ZSTD_freeCDict(d->cdict);
+     ZSTD_freeCCtx(d->cctx);
+     free(d->buf);
+     free(d->data);
+     free(d);
+     *dp = NULL;
+ }
+ 
+ static inline bool dict_candidate(const FileEntry *e) {
+     return !(e->attr & FILE_ATTRIBUTE_DIRECTORY) && e->size > 0 && e->size <= DICT_MAX_FILE;
+ }
+ 
+ // Train on small files spread over the whole list, NULL when there are too few of them
+ static uint8_t *dict_train(const EntryList *list, size_t *dict_len, bool quiet) {
+     int candidates = 0;
+     for (int i = 0; i < list->count; i++) candidates += dict_candidate(&list->items[i]);
+     if (candidates < DICT_MIN_SAMPLES) return NULL;
+     int step = candidates > DICT_SAMPLES ? (candidates + DICT_SAMPLES - 1) / DICT_SAMPLES : 1;
+     uint8_t *samples = malloc(DICT_SAMPLE_BYTES);
+     size_t *sizes = malloc(DICT_SAMPLES * sizeof(size_t));
+     size_t used = 0;
+     unsigned count = 0;
+     for (int i = 0, seen = 0; i < list->count && count < DICT_SAMPLES; i++) {
+         const FileEntry *e = &list->items[i];
+         if (!dict_candidate(e) || seen++ % step != 0) continue;
+         if (used + e->size > DICT_SAMPLE_BYTES) break;
+         HANDLE h = source_open(entry_full(list, e), FILE_FLAG_SEQUENTIAL_SCAN);
+         if (h == INVALID_HANDLE_VALUE) continue;
+         DWORD got = 0;
+         if (io_read(h, samples + used, (DWORD)e->size, &got) && got > 0) {
+             sizes[count++] = got;
+             used += got;
+         }
+         CloseHandle(h);
+     }
+     uint8_t *dict = NULL;
+     if (count >= DICT_MIN_SAMPLES) {
+         dict = malloc(DICT_CAPACITY);
+         size_t n = ZDICT_trainFromBuffer(dict, DICT_CAPACITY, samples, sizes, count);
+         if (ZDICT_isError(n)) {
+             free(dict);
+             dict = NULL;
+         } else {
+             *dict_len = n;
+             if (!quiet) wprintf(L"Dictionary: %u bytes trained on %u files\n", (unsigned)n, count);
+         }
+     }
+     free(samples);
+     free(sizes);
+     return dict;
+ }
+ 
+ static void dict_store(void *writer, const ZstdDict *d) {
+     mz_zip_file fi = { 0 };
+     fi.version_madeby = MZ_VERSION_MADEBY;
+     fi.compression_method = MZ_COMPRESS_METHOD_STORE;
+     fi.flag = MZ_ZIP_FLAG_UTF8;
+     fi.filename = DICT_ENTRY;
+     fi.uncompressed_size = (int64_t)d->len;
+     fi.modified_date = time(NULL);
+     if (mz_zip_writer_add_buffer(writer, d->data, (int32_t)d->len, &fi) != MZ_OK)
+         fwprintf(stderr, L"Cannot store the dictionary\n");
+ }
+ 
+ // The archive's dictionary, NULL when it has none
+ uint8_t *dict_read(void *zip, size_t *len) {
+     mz_zip_file *fi = NULL;
+     if (mz_zip_locate_entry(zip, DICT_ENTRY, 0) != MZ_OK || mz_zip_entry_get_info(zip, &fi) != MZ_OK ||
+         fi->uncompressed_size <= 0 || fi->uncompressed_size > DICT_CAPACITY * 8)
+         return NULL;
+     int32_t size = (int32_t)fi->uncompressed_size, got = 0, n = 0;
+     if (mz_zip_entry_read_open(zip, 0, NULL) != MZ_OK) return NULL;
+     uint8_t *data = malloc(size);
+     while (got < size && (n = mz_zip_entry_read(zip, data + got, size - got)) > 0) got += n;
+     if (mz_zip_entry_close(zip) != MZ_OK || got != size) {
+         free(data);
+         return NULL;
+     }
+     *len = (size_t)size;
+     return data;
+ }
+ 
+ bool dict_marked(const mz_zip_file *fi) {
+     uint16_t len = 0;
+     return fi->extrafield_size > 0 &&
+            mz_zip_extrafield_contains(fi->extrafield, fi->extrafield_size, DICT_FIELD, &len) == MZ_OK;
+ }
+ 
+ // Compress one small file against the dictionary into a malloc'ed frame, fi describes the raw entry.
+ // False when the caller should add the file the usual way.
+ static bool dict_compress(const ZstdDict *d, ZSTD_CCtx *cctx, const FileEntry *e, const wchar_t *full,
+                           const ArchiveOptions *opt, uint8_t *buf, mz_zip_file *fi, uint8_t **frame) {
+     if (opt->adaptive && has_compressed_ext(full)) return false;
+     HANDLE h = source_open(full, FILE_FLAG_SEQUENTIAL_SCAN);
+     if (h == INVALID_HANDLE_VALUE) return false;
+     DWORD got = 0;
+     bool ok = io_read(h, buf, DICT_MAX_FILE, &got) && got == (DWORD)e->size;
+     CloseHandle(h);
+     if (!ok) return false;
+     size_t cap = ZSTD_compressBound(got);
+     *frame = malloc(cap);
+     size_t n = ZSTD_compress_usingCDict(cctx, *frame, cap, buf, got, d->cdict);
+     // Same rule as sample_compresses: what does not save 5% is stored instead
+     if (ZSTD_isError(n) || (opt->adaptive && got >= ADAPTIVE_MIN_SAMPLE && (int64_t)n * 100 >= (int64_t)got * 95)) {
+         free(*frame);
+         *frame = NULL;
+         return false;
+     }
+     entry_file_info(e, NULL, MZ_COMPRESS_METHOD_ZSTD, fi);
+     fi->crc = crc32_update(0, buf, (int32_t)got);
+     fi->compressed_size = (int64_t)n;
+     fi->extrafield = d->extra;
+     fi->extrafield_size = sizeof(d->extra);
+     return true;
+ }
+ 
+ // Serial path: compress on the writer thread and append the frame as a raw entry
+ // Returns MZ_EXIST_ERROR when nothing was written and the caller should add the file itself
+ static int32_t add_dict_file(void *writer, ZstdDict *d, const FileEntry *e, const wchar_t *full, const char *relUtf,
+                              const ArchiveOptions *opt) {
+     mz_zip_file fi;
+     uint8_t *frame = NULL;
+     if (!dict_compress(d, d->cctx, e, full, opt, d->buf, &fi, &frame)) return MZ_EXIST_ERROR;
+     fi.filename = relUtf;
+     mz_zip_writer_set_raw(writer, 1);
+     int32_t err = mz_zip_writer_entry_open(writer, &fi);
+     bool opened = err == MZ_OK;
+     if (opened && mz_zip_writer_entry_write(writer, frame, (int32_t)fi.compressed_size) != (int32_t)fi.compressed_size)
+         err = MZ_WRITE_ERROR;
+     if (opened && mz_zip_writer_entry_close(writer) != MZ_OK && err == MZ_OK) err = MZ_CLOSE_ERROR;
+     mz_zip_writer_set_raw(writer, 0);
+     free(frame);
+     if (!opened) return MZ_EXIST_ERROR;
+     if (err != MZ_OK) fwprintf(stderr, L"Compression failed for %s (%d)\n", full, err);
+     return err;
+ }
+ 
+ // Decode the current dictionary compressed entry into h
+ bool dict_extract(void *zip, const ZSTD_DDict *ddict, ZSTD_DCtx *dctx, HANDLE h) {
+     mz_zip_file *fi = NULL;
+     if (!ddict || !dctx || mz_zip_entry_get_info(zip, &fi) != MZ_OK || fi->uncompressed_size > DICT_MAX_FILE ||
+         fi->compressed_size > (int64_t)ZSTD_compressBound(DICT_MAX_FILE))
+         return false;
+     int32_t src_len = (int32_t)fi->compressed_size, got = 0, n = 0;
+     size_t dst_len = (size_t)fi->uncompressed_size;
+     uint32_t crc = fi->crc;
+     if (mz_zip_entry_read_open(zip, 1, NULL) != MZ_OK) return false;
+     uint8_t *src = malloc(src_len + 1), *dst = malloc(dst_len + 1);
+     while (got < src_len && (n = mz_zip_entry_read(zip, src + got, src_len - got)) > 0) got += n;
+     mz_zip_entry_close(zip);
+     size_t out = got == src_len ? ZSTD_decompress_usingDDict(dctx, dst, dst_len, src, src_len, ddict) : 0;
+     bool ok = got == src_len && !ZSTD_isError(out) && out == dst_len &&
+               crc32_update(0, dst, (int32_t)out) == crc;
+     DWORD put = 0;
+     if (ok && out > 0) ok = WriteFile(h, dst, (DWORD)out, &put, NULL) && put == (DWORD)out;
+     free(src);
+     free(dst);
+     return ok;
+ }
+ 
+ // --seekable: entries from SEEK_MIN up as independent zstd frames and a seek table, --range decodes only a few
+ #define SEEK_MIN ((int64_t)64 << 20)
+ #define SEEK_WINDOW_MAX 32             // frames compressed ahead of the writer
+ 
+ typedef struct SeekSlot {
+     uint8_t *src;
+     uint8_t *dst;
+     int32_t src_len;
+     size_t dst_len;
+     bool ready;
+ } SeekSlot;
+ 
+ typedef struct SeekCompress {
+     const wchar_t *full;
+     int64_t size;
+     int level;
+     int frames;
+     int window;
+     SeekSlot *slots;       // frame f is compressed into slots[f % window]
+     SRWLOCK lock;
+     CONDITION_VARIABLE ready;
+     CONDITION_VARIABLE moved;
+     int next;              // next frame a worker may claim
+     int written;           // frames appended to the entry
+     bool failed;
+ } SeekCompress;
+ 
+ // Both the table and the extra field are little endian, like every Windows target
+ static void put_u32(uint8_t *p, uint32_t v) {
+     memcpy(p, &v, sizeof(v));
+ }
+ 
+ uint32_t get_u32(const uint8_t *p) {
+     uint32_t v;
+     memcpy(&v, p, sizeof(v));
+     return v;
+ }
+ 
+ // Data of the extra field id, NULL when the entry has none
+ const uint8_t *extra_find(const mz_zip_file *fi, uint16_t id, uint16_t *len) {
+     const uint8_t *p = fi->extrafield;
+     for (int32_t left = fi->extrafield_size; p && left >= 4;) {
+         uint16_t field = (uint16_t)(p[0] | p[1] << 8), size = (uint16_t)(p[2] | p[3] << 8);
+         if (size > left - 4) break;
+         if (field == id) {
+             *len = size;
+             return p + 4;
+         }
+         p += 4 + size;
+         left -= 4 + size;
+     }
+     return NULL;
+ }
+ 
+ static DWORD WINAPI seek_worker(LPVOID param) {
+     SeekCompress *sc = param;
+     HANDLE h = source_open(sc->full, 0);
+     ZSTD_CCtx *cctx = ZSTD_createCCtx();
+     if (cctx) {
+         ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, sc->level);
+         // Each frame verifies itself when --range decodes it alone
+         ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 1);
+     }
+     size_t cap = ZSTD_compressBound(SEEK_FRAME);
+     for (;;) {
+         AcquireSRWLockExclusive(&sc->lock);
+         while (sc->next < sc->frames && sc->next >= sc->written + sc->window && !sc->failed)
+             SleepConditionVariableSRW(&sc->moved, &sc->lock, INFINITE, 0);
+         if (sc->next >= sc->frames || sc->failed) {
+             ReleaseSRWLockExclusive(&sc->lock);
+             break;
+         }
+         int f = sc->next++;
+         ReleaseSRWLockExclusive(&sc->lock);
+ 
+         SeekSlot *slot = &sc->slots[f % sc->window];
+         int64_t at = (int64_t)f * SEEK_FRAME;
+         int32_t len = sc->size - at < SEEK_FRAME ? (int32_t)(sc->size - at) : SEEK_FRAME;
+         bool ok = h != INVALID_HANDLE_VALUE && cctx && read_at(h, at, slot->src, (DWORD)len);
+         int64_t start = trace_begin();
+         size_t n = ok ? ZSTD_compress2(cctx, slot->dst, cap, slot->src, (size_t)len) : 0;
+         ok = ok && !ZSTD_isError(n);
+         if (ok) trace_end(TRACE_COMPRESS, start, len);
+ 
+         AcquireSRWLockExclusive(&sc->lock);
+         slot->src_len = len;
+         slot->dst_len = n;
+         slot->ready = ok;
+         if (!ok) {
+             sc->failed = true;
+             WakeAllConditionVariable(&sc->moved);
+         }
+         WakeAllConditionVariable(&sc->ready);
+         ReleaseSRWLockExclusive(&sc->lock);
+     }
+     ZSTD_freeCCtx(cctx);
+     if (h != INVALID_HANDLE_VALUE) CloseHandle(h);
+     return 0;
+ }
+ 
+ static void seek_slots_free(SeekCompress *sc) {
+     for (int i = 0; sc->slots && i < sc->window; i++) {
+         free(sc->slots[i].src);
+         free(sc->slots[i].dst);
+     }
+     free(sc->slots);
+ }
+ 
+ // Returns MZ_EXIST_ERROR when nothing was written and the caller should add the file itself
+ static int32_t add_zstd_seekable(void *writer, const FileEntry *e, const wchar_t *full, const char *relUtf,
+                                  int16_t level, Progress *progress) {
+     void *zip = NULL;
+     mz_zip_writer_get_zip_handle(writer, &zip);
+     if (!zip) return MZ_EXIST_ERROR;
+     if (level == MZ_COMPRESS_LEVEL_DEFAULT) level = 3;
+     SeekCompress sc = { .full = full, .size = e->size, .level = level };
+     sc.frames = (int)((e->size + SEEK_FRAME - 1) / SEEK_FRAME);
+     int threads = (int)GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+     if (threads > sc.frames) threads = sc.frames;
+     sc.window = threads * 2 < SEEK_WINDOW_MAX ? threads * 2 : SEEK_WINDOW_MAX;
+     sc.slots = calloc(sc.window, sizeof(SeekSlot));
+     // Skippable frame header, one compressed/decompressed size pair per frame, footer
+     size_t table_len = 8 + (size_t)sc.frames * 8 + SEEK_FOOTER;
+     uint8_t *table = malloc(table_len);
+     bool ok = sc.slots && table;
+     for (int i = 0; ok && i < sc.window; i++) {
+         sc.slots[i].src = malloc(SEEK_FRAME);
+         sc.slots[i].dst = malloc(ZSTD_compressBound(SEEK_FRAME));
+         ok = sc.slots[i].src && sc.slots[i].dst;
+     }
+     InitializeSRWLock(&sc.lock);
+     InitializeConditionVariable(&sc.ready);
+     InitializeConditionVariable(&sc.moved);
+     HANDLE *workers = ok ? calloc(threads, sizeof(HANDLE)) : NULL;
+     int started = 0;
+     for (int t = 0; workers && t < threads; t++) {
+         workers[started] = CreateThread(NULL, 0, seek_worker, &sc, 0, NULL);
+         if (workers[started]) started++;
+     }
+     if (started == 0) {
+         free(workers);
+         free(table);
+         seek_slots_free(&sc);
+         return MZ_EXIST_ERROR;
+     }
+ 
+     uint8_t extra[12] = { SEEK_FIELD & 0xff, SEEK_FIELD >> 8, 8, 0 };
+     put_u32(extra + 4, SEEK_FRAME);
+     put_u32(extra + 8, (uint32_t)sc.frames);
+     mz_zip_file file_info;
+     entry_file_info(e, relUtf, MZ_COMPRESS_METHOD_ZSTD, &file_info);
+     file_info.extrafield = extra;
+     file_info.extrafield_size = sizeof(extra);
+     int32_t err = mz_zip_entry_write_open(zip, &file_info, level, 1, NULL);
+     bool opened = err == MZ_OK;
+     uint32_t crc = 0;
+     int64_t total = 0;
+     uint8_t *pair = table + 8;
+     for (int f = 0; err == MZ_OK && f < sc.frames; f++) {
+         SeekSlot *slot = &sc.slots[f % sc.window];
+         AcquireSRWLockExclusive(&sc.lock);
+         while (!slot->ready && !sc.failed) SleepConditionVariableSRW(&sc.ready, &sc.lock, INFINITE, 0);
+         bool ready = slot->ready;
+         ReleaseSRWLockExclusive(&sc.lock);
+         if (!ready) {
+             err = MZ_READ_ERROR;
+             break;
+         }
+         crc = crc32_update(crc, slot->src, slot->src_len);
+         total += slot->src_len;
+         if (mz_zip_entry_write(zip, slot->dst, (int32_t)slot->dst_len) != (int32_t)slot->dst_len)
+             err = MZ_WRITE_ERROR;
+         put_u32(pair, (uint32_t)slot->dst_len);
+         put_u32(pair + 4, (uint32_t)slot->src_len);
+         pair += 8;
+         progress_advance(progress, total);
+ 
+         AcquireSRWLockExclusive(&sc.lock);
+         slot->ready = false;
+         sc.written = f + 1;
+         WakeAllConditionVariable(&sc.moved);
+         ReleaseSRWLockExclusive(&sc.lock);
+     }
+     if (err != MZ_OK) {
+         AcquireSRWLockExclusive(&sc.lock);
+         sc.failed = true;
+         WakeAllConditionVariable(&sc.moved);
+         ReleaseSRWLockExclusive(&sc.lock);
+     }
+     WaitForMultipleObjects(started, workers, TRUE, INFINITE);
+     for (int t = 0; t < started; t++) CloseHandle(workers[t]);
+     if (err == MZ_OK) {
+         put_u32(table, SEEK_SKIPPABLE_MAGIC);
+         put_u32(table + 4, (uint32_t)(table_len - 8));
+         put_u32(pair, (uint32_t)sc.frames);
+         pair[4] = 0;                       // no per frame checksums, the frames carry their own
+         put_u32(pair + 5, SEEK_TABLE_MAGIC);
+         if (mz_zip_entry_write(zip, table, (int32_t)table_len) != (int32_t)table_len) err = MZ_WRITE_ERROR;
+     }
+     // A file that shrank fails its last read, one that grew is cut at the walked size
+     if (opened && mz_zip_entry_close_raw(zip, total, crc) != MZ_OK && err == MZ_OK)
+         err = MZ_CLOSE_ERROR;
+     free(workers);
+     free(table);
+     seek_slots_free(&sc);
+     if (err != MZ_OK) fwprintf(stderr, L"Compression failed for %s (%d)\n", full, err);
+     return err;
+ }
+ 
+ static int32_t handle_read(void *stream, void *buf, int32_t size) {
+     DWORD got = 0;
+     return io_read(*(HANDLE *)stream, buf, (DWORD)size, &got) ? (int32_t)got : MZ_READ_ERROR;
+ }
+ 
+ // Add one regular file, reusing the previous archive's data when unchanged
+ static void zip_write_file(ZipOutput *out, const FileEntry *e, const wchar_t *full, const char *relUtf) {
+     if (out->broken) return;
+     const ManifestRecord *r = incremental_match(out, e, relUtf);
+     int32_t dict_err = !r && out->dict && out->dict->compress && dict_candidate(e)
+                            ? add_dict_file(out->zip, out->dict, e, full, relUtf, out->opt) : MZ_EXIST_ERROR;
+     bool done = dict_err != MZ_EXIST_ERROR;
+     // The broken entry is in the archive already, it stays out of the manifest so the next run redoes it
+     if (done && dict_err != MZ_OK) {
+         out->skipped = true;
+         return;
+     }
+     if (!done && (!r || copy_prev_entry(out, r) != MZ_OK)) {
+         if (out->broken) return;
+         uint16_t method;
+         int16_t level;
+         choose_method(out->opt, full, e->size, NULL, 0, &method, &level);
+         if (out->opt->adaptive) {
+             mz_zip_writer_set_compress_method(out->zip, method);
+             mz_zip_writer_set_compress_level(out->zip, level);
+         }
+         int32_t err = MZ_EXIST_ERROR;
+         if (method == MZ_COMPRESS_METHOD_ZSTD && out->opt->seekable && e->size >= SEEK_MIN)
+             err = add_zstd_seekable(out->zip, e, full, relUtf, level, out->progress);
+         if (err == MZ_EXIST_ERROR && method == MZ_COMPRESS_METHOD_ZSTD && e->size >= out->opt->mt_threshold)
+             err = add_zstd_mt(out->zip, e, full, relUtf, level, out->progress);
+         if (err == MZ_EXIST_ERROR && e->size >= MAP_MIN_SIZE)
+             err = add_mapped_file(out->zip, e, full, relUtf, method, out->progress);
+         if (err == MZ_EXIST_ERROR) {
+             HANDLE h = source_open(full, FILE_FLAG_SEQUENTIAL_SCAN);
+             if (h == INVALID_HANDLE_VALUE) {
+                 fwprintf(stderr, L"Cannot read %s\n", full);
+                 out->skipped = true;
+                 return;
+             }
+             mz_zip_file file_info;
+             entry_file_info(e, relUtf, method, &file_info);
+             err = mz_zip_writer_add_info(out->zip, &h, handle_read, &file_info);
+             CloseHandle(h);
+             if (err != MZ_OK) fwprintf(stderr, L"Compression failed for %s (%d)\n", full, err);
+         }
+         // A failed entry is left out of the manifest, the next incremental run compresses it again
+         if (err != MZ_OK) {
+             out->skipped = true;
+             return;
+         }
+     }
+     if (out->manifest_path[0])
+         manifest_add(&out->next, relUtf, e->size, e->mtime, r ? r->crc : 0);
+ }
+ 
+ // Fill CRCs of this run's manifest from the central directory just written
+ static void manifest_fill_crc(Manifest *m, const char *zip_path) {
+     void *reader = mz_zip_reader_create();
+     if (mz_zip_reader_open_file(reader, zip_path) == MZ_OK) {
+         for (int32_t err = mz_zip_reader_goto_first_entry(reader); err == MZ_OK;
+              err = mz_zip_reader_goto_next_entry(reader)) {
+             mz_zip_file *fi = NULL;
+             if (mz_zip_reader_entry_get_info(reader, &fi) != MZ_OK) continue;
+             ManifestRecord *r = manifest_find(m, fi->filename);
+             if (r) r->crc = fi->crc;
+         }
+         mz_zip_reader_close(reader);
+     }
+     mz_zip_reader_delete(&reader);
+ }
+ 
+ // Parallel compression pipeline: workers compress ahead, largest files first and small ones in batches,
+ // and the writer appends the payloads in schedule order so the layout only depends on the tree
+ #define POOL_BATCH_FILES 64
+ #define POOL_BATCH_BYTES ((int64_t)1 << 20)
+ 
+ typedef enum JobKind {
+     JOB_PENDING = 0,
+     JOB_SKIP,    // excluded or directory, nothing to write
+     JOB_INLINE,  // too large or unreadable by the worker, writer adds it itself
+     JOB_RAW,     // compressed payload ready in mem_stream
+     JOB_COPY     // unchanged since the previous run, copied raw from it
+ } JobKind;
+ 
+ typedef struct CompressJob {
+     JobKind kind;
+     void *mem_stream;            // an OS file stream over spill when that is set
+     wchar_t *spill;              // temp file of a payload above POOL_ENTRY_MAX
+     mz_zip_file file_info;
+     const ManifestRecord *prev;  // JOB_COPY source
+ } CompressJob;
+ 
+ typedef struct CompressPool {
+     const EntryList *list;
+     int count;
+     CompressJob *jobs;
+     const ArchiveOptions *opt;
+     const ZipOutput *out;
+     int *order;        // entry indices in write order, directories left out
+     int *batches;      // batch b is order[batches[b]] up to order[batches[b + 1]]
+     int batch_count;
+     SRWLOCK lock;
+     CONDITION_VARIABLE job_done;
+     CONDITION_VARIABLE window_moved;
+     int next;     // next batch a worker may claim
+     int written;  // batches below this index have been consumed by the writer
+     int window;
+ } CompressPool;
+ 
+ typedef struct ScheduleItem {
+     int64_t size;
+     int index;
+ } ScheduleItem;
+ 
+ // Largest first, list order among equal sizes
+ static int schedule_item_cmp(const void *a, const void *b) {
+     const ScheduleItem *x = a, *y = b;
+     if (x->size != y->size) return x->size < y->size ? 1 : -1;
+     return x->index < y->index ? -1 : x->index > y->index;
+ }
+ 
+ // Fill the write order and its batches: big files one per batch, the small ones grouped
+ static void pool_schedule(CompressPool *pool) {
+     const EntryList *list = pool->list;
+     pool->order = malloc(((size_t)pool->count + 1) * sizeof(int));
+     pool->batches = malloc(((size_t)pool->count + 1) * sizeof(int));
+     ScheduleItem *big = malloc(((size_t)pool->count + 1) * sizeof(ScheduleItem));
+     int nbig = 0, n = 0;
+     for (int i = 0; i < pool->count; i++) {
+         const FileEntry *e = &list->items[i];
+         if (!(e->attr & FILE_ATTRIBUTE_DIRECTORY) && e->size >= POOL_BATCH_BYTES)
+             big[nbig++] = (ScheduleItem){ e->size, i };
+     }
+     qsort(big, nbig, sizeof(ScheduleItem), schedule_item_cmp);
+     pool->batch_count = 0;
+     for (int k = 0; k < nbig; k++) {
+         pool->batches[pool->batch_count++] = n;
+         pool->order[n++] = big[k].index;
+     }
+     free(big);
+     int64_t batch_bytes = 0;
+     int batch_files = 0;
+     for (int i = 0; i < pool->count; i++) {
+         const FileEntry *e = &list->items[i];
+         if ((e->attr & FILE_ATTRIBUTE_DIRECTORY) || e->size >= POOL_BATCH_BYTES) continue;
+         if (batch_files == 0 || batch_files == POOL_BATCH_FILES || batch_bytes + e->size > POOL_BATCH_BYTES) {
+             pool->batches[pool->batch_count++] = n;
+             batch_bytes = 0;
+             batch_files = 0;
+         }
+         pool->order[n++] = i;
+         batch_bytes += e->size;
+         batch_files++;
+     }
+     pool->batches[pool->batch_count] = n;
+ }
+ 
+ // Drop a job's payload, deleting its temp file if it spilled
+ static void job_release(CompressJob *job) {
+     if (job->spill) {
+         mz_stream_os_close(job->mem_stream);
+         mz_stream_os_delete(&job->mem_stream);
+         DeleteFileW(job->spill);
+         free(job->spill);
+         job->spill = NULL;
+     } else if (job->mem_stream) {
+         mz_stream_mem_delete(&job->mem_stream);
+     }
+ }
+ 
+ // Open a temp file stream for a payload too big to hold in memory
+ static void *spill_open(CompressJob *job) {
+     wchar_t dir[PATH_MAX_LEN];
+     job->spill = malloc(PATH_MAX_LEN * sizeof(wchar_t));
+     if (!job->spill || !GetTempPathW(PATH_MAX_LEN, dir) || !GetTempFileNameW(dir, L"arc", 0, job->spill)) {
+         free(job->spill);
+         job->spill = NULL;
+         return NULL;
+     }
+     char path[PATH_MAX_LEN];
+     WideCharToMultiByte(CP_UTF8, 0, job->spill, -1, path, PATH_MAX_LEN, NULL, NULL);
+     void *s = mz_stream_os_create();
+     if (!s || mz_stream_os_open(s, path, MZ_OPEN_MODE_READWRITE | MZ_OPEN_MODE_CREATE) != MZ_OK) {
+         if (s) mz_stream_os_delete(&s);
+         DeleteFileW(job->spill);
+         free(job->spill);
+         job->spill = NULL;
+         return NULL;
+     }
+     return s;
+ }
+ 
+ // Compress a whole file into an in-memory stream (a temp file for big ones), filling the raw entry info
+ static JobKind compress_to_memory(const FileEntry *e, const wchar_t *full, const ArchiveOptions *opt,
+                                   uint8_t *buf, CompressJob *job) {
+     int64_t size = e->size;
+     bool spill = size > POOL_ENTRY_MAX;
+     if (spill && (size >= opt->mt_threshold || (opt->seekable && size >= SEEK_MIN))) return JOB_INLINE;
+     HANDLE h = source_open(full, FILE_FLAG_SEQUENTIAL_SCAN);
+     if (h == INVALID_HANDLE_VALUE) return JOB_INLINE;
+ 
+     // The first chunk doubles as the adaptive sample
+     DWORD got = 0;
+     if (!io_read(h, buf, READ_CHUNK, &got)) { CloseHandle(h); return JOB_INLINE; }
+     uint16_t method;
+     int16_t level;
+     choose_method(opt, full, size, buf, (int32_t)got, &method, &level);
+     // Only zstd and store are built into the bundled minizip-ng
+     bool store = method == MZ_COMPRESS_METHOD_STORE;
+     // A big stored file is one copy for the writer, spilling it would read and write it twice
+     if ((!store && method != MZ_COMPRESS_METHOD_ZSTD) || (store && spill)) {
+         CloseHandle(h);
+         return JOB_INLINE;
+     }
+ 
+     void *mem = NULL;
+     if (spill && !(mem = spill_open(job))) {
+         CloseHandle(h);
+         return JOB_INLINE;
+     }
+     if (!spill) {
+         mem = mz_stream_mem_create();
+         mz_stream_mem_set_grow_size(mem, (int32_t)(store ? size : size / 2) + 65536);
+         mz_stream_mem_open(mem, NULL, MZ_OPEN_MODE_CREATE);
+     }
+     job->mem_stream = mem;
+     void *zs = NULL;
+     int32_t err = MZ_OK;
+     if (!store) {
+         zs = mz_stream_zstd_create();
+         mz_stream_set_base(zs, mem);
+         mz_stream_set_prop_int64(zs, MZ_STREAM_PROP_COMPRESS_LEVEL, level);
+         err = mz_stream_open(zs, NULL, MZ_OPEN_MODE_WRITE);
+     }
+     void *sink = store ? mem : zs;
+ 
+     uint32_t crc = 0;
+     int64_t total = 0;
+     while (err == MZ_OK && got > 0) {
+         crc = crc32_update(crc, buf, (int32_t)got);
+         if (mz_stream_write(sink, buf, (int32_t)got) != (int32_t)got) err = MZ_WRITE_ERROR;
+         total += got;
+         if (!io_read(h, buf, READ_CHUNK, &got)) err = MZ_READ_ERROR;
+     }
+     CloseHandle(h);
+     if (zs) {
+         if (mz_stream_close(zs) != MZ_OK) err = MZ_WRITE_ERROR;
+         mz_stream_zstd_delete(&zs);
+     }
+     // File changed under us, let the writer read it again the normal way
+     if (err != MZ_OK || total != size) {
+         job_release(job);
+         return JOB_INLINE;
+     }
+ 
+     int64_t compressed = 0;
+     if (spill) {
+         compressed = mz_stream_os_tell(mem);
+     } else {
+         int32_t len = 0;
+         mz_stream_mem_get_buffer_length(mem, &len);
+         compressed = len;
+     }
+     entry_file_info(e, NULL, method, &job->file_info);
+     job->file_info.crc = crc;
+     job->file_info.compressed_size = compressed;
+     return JOB_RAW;
+ }
+ 
+ // Dictionary compress a small file into the job, JOB_INLINE when it has to go the usual way
+ static JobKind dict_to_memory(const ZstdDict *d, ZSTD_CCtx *cctx, const FileEntry *e, const wchar_t *full,
+                               const ArchiveOptions *opt, uint8_t *buf, CompressJob *job) {
+     uint8_t *frame = NULL;
+     if (!dict_compress(d, cctx, e, full, opt, buf, &job->file_info, &frame)) return JOB_INLINE;
+     void *mem = mz_stream_mem_create();
+     mz_stream_mem_set_grow_size(mem, (int32_t)job->file_info.compressed_size + 1024);
+     mz_stream_mem_open(mem, NULL, MZ_OPEN_MODE_CREATE);
+     int32_t len = (int32_t)job->file_info.compressed_size;
+     bool ok = mz_stream_write(mem, frame, len) == len;
+     free(frame);
+     if (!ok) {
+         mz_stream_mem_delete(&mem);
+         return JOB_INLINE;
+     }
+     job->mem_stream = mem;
+     return JOB_RAW;
+ }
+ 
+ static DWORD WINAPI compress_worker(LPVOID param) {
+     CompressPool *pool = param;
+     uint8_t *buf = malloc(READ_CHUNK);
+     const ZstdDict *dict = pool->out->dict && pool->out->dict->compress ? pool->out->dict : NULL;
+     ZSTD_CCtx *dict_cctx = dict ? ZSTD_createCCtx() : NULL;
+     JobKind kinds[POOL_BATCH_FILES];
+     for (;;) {
+         AcquireSRWLockExclusive(&pool->lock);
+         while (pool->next < pool->batch_count && pool->next >= pool->written + pool->window)
+             SleepConditionVariableSRW(&pool->window_moved, &pool->lock, INFINITE, 0);
+         if (pool->next >= pool->batch_count) {
+             ReleaseSRWLockExclusive(&pool->lock);
+             break;
+         }
+         int b = pool->next++;
+         ReleaseSRWLockExclusive(&pool->lock);
+ 
+         int first = pool->batches[b], last = pool->batches[b + 1];
+         for (int k = first; k < last; k++) {
+             int i = pool->order[k];
+             const FileEntry *e = &pool->list->items[i];
+             JobKind kind = JOB_INLINE;
+             if (pool->out->prev_zip &&
+                 (pool->jobs[i].prev = incremental_match(pool->out, e, entry_name(pool->list, e))) != NULL)
+                 kind = JOB_COPY;
+             int64_t start = trace_begin();
+             if (kind == JOB_INLINE && dict_cctx && buf && dict_candidate(e))
+                 kind = dict_to_memory(dict, dict_cctx, e, entry_full(pool->list, e), pool->opt, buf, &pool->jobs[i]);
+             if (kind == JOB_INLINE && buf)
+                 kind = compress_to_memory(e, entry_full(pool->list, e), pool->opt, buf, &pool->jobs[i]);
+             if (kind == JOB_RAW) trace_end(TRACE_COMPRESS, start, e->size);
+             kinds[k - first] = kind;
+         }
+ 
+         AcquireSRWLockExclusive(&pool->lock);
+         for (int k = first; k < last; k++) pool->jobs[pool->order[k]].kind = kinds[k - first];
+         WakeAllConditionVariable(&pool->job_done);
+         ReleaseSRWLockExclusive(&pool->lock);
+     }
+     ZSTD_freeCCtx(dict_cctx);
+     free(buf);
+     return 0;
+ }
+ 
+ // Append a worker-compressed payload as a raw entry
+ static int32_t write_raw_job(void *zip, CompressJob *job, const char *name) {
+     job->file_info.filename = name;
+     mz_zip_writer_set_raw(zip, 1);
+     int64_t len = job->file_info.compressed_size;
+     int32_t err = mz_zip_writer_entry_open(zip, &job->file_info);
+     bool opened = err == MZ_OK;
+     if (opened && job->spill) {
+         uint8_t buf[64 * 1024];
+         if (mz_stream_os_seek(job->mem_stream, 0, MZ_SEEK_SET) != MZ_OK) err = MZ_READ_ERROR;
+         for (int64_t left = len; err == MZ_OK && left > 0;) {
+             int32_t want = left < (int64_t)sizeof(buf) ? (int32_t)left : (int32_t)sizeof(buf);
+             int32_t n = mz_stream_os_read(job->mem_stream, buf, want);
+             if (n <= 0) err = MZ_READ_ERROR;
+             else if (mz_zip_writer_entry_write(zip, buf, n) != n) err = MZ_WRITE_ERROR;
+             else left -= n;
+         }
+     } else if (opened) {
+         const void *data = NULL;
+         mz_stream_mem_get_buffer(job->mem_stream, &data);
+         if (mz_zip_writer_entry_write(zip, data, (int32_t)len) != (int32_t)len) err = MZ_WRITE_ERROR;
+     }
+     if (opened && mz_zip_writer_entry_close(zip) != MZ_OK && err == MZ_OK) err = MZ_CLOSE_ERROR;
+     mz_zip_writer_set_raw(zip, 0);
+     job_release(job);
+     return err;
+ }
+ 
+ static void zip_entries_parallel(ZipOutput *out, const EntryList *list) {
+     const ArchiveOptions *opt = out->opt;
+     int count = list->count;
+     CompressPool pool = {0};
+     pool.list = list;
+     pool.count = count;
+     pool.opt = opt;
+     pool.out = out;
+     pool.window = opt->threads * 2;
+     pool.jobs = calloc(count, sizeof(CompressJob));
+     pool_schedule(&pool);
+     InitializeSRWLock(&pool.lock);
+     InitializeConditionVariable(&pool.job_done);
+     InitializeConditionVariable(&pool.window_moved);
+ 
+     HANDLE *workers = calloc(opt->threads, sizeof(HANDLE));
+     int started = 0;
+     for (int t = 0; t < opt->threads; t++) {
+         workers[started] = CreateThread(NULL, 0, compress_worker, &pool, 0, NULL);
+         if (workers[started]) started++;
+     }
+     if (started == 0) {
+         // No workers available, degrade to the writer doing everything inline
+         for (int i = 0; i < count; i++) pool.jobs[i].kind = JOB_INLINE;
+         pool.next = pool.batch_count;
+     }
  
- // Recursively collect file paths under base_dir, excluding hidden/system and desktop.ini
- static void collect_entries(const wchar_t *base_dir, const wchar_t *curr_dir,
-                              FileEntry **arr, int *cnt, int *cap) {
-     WIN32_FIND_DATAW ffd;
-     HANDLE hFind;
-     wchar_t pattern[PATH_MAX_LEN];
-     wsprintfW(pattern, L"%s\\*", curr_dir);
-     hFind = FindFirstFileW(pattern, &ffd);
-     if (hFind == INVALID_HANDLE_VALUE) return;
-     do {
-         // Skip . and ..
-         if (wcscmp(ffd.cFileName, L".") == 0 || wcscmp(ffd.cFileName, L"..") == 0)
-             continue;
-         // Skip hidden and system
-         if (ffd.dwFileAttributes & (FILE_ATTRIBUTE_HIDDEN | FILE_ATTRIBUTE_SYSTEM))
-             continue;
-         // Skip desktop.ini
-         if (_wcsicmp(ffd.cFileName, L"desktop.ini") == 0)
+     for (int k = 0; k < pool.batches[pool.batch_count]; k++) {
+         int i = pool.order[k];
+         AcquireSRWLockExclusive(&pool.lock);
+         while (pool.jobs[i].kind == JOB_PENDING)
+             SleepConditionVariableSRW(&pool.job_done, &pool.lock, INFINITE, 0);
+         ReleaseSRWLockExclusive(&pool.lock);
+ 
+         CompressJob *job = &pool.jobs[i];
+         if (job->kind != JOB_SKIP) {
+             const FileEntry *e = &list->items[i];
+             const char *relUtf = entry_name(list, e);
+             if (out->progress) {
+                 wchar_t rel_buf[PATH_MAX_LEN];
+                 progress_begin(out->progress, entry_rel(list, e, rel_buf));
+             }
+             int64_t start = output_size(out), began = trace_begin();
+             if (job->kind == JOB_RAW) {
+                 uint32_t crc = job->file_info.crc;
+                 int32_t err = write_raw_job(out->zip, job, relUtf);
+                 if (err != MZ_OK) {
+                     // Left out of the manifest, the next incremental run adds it again
+                     fwprintf(stderr, L"Cannot write %s (%d)\n", entry_full(list, e), err);
+                     out->skipped = true;
+                 } else if (out->manifest_path[0]) {
+                     manifest_add(&out->next, relUtf, e->size, e->mtime, crc);
+                 }
+             } else if (job->kind == JOB_COPY && copy_prev_entry(out, job->prev) == MZ_OK) {
+                 if (out->manifest_path[0])
+                     manifest_add(&out->next, relUtf, e->size, e->mtime, job->prev->crc);
+             } else {
+                 zip_write_file(out, e, entry_full(list, e), relUtf);
+             }
+             entry_written(out, e, relUtf, start, began);
+             if (out->progress) progress_end(out->progress, e->size, output_size(out));
+         }
+ 
+         // The window moves on whole batches
+         if (k + 1 < pool.batches[pool.written + 1]) continue;
+         AcquireSRWLockExclusive(&pool.lock);
+         pool.written++;
+         WakeAllConditionVariable(&pool.window_moved);
+         ReleaseSRWLockExclusive(&pool.lock);
+     }
+ 
+     WaitForMultipleObjects(started, workers, TRUE, INFINITE);
+     for (int t = 0; t < started; t++) CloseHandle(workers[t]);
+     free(workers);
+     free(pool.order);
+     free(pool.batches);
+     free(pool.jobs);
+ }
+ 
+ // --dedup: content-defined chunks stored once by SHA-256 in a pack entry, an index entry rebuilds the files
+ #define DEDUP_PACK "archiver.dedup/chunks"
+ #define DEDUP_HEADER "# archiver dedup index v1"
+ #define CHUNK_MIN (16 * 1024)
+ #define CHUNK_MAX (256 * 1024)
+ #define CHUNK_BITS 16          // ~64 KB average past CHUNK_MIN
+ 
+ typedef struct DedupChunk {
+     uint8_t digest[MZ_HASH_SHA256_SIZE];
+     uint32_t len;
+ } DedupChunk;
+ 
+ typedef struct DedupStore {
+     DedupChunk *chunks;
+     int32_t count, cap;
+     int32_t *slots;        // open addressing on the digest, -1 = empty
+     int32_t slot_cap;
+     TextBuf files;         // index records, written out on close
+     TextBuf ids;           // chunk ids of the file being added
+     uint64_t gear[256];
+     void *sha;
+     uint8_t *buf;          // READ_CHUNK plus a carried partial chunk
+     bool pack_open;
+     int64_t total_bytes, unique_bytes;
+ } DedupStore;
+ 
+ void text_append(TextBuf *t, const char *s, size_t len) {
+     if (t->len + len + 1 > t->cap) {
+         size_t cap = t->cap ? t->cap : 4096;
+         while (t->len + len + 1 > cap) cap *= 2;
+         t->data = realloc(t->data, cap);
+         t->cap = cap;
+     }
+     memcpy(t->data + t->len, s, len);
+     t->len += len;
+     t->data[t->len] = '\0';
+ }
+ 
+ static DedupStore *dedup_create(void) {
+     DedupStore *d = calloc(1, sizeof(*d));
+     d->buf = malloc(READ_CHUNK + CHUNK_MAX);
+     d->sha = mz_crypt_sha_create();
+     mz_crypt_sha_set_algorithm(d->sha, MZ_HASH_SHA256);
+     d->slot_cap = 1 << 16;
+     d->slots = malloc(d->slot_cap * sizeof(int32_t));
+     memset(d->slots, 0xff, d->slot_cap * sizeof(int32_t));
+     // Fixed splitmix64 sequence, boundaries must not change between runs
+     uint64_t x = 0x9e3779b97f4a7c15ull;
+     for (int i = 0; i < 256; i++) {
+         uint64_t z = (x += 0x9e3779b97f4a7c15ull);
+         z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+         z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+         d->gear[i] = z ^ (z >> 31);
+     }
+     return d;
+ }
+ 
+ static void dedup_free(DedupStore **pd) {
+     DedupStore *d = *pd;
+     if (!d) return;
+     mz_crypt_sha_delete(&d->sha);
+     free(d->chunks);
+     free(d->slots);
+     free(d->files.data);
+     free(d->ids.data);
+     free(d->buf);
+     free(d);
+     *pd = NULL;
+ }
+ 
+ static uint32_t digest_hash(const uint8_t *digest) {
+     uint32_t h;
+     memcpy(&h, digest, sizeof(h));
+     return h;
+ }
+ 
+ static void dedup_rehash(DedupStore *d) {
+     free(d->slots);
+     d->slot_cap *= 2;
+     d->slots = malloc(d->slot_cap * sizeof(int32_t));
+     memset(d->slots, 0xff, d->slot_cap * sizeof(int32_t));
+     for (int32_t i = 0; i < d->count; i++) {
+         uint32_t s = digest_hash(d->chunks[i].digest) & (d->slot_cap - 1);
+         while (d->slots[s] >= 0) s = (s + 1) & (d->slot_cap - 1);
+         d->slots[s] = i;
+     }
+ }
+ 
+ // Length of the next chunk, 0 when more data is needed to find its end
+ static size_t dedup_cut(const DedupStore *d, const uint8_t *p, size_t n, bool eof) {
+     if (n <= CHUNK_MIN) return eof ? n : 0;
+     size_t limit = n < CHUNK_MAX ? n : CHUNK_MAX;
+     uint64_t h = 0;
+     for (size_t i = CHUNK_MIN; i < limit; i++) {
+         h = (h << 1) + d->gear[p[i]];
+         if ((h >> (64 - CHUNK_BITS)) == 0) return i + 1;
+     }
+     return limit == CHUNK_MAX || eof ? limit : 0;
+ }
+ 
+ static int32_t dedup_open_pack(void *zip, uint16_t method) {
+     mz_zip_file file_info = { 0 };
+     file_info.version_madeby = MZ_VERSION_MADEBY;
+     file_info.compression_method = method;
+     file_info.flag = MZ_ZIP_FLAG_UTF8;
+     file_info.filename = DEDUP_PACK;
+     file_info.zip64 = MZ_ZIP64_FORCE;  // size is unknown up front and often large
+     file_info.modified_date = time(NULL);
+     return mz_zip_writer_entry_open(zip, &file_info);
+ }
+ 
+ static int32_t dedup_chunk(DedupStore *d, void *zip, const uint8_t *p, uint32_t len) {
+     uint8_t digest[MZ_HASH_SHA256_SIZE];
+     mz_crypt_sha_reset(d->sha);
+     mz_crypt_sha_set_algorithm(d->sha, MZ_HASH_SHA256);
+     mz_crypt_sha_begin(d->sha);
+     mz_crypt_sha_update(d->sha, p, (int32_t)len);
+     mz_crypt_sha_end(d->sha, digest, sizeof(digest));
+ 
+     uint32_t s = digest_hash(digest) & (d->slot_cap - 1);
+     int32_t id = -1;
+     while (d->slots[s] >= 0) {
+         const DedupChunk *c = &d->chunks[d->slots[s]];
+         if (c->len == len && memcmp(c->digest, digest, sizeof(digest)) == 0) {
+             id = d->slots[s];
+             break;
+         }
+         s = (s + 1) & (d->slot_cap - 1);
+     }
+     if (id < 0) {
+         if (mz_zip_writer_entry_write(zip, p, (int32_t)len) != (int32_t)len) return MZ_WRITE_ERROR;
+         if (d->count >= d->cap) {
+             d->cap = d->cap ? d->cap * 2 : 4096;
+             d->chunks = realloc(d->chunks, d->cap * sizeof(DedupChunk));
+         }
+         id = d->count++;
+         memcpy(d->chunks[id].digest, digest, sizeof(digest));
+         d->chunks[id].len = len;
+         d->slots[s] = id;
+         d->unique_bytes += len;
+         if (d->count * 2 > d->slot_cap) dedup_rehash(d);
+     }
+     char num[16];
+     int n = snprintf(num, sizeof(num), d->ids.len ? " %d" : "%d", id);
+     text_append(&d->ids, num, n);
+     return MZ_OK;
+ }
+ 
+ static void dedup_add_file(DedupStore *d, void *zip, uint16_t method, const FileEntry *e,
+                            const wchar_t *full, const char *relUtf) {
+     HANDLE h = source_open(full, FILE_FLAG_SEQUENTIAL_SCAN);
+     if (h == INVALID_HANDLE_VALUE) {
+         fwprintf(stderr, L"Cannot read %s\n", full);
+         return;
+     }
+     if (!d->pack_open) {
+         if (dedup_open_pack(zip, method) != MZ_OK) {
+             CloseHandle(h);
+             return;
+         }
+         d->pack_open = true;
+     }
+     d->ids.len = 0;
+     size_t have = 0;
+     int64_t total = 0;
+     bool eof = false, ok = true;
+     while (ok && !eof) {
+         DWORD got = 0;
+         if (!io_read(h, d->buf + have, READ_CHUNK, &got)) ok = false;
+         eof = got == 0;
+         have += got;
+         total += got;
+         size_t pos = 0, cut;
+         while (ok && pos < have && (cut = dedup_cut(d, d->buf + pos, have - pos, eof)) > 0) {
+             ok = dedup_chunk(d, zip, d->buf + pos, (uint32_t)cut) == MZ_OK;
+             pos += cut;
+         }
+         memmove(d->buf, d->buf + pos, have - pos);
+         have -= pos;
+     }
+     CloseHandle(h);
+     if (!ok) {
+         fwprintf(stderr, L"Cannot read %s\n", full);
+         return;
+     }
+     d->total_bytes += total;
+     char head[64];
+     int n = snprintf(head, sizeof(head), "%lld\t%llu\t", (long long)total, (unsigned long long)e->mtime);
+     text_append(&d->files, head, n);
+     text_append(&d->files, relUtf, strlen(relUtf));
+     text_append(&d->files, "\n", 1);
+     text_append(&d->files, d->ids.data ? d->ids.data : "", d->ids.len);
+     text_append(&d->files, "\n", 1);
+ }
+ 
+ // Close the pack and write the index entry
+ static int32_t dedup_finish(DedupStore *d, void *zip, const ArchiveOptions *opt) {
+     int32_t err = MZ_OK;
+     if (!d->pack_open && dedup_open_pack(zip, opt->compress_method) == MZ_OK) d->pack_open = true;
+     if (d->pack_open && mz_zip_writer_entry_close(zip) != MZ_OK) err = MZ_CLOSE_ERROR;
+ 
+     TextBuf index = { 0 };
+     char line[64];
+     int n = snprintf(line, sizeof(line), "%s\nchunks %d\n", DEDUP_HEADER, d->count);
+     text_append(&index, line, n);
+     for (int32_t i = 0; i < d->count; i++) {
+         n = snprintf(line, sizeof(line), "%u\n", (unsigned int)d->chunks[i].len);
+         text_append(&index, line, n);
+     }
+     text_append(&index, "files\n", 6);
+     text_append(&index, d->files.data ? d->files.data : "", d->files.len);
+ 
+     mz_zip_file file_info = { 0 };
+     file_info.version_madeby = MZ_VERSION_MADEBY;
+     file_info.compression_method = opt->compress_method;
+     file_info.flag = MZ_ZIP_FLAG_UTF8;
+     file_info.filename = DEDUP_INDEX;
+     file_info.uncompressed_size = index.len;
+     file_info.modified_date = time(NULL);
+     if (mz_zip_writer_entry_open(zip, &file_info) != MZ_OK ||
+         mz_zip_writer_entry_write(zip, index.data, (int32_t)index.len) != (int32_t)index.len ||
+         mz_zip_writer_entry_close(zip) != MZ_OK)
+         err = MZ_WRITE_ERROR;
+     free(index.data);
+     if (!opt->quiet && d->total_bytes > 0)
+         wprintf(L"Dedup: %lld of %lld bytes unique (%d chunks)\n", (long long)d->unique_bytes,
+                 (long long)d->total_bytes, d->count);
+     return err;
+ }
+ 
+ // Create every missing directory on the way to path's parent
+ void make_parent_dirs(wchar_t *path) {
+     for (wchar_t *p = path; *p; p++) {
+         if ((*p == L'\\' || *p == L'/') && p > path && p[-1] != L':') {
+             wchar_t c = *p;
+             *p = L'\0';
+             CreateDirectoryW(path, NULL);
+             *p = c;
+         }
+     }
+ }
+ 
+ // Rebuild the files of a --dedup archive under dest
+ int dedup_extract(const wchar_t *zip_path, const wchar_t *dest) {
+     char zipUtf[PATH_MAX_LEN];
+     WideCharToMultiByte(CP_UTF8, 0, zip_path, -1, zipUtf, PATH_MAX_LEN, NULL, NULL);
+     void *reader = mz_zip_reader_create();
+     if (mz_zip_reader_open_file(reader, zipUtf) != MZ_OK || mz_zip_reader_locate_entry(reader, DEDUP_INDEX, 0) != MZ_OK) {
+         fwprintf(stderr, L"%s is not a dedup archive\n", zip_path);
+         mz_zip_reader_delete(&reader);
+         return 1;
+     }
+     int32_t index_len = mz_zip_reader_entry_save_buffer_length(reader);
+     char *index = index_len >= 0 ? malloc(index_len + 1) : NULL;
+     if (!index || mz_zip_reader_entry_save_buffer(reader, index, index_len) != MZ_OK) {
+         fwprintf(stderr, L"Cannot read the dedup index of %s\n", zip_path);
+         free(index);
+         mz_zip_reader_delete(&reader);
+         return 1;
+     }
+     index[index_len] = '\0';
+ 
+     // The pack is unpacked to a scratch file so chunks can be read in any order
+     wchar_t pack_path[PATH_MAX_LEN];
+     wsprintfW(pack_path, L"%s\\archiver.dedup.tmp", dest);
+     make_parent_dirs(pack_path);
+     char packUtf[PATH_MAX_LEN];
+     WideCharToMultiByte(CP_UTF8, 0, pack_path, -1, packUtf, PATH_MAX_LEN, NULL, NULL);
+     int32_t err = mz_zip_reader_locate_entry(reader, DEDUP_PACK, 0);
+     if (err == MZ_OK) err = mz_zip_reader_entry_save_file(reader, packUtf);
+     mz_zip_reader_close(reader);
+     mz_zip_reader_delete(&reader);
+     HANDLE pack = err == MZ_OK ? CreateFileW(pack_path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                                              FILE_FLAG_DELETE_ON_CLOSE, NULL) : INVALID_HANDLE_VALUE;
+     int chunk_count = 0;
+     char *line = index;
+     if (pack == INVALID_HANDLE_VALUE || strncmp(line, DEDUP_HEADER "\n", sizeof(DEDUP_HEADER)) != 0 ||
+         sscanf(line + sizeof(DEDUP_HEADER), "chunks %d", &chunk_count) != 1 || chunk_count < 0) {
+         fwprintf(stderr, L"Cannot read the chunk pack of %s\n", zip_path);
+         if (pack != INVALID_HANDLE_VALUE) CloseHandle(pack);
+         DeleteFileW(pack_path);
+         free(index);
+         return 1;
+     }
+     line = strchr(line + sizeof(DEDUP_HEADER), '\n') + 1;
+ 
+     int64_t *offsets = malloc((chunk_count + 1) * sizeof(int64_t));
+     offsets[0] = 0;
+     for (int i = 0; i < chunk_count && line; i++) {
+         offsets[i + 1] = offsets[i] + strtoll(line, NULL, 10);
+         line = strchr(line, '\n');
+         if (line) line++;
+     }
+     if (line && strncmp(line, "files\n", 6) == 0) line += 6;
+     else line = NULL;
+ 
+     uint8_t *buf = malloc(CHUNK_MAX);
+     int files = 0, failed = 0;
+     while (line && *line) {
+         long long size;
+         unsigned long long mtime;
+         int name_at = 0;
+         char *ids = strchr(line, '\n');
+         if (!ids || sscanf(line, "%lld\t%llu\t%n", &size, &mtime, &name_at) != 2 || name_at == 0) break;
+         *ids++ = '\0';
+         char *next = strchr(ids, '\n');
+         if (next) *next++ = '\0';
+         // Names come from the archive, none may climb out of dest
+         if (!restore_name_safe(line + name_at)) {
+             fwprintf(stderr, L"Skipping unsafe entry name %hs\n", line + name_at);
+             failed++;
+             line = next;
              continue;
-         wchar_t full_path[PATH_MAX_LEN];
-         wsprintfW(full_path, L"%s\\%s", curr_dir, ffd.cFileName);
-         // compute relative path
-         size_t base_len = wcslen(base_dir);
-         wchar_t rel_part[PATH_MAX_LEN];
-         if (wcsncmp(full_path, base_dir, base_len) == 0 && full_path[base_len] == L'\\')
-             wcscpy(rel_part, full_path + base_len + 1);
-         else
-             wcscpy(rel_part, ffd.cFileName);
-         // resize array if needed
-         if (*cnt >= *cap) {
-             *cap *= 2;
-             *arr = realloc(*arr, (*cap) * sizeof(FileEntry));
-         }
-         wcscpy((*arr)[*cnt].full, full_path);
-         wcscpy((*arr)[*cnt].rel, rel_part);
-         (*cnt)++;
-         if (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
-             collect_entries(base_dir, full_path, arr, cnt, cap);
-     } while (FindNextFileW(hFind, &ffd));
-     FindClose(hFind);
+         }
+ 
+         wchar_t rel[PATH_MAX_LEN], out_path[PATH_MAX_LEN];
+         MultiByteToWideChar(CP_UTF8, 0, line + name_at, -1, rel, PATH_MAX_LEN);
+         wsprintfW(out_path, L"%s\\%s", dest, rel);
+         for (wchar_t *p = out_path; *p; p++) if (*p == L'/') *p = L'\\';
+         make_parent_dirs(out_path);
+         HANDLE h = CreateFileW(out_path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+         bool ok = h != INVALID_HANDLE_VALUE;
+         for (char *p = ids; ok && *p;) {
+             char *end;
+             long id = strtol(p, &end, 10);
+             if (end == p || id < 0 || id >= chunk_count) { ok = false; break; }
+             p = end;
+             DWORD len = (DWORD)(offsets[id + 1] - offsets[id]), got = 0, put = 0;
+             LARGE_INTEGER at = { .QuadPart = offsets[id] };
+             ok = SetFilePointerEx(pack, at, NULL, FILE_BEGIN) && ReadFile(pack, buf, len, &got, NULL) &&
+                  got == len && WriteFile(h, buf, len, &put, NULL) && put == len;
+         }
+         if (h != INVALID_HANDLE_VALUE) {
+             FILETIME ft = { (DWORD)mtime, (DWORD)(mtime >> 32) };
+             SetFileTime(h, NULL, NULL, &ft);
+             CloseHandle(h);
+         }
+         if (ok) files++;
+         else {
+             fwprintf(stderr, L"Cannot restore %s\n", out_path);
+             failed++;
+         }
+         line = next;
+     }
+     free(buf);
+     free(offsets);
+     CloseHandle(pack);
+     free(index);
+     wprintf(L"Restored %d files to %s\n", files, dest);
+     return failed ? 1 : 0;
  }
  
- // Resolve .lnk shortcut to target path
- static BOOL resolve_link(LPCWSTR link_path, LPWSTR out_path, size_t max_len) {
-     IShellLinkW *psl = NULL;
-     IPersistFile *ppf = NULL;
-     HRESULT hr = CoInitialize(NULL);
-     if (FAILED(hr)) return FALSE;
-     hr = CoCreateInstance(&CLSID_ShellLink, NULL, CLSCTX_INPROC_SERVER,
-                           &IID_IShellLinkW, (void**)&psl);
-     if (SUCCEEDED(hr)) hr = psl->lpVtbl->QueryInterface(psl, &IID_IPersistFile, (void**)&ppf);
-     if (SUCCEEDED(hr)) hr = ppf->lpVtbl->Load(ppf, link_path, STGM_READ);
-     if (SUCCEEDED(hr)) hr = psl->lpVtbl->GetPath(psl, out_path, (int)max_len, NULL, SLGP_RAWPATH);
-     if (ppf) ppf->lpVtbl->Release(ppf);
-     if (psl) psl->lpVtbl->Release(psl);
-     CoUninitialize();
-     return SUCCEEDED(hr);
+ // --solid: files up to SOLID_MAX_FILE concatenated by extension into zstd blocks, an index entry locates them
+ #define SOLID_BLOCK ((int64_t)64 << 20)
+ #define SOLID_MAX_FILE ((int64_t)1 << 20)
+ 
+ typedef struct SolidItem {
+     const wchar_t *ext;
+     int index;
+ } SolidItem;
+ 
+ typedef struct SolidBlock {
+     void *zip;             // mz_zip handle under the writer
+     ZSTD_CCtx *cctx;
+     uint8_t *outbuf;
+     int number;            // blocks written so far, the open one included
+     bool open;
+     uint32_t crc;
+     int64_t size;
+     int32_t err;
+ } SolidBlock;
+ 
+ static const wchar_t *solid_ext(const wchar_t *path) {
+     const wchar_t *slash = wcsrchr(path, L'\\');
+     const wchar_t *dot = wcsrchr(slash ? slash : path, L'.');
+     return dot ? dot + 1 : L"";
  }
  
- // Write entries to a ZIP file, excluding hidden/system and desktop.ini in archive step as well
- static void zip_entries(const wchar_t *zip_path_w, FileEntry *entries, int count) {
+ // Same extension together, the walk order inside a group
+ static int solid_item_cmp(const void *a, const void *b) {
+     const SolidItem *x = a, *y = b;
+     int c = _wcsicmp(x->ext, y->ext);
+     return c ? c : x->index - y->index;
+ }
+ 
+ static int32_t solid_block_open(SolidBlock *b) {
+     char name[64];
+     snprintf(name, sizeof(name), SOLID_BLOCK_NAME, b->number);
+     mz_zip_file file_info = { 0 };
+     file_info.version_madeby = MZ_VERSION_MADEBY;
+     file_info.compression_method = MZ_COMPRESS_METHOD_ZSTD;
+     file_info.flag = MZ_ZIP_FLAG_UTF8;
+     file_info.filename = name;
+     file_info.zip64 = MZ_ZIP64_FORCE;  // size is unknown up front
+     file_info.modified_date = time(NULL);
+     b->err = mz_zip_entry_write_open(b->zip, &file_info, MZ_COMPRESS_LEVEL_DEFAULT, 1, NULL);
+     b->open = b->err == MZ_OK;
+     b->crc = 0;
+     b->size = 0;
+     b->number++;
+     return b->err;
+ }
+ 
+ static void solid_block_write(SolidBlock *b, const uint8_t *p, size_t len, bool end) {
+     b->crc = crc32_update(b->crc, p, (int32_t)len);
+     b->size += len;
+     ZSTD_inBuffer input = { p, len, 0 };
+     size_t remaining;
+     do {
+         ZSTD_outBuffer output = { b->outbuf, READ_CHUNK, 0 };
+         remaining = ZSTD_compressStream2(b->cctx, &output, &input, end ? ZSTD_e_end : ZSTD_e_continue);
+         if (ZSTD_isError(remaining)) {
+             b->err = MZ_STREAM_ERROR;
+             break;
+         }
+         if (output.pos && mz_zip_entry_write(b->zip, b->outbuf, (int32_t)output.pos) != (int32_t)output.pos)
+             b->err = MZ_WRITE_ERROR;
+     } while (b->err == MZ_OK && (end ? remaining != 0 : input.pos < input.size));
+ }
+ 
+ static void solid_block_close(SolidBlock *b) {
+     if (b->err == MZ_OK) solid_block_write(b, NULL, 0, true);
+     if (mz_zip_entry_close_raw(b->zip, b->size, b->crc) != MZ_OK && b->err == MZ_OK) b->err = MZ_CLOSE_ERROR;
+     b->open = false;
+ }
+ 
+ // Write the small files of list as solid blocks plus their index. rest receives a view
+ // of the remaining files that shares list's pools; only rest->items is its own.
+ static void solid_add_list(ZipOutput *out, const EntryList *list, EntryList *rest) {
+     const ArchiveOptions *opt = out->opt;
+     *rest = *list;
+     rest->items = malloc(((size_t)list->count + 1) * sizeof(FileEntry));
+     rest->count = rest->cap = 0;
+     SolidItem *items = malloc(((size_t)list->count + 1) * sizeof(SolidItem));
+     int n = 0;
+     for (int i = 0; i < list->count; i++) {
+         const FileEntry *e = &list->items[i];
+         if (e->attr & FILE_ATTRIBUTE_DIRECTORY) continue;
+         if (e->size <= SOLID_MAX_FILE) items[n++] = (SolidItem){ solid_ext(entry_full(list, e)), i };
+         else rest->items[rest->count++] = *e;
+     }
+     rest->cap = rest->count;
+     qsort(items, n, sizeof(SolidItem), solid_item_cmp);
+ 
+     SolidBlock b = { 0 };
+     mz_zip_writer_get_zip_handle(out->zip, &b.zip);
+     b.cctx = ZSTD_createCCtx();
+     b.outbuf = malloc(READ_CHUNK);
+     uint8_t *buf = malloc(READ_CHUNK);
+     if (!b.zip || !b.cctx || !b.outbuf || !buf) n = 0;
+     if (b.cctx) {
+         int level = opt->compress_level > 0 ? opt->compress_level : 3;
+         ZSTD_CCtx_setParameter(b.cctx, ZSTD_c_compressionLevel, level);
+         // A libzstd built without threads rejects nbWorkers and compresses on this thread
+         if (opt->threads > 1) ZSTD_CCtx_setParameter(b.cctx, ZSTD_c_nbWorkers, opt->threads);
+     }
+     TextBuf index = { 0 };
+     text_append(&index, SOLID_HEADER "\n", sizeof(SOLID_HEADER));
+     int members = 0;
+     for (int k = 0; k < n; k++) {
+         const FileEntry *e = &list->items[items[k].index];
+         const wchar_t *full = entry_full(list, e);
+         const char *relUtf = entry_name(list, e);
+         if (out->progress) {
+             wchar_t rel_buf[PATH_MAX_LEN];
+             progress_begin(out->progress, entry_rel(list, e, rel_buf));
+         }
+         HANDLE h = source_open(full, FILE_FLAG_SEQUENTIAL_SCAN);
+         if (h == INVALID_HANDLE_VALUE) {
+             fwprintf(stderr, L"Cannot read %s\n", full);
+             out->skipped = true;
+             continue;
+         }
+         if (b.open && b.size + e->size > SOLID_BLOCK) {
+             solid_block_close(&b);
+             volume_check(out);
+         }
+         if (!b.open && solid_block_open(&b) != MZ_OK) {
+             CloseHandle(h);
+             break;
+         }
+         // Whatever the file holds now is recorded, the index follows the block
+         int64_t offset = b.size;
+         DWORD got = 0;
+         while (b.err == MZ_OK && io_read(h, buf, READ_CHUNK, &got) && got > 0)
+             solid_block_write(&b, buf, got, false);
+         CloseHandle(h);
+         if (b.err != MZ_OK) break;
+         char head[96];
+         int len = snprintf(head, sizeof(head), "%d\t%lld\t%lld\t%llu\t%lx\t", b.number - 1, (long long)offset,
+                            (long long)(b.size - offset), (unsigned long long)e->mtime, (unsigned long)e->attr);
+         text_append(&index, head, len);
+         text_append(&index, relUtf, strlen(relUtf));
+         text_append(&index, "\n", 1);
+         members++;
+         if (out->progress) progress_end(out->progress, e->size, output_size(out));
+     }
+     if (b.open) solid_block_close(&b);
+     if (b.err != MZ_OK) fwprintf(stderr, L"Cannot write solid block %d of %s (%d)\n", b.number - 1, out->path, b.err);
+ 
+     mz_zip_file file_info = { 0 };
+     file_info.version_madeby = MZ_VERSION_MADEBY;
+     file_info.compression_method = MZ_COMPRESS_METHOD_ZSTD;
+     file_info.flag = MZ_ZIP_FLAG_UTF8;
+     file_info.filename = SOLID_INDEX;
+     file_info.uncompressed_size = index.len;
+     file_info.modified_date = time(NULL);
+     if (mz_zip_writer_entry_open(out->zip, &file_info) != MZ_OK ||
+         mz_zip_writer_entry_write(out->zip, index.data, (int32_t)index.len) != (int32_t)index.len ||
+         mz_zip_writer_entry_close(out->zip) != MZ_OK)
+         fwprintf(stderr, L"Cannot write the solid index of %s\n", out->path);
+     if (!opt->quiet) wprintf(L"Solid: %d files in %d blocks\n", members, b.number);
+     free(index.data);
+     free(buf);
+     free(b.outbuf);
+     ZSTD_freeCCtx(b.cctx);
+     free(items);
+ }
+ 
+ // Open the output archive; with a manifest the previous archive is moved aside for reuse
+ bool zip_open_output(ZipOutput *out, const wchar_t *zip_path_w, const wchar_t *manifest_path,
+                      const ArchiveOptions *opt) {
+     memset(out, 0, sizeof(*out));
+     out->opt = opt;
+     wcscpy(out->path, zip_path_w);
+     if (manifest_path) {
+         wcscpy(out->manifest_path, manifest_path);
+         if (manifest_load(&out->prev, manifest_path) && GetFileAttributesW(zip_path_w) != INVALID_FILE_ATTRIBUTES) {
+             wsprintfW(out->prev_path, L"%s.prev", zip_path_w);
+             if (!MoveFileExW(zip_path_w, out->prev_path, MOVEFILE_REPLACE_EXISTING))
+                 out->prev_path[0] = L'\0';
+             else if (!prev_open(out))
+                 fwprintf(stderr, L"Cannot read previous archive %s, recompressing everything\n", out->prev_path);
+         }
+     }
+     if (opt->resume) journal_resume(out, zip_path_w);
      char zipPath[PATH_MAX_LEN];
      WideCharToMultiByte(CP_UTF8, 0, zip_path_w, -1, zipPath, PATH_MAX_LEN, NULL, NULL);
-     void *zip = mz_zip_writer_create();
-     if (mz_zip_writer_open_file(zip, zipPath, 0, 0) != MZ_OK) {
+     out->zip = mz_zip_writer_create();
+     writer_apply_options(out->zip, opt);
+     if (sink_target(zip_path_w)) {
+         out->stream = sink_create();
+         if (!out->stream || mz_stream_open(out->stream, zipPath, MZ_OPEN_MODE_WRITE | MZ_OPEN_MODE_CREATE) != MZ_OK ||
+             mz_zip_writer_open(out->zip, out->stream, 0) != MZ_OK) {
+             fwprintf(stderr, L"Cannot open %s\n", zip_path_w);
+             if (out->stream) mz_stream_delete(&out->stream);
+             mz_zip_writer_delete(&out->zip);
+             return false;
+         }
+         // Sizes and CRC follow each entry, no local header is rewritten
+         void *handle = NULL;
+         mz_zip_writer_get_zip_handle(out->zip, &handle);
+         mz_zip_set_data_descriptor(handle, 1);
+     } else if (opt->direct_io || opt->resume) {
+         // Checkpoints need an output that can be flushed to disk, the unbuffered stream can
+         out->stream = async_create();
+         if (out->stream && (mz_stream_open(out->stream, zipPath, MZ_OPEN_MODE_WRITE | MZ_OPEN_MODE_CREATE) != MZ_OK ||
+                             mz_zip_writer_open(out->zip, out->stream, 0) != MZ_OK))
+             mz_stream_delete(&out->stream);
+         if (!out->stream)
+             fwprintf(stderr, L"Unbuffered output unavailable for %s, using buffered writes%s\n", zip_path_w,
+                      opt->resume ? L" without checkpoints" : L"");
+     }
+     if (opt->resume && !out->stream) out->journal.h = INVALID_HANDLE_VALUE;
+     if (opt->volume_size > 0) volume_clear(zip_path_w);
+     if (!out->stream && (tracer || governor) && (out->traced = trace_output_open(zipPath, opt->volume_size)) != NULL &&
+         mz_zip_writer_open(out->zip, out->traced, 0) != MZ_OK) {
+         mz_stream_close(out->traced);
+         stream_chain_delete(&out->traced);
+     }
+     if (!out->stream && !out->traced && mz_zip_writer_open_file(out->zip, zipPath, opt->volume_size, 0) != MZ_OK) {
          fwprintf(stderr, L"Cannot open %s\n", zip_path_w);
-         mz_zip_writer_delete(&zip);
+         mz_zip_writer_delete(&out->zip);
+         if (out->prev_reader) mz_zip_reader_delete(&out->prev_reader);
+         if (out->prev_path[0]) MoveFileExW(out->prev_path, zip_path_w, MOVEFILE_REPLACE_EXISTING);
+         if (opt->resume && out->prev_path[0]) {
+             wchar_t partial_journal[PATH_MAX_LEN];
+             wsprintfW(partial_journal, L"%s.partial.journal", zip_path_w);
+             MoveFileExW(partial_journal, out->journal.path, MOVEFILE_REPLACE_EXISTING);
+         }
+         manifest_free(&out->prev);
+         return false;
+     }
+     if (opt->dedup) out->dedup = dedup_create();
+     if (opt->volume_size > 0 && !(out->volumes = volume_start(zip_path_w, opt->volume_cmd)))
+         fwprintf(stderr, L"Cannot start the volume thread, volumes of %s are not flushed\n", zip_path_w);
+     // Dictionary entries copied from the previous archive only decode with its dictionary, keep it
+     size_t dict_len = 0;
+     uint8_t *dict_data = out->prev_zip ? dict_read(out->prev_zip, &dict_len) : NULL;
+     if (dict_data) {
+         out->dict = dict_create(dict_data, dict_len, dict_level(opt), opt->dict && !out->dedup);
+         dict_store(out->zip, out->dict);
+     }
+     if (!opt->quiet && (out->progress = progress_start()) != NULL) {
+         mz_zip_writer_set_progress_cb(out->zip, out->progress, progress_writer_cb);
+         mz_zip_writer_set_progress_interval(out->zip, PROGRESS_INTERVAL_MS);
+     }
+     return true;
+ }
+ 
+ // Give the progress display its totals when the whole tree is known up front
+ static void zip_set_totals(ZipOutput *out, const EntryList *list) {
+     if (!out->progress) return;
+     for (int i = 0; i < list->count; i++) {
+         if (list->items[i].attr & FILE_ATTRIBUTE_DIRECTORY) continue;
+         out->progress->files_total++;
+         out->progress->bytes_total += list->items[i].size;
+     }
+ }
+ 
+ // Write a list of entries
+ void zip_add_list(ZipOutput *out, const EntryList *list) {
+     // Solid blocks take the small files, the rest goes on below as usual
+     EntryList rest;
+     if (out->opt->solid) {
+         solid_add_list(out, list, &rest);
+         list = &rest;
+     }
+     if (out->opt->threads > 1 && !out->dedup) {
+         zip_entries_parallel(out, list);
+         if (list == &rest) free(rest.items);
          return;
      }
+     for (int i = 0; i < list->count; i++) {
+         const FileEntry *e = &list->items[i];
+         if (e->attr & FILE_ATTRIBUTE_DIRECTORY) continue;
+         const wchar_t *full = entry_full(list, e);
+         const char *relUtf = entry_name(list, e);
+         if (out->progress) {
+             wchar_t rel_buf[PATH_MAX_LEN];
+             progress_begin(out->progress, entry_rel(list, e, rel_buf));
+         }
+         int64_t start = output_size(out), began = trace_begin();
+         if (out->dedup)
+             dedup_add_file(out->dedup, out->zip, out->opt->compress_method, e, full, relUtf);
+         else
+             zip_write_file(out, e, full, relUtf);
+         entry_written(out, e, relUtf, start, began);
+         if (out->progress) progress_end(out->progress, e->size, output_size(out));
+     }
+     if (list == &rest) free(rest.items);
+ }
+ 
+ void zip_close_output(ZipOutput *out, int count) {
+     progress_stop(&out->progress);
+     if (!out->opt->quiet) wprintf(L"Done: %d items -> %s\n", count, out->path);
+     if (out->dedup) {
+         if (dedup_finish(out->dedup, out->zip, out->opt) != MZ_OK)
+             fwprintf(stderr, L"Cannot write the dedup index of %s\n", out->path);
+         dedup_free(&out->dedup);
+     }
+     bool complete = mz_zip_writer_close(out->zip) == MZ_OK && !out->broken;
+     mz_zip_writer_delete(&out->zip);
+     if (out->stream) {
+         if (mz_stream_close(out->stream) != MZ_OK) {
+             fwprintf(stderr, L"Write error on %s\n", out->path);
+             complete = false;
+         }
+         mz_stream_delete(&out->stream);
+     }
+     if (out->traced) {
+         if (mz_stream_close(out->traced) != MZ_OK) {
+             fwprintf(stderr, L"Write error on %s\n", out->path);
+             complete = false;
+         }
+         stream_chain_delete(&out->traced);
+     }
+     if (out->volumes) volume_finish(out);
+     if (out->journal.path[0]) journal_finish(out, complete);
+     if (out->opt->index && !out->broken && !index_write(out->path))
+         fwprintf(stderr, L"Cannot write index %s.idx\n", out->path);
+     if (out->manifest_path[0] && !out->broken) {
+         char zipPath[PATH_MAX_LEN];
+         WideCharToMultiByte(CP_UTF8, 0, out->path, -1, zipPath, PATH_MAX_LEN, NULL, NULL);
+         manifest_fill_crc(&out->next, zipPath);
+         bool saved = manifest_save(&out->next, out->manifest_path);
+         if (!saved) fwprintf(stderr, L"Cannot write manifest %s\n", out->manifest_path);
+         // The --usn journal mark only vouches for a manifest holding every file. Without a
+         // mark from this run an older one is kept, it replays a superset of the changes.
+         wchar_t state_path[PATH_MAX_LEN], next_path[PATH_MAX_LEN];
+         wsprintfW(state_path, L"%s.usn", out->manifest_path);
+         wsprintfW(next_path, L"%s.usn.next", out->manifest_path);
+         if (saved && !out->skipped) {
+             MoveFileExW(next_path, state_path, MOVEFILE_REPLACE_EXISTING);
+         } else {
+             DeleteFileW(state_path);
+             DeleteFileW(next_path);
+         }
+         if (out->prev_zip)
+             wprintf(L"Unchanged: %d entries copied from the previous archive\n", out->copied);
+     }
+     if (out->prev_reader) {
+         mz_zip_reader_close(out->prev_reader);
+         mz_zip_reader_delete(&out->prev_reader);
+     }
+     // An unfinished --resume run still needs the interrupted archive. A broken incremental run
+     // puts the previous archive back, its manifest and index still describe it.
+     if (out->broken && !out->journal.path[0] && out->prev_path[0]) {
+         fwprintf(stderr, L"%s is incomplete, the previous archive was put back\n", out->path);
+         MoveFileExW(out->prev_path, out->path, MOVEFILE_REPLACE_EXISTING);
+     } else if (out->prev_path[0] && (complete || !out->journal.path[0])) {
+         DeleteFileW(out->prev_path);
+     }
+     manifest_free(&out->prev);
+     manifest_free(&out->next);
+     dict_free(&out->dict);
+ }
+ 
+ // Write entries to a ZIP file, excluding hidden/system and desktop.ini in archive step as well
+ static void zip_entries(const wchar_t *zip_path_w, const wchar_t *manifest_path, const EntryList *list,
+                         const ArchiveOptions *opt) {
+     ZipOutput out;
+     if (!zip_open_output(&out, zip_path_w, manifest_path, opt)) return;
+     if (opt->dict && !out.dict) {
+         size_t dict_len = 0;
+         uint8_t *dict_data = dict_train(list, &dict_len, opt->quiet);
+         if (dict_data) {
+             out.dict = dict_create(dict_data, dict_len, dict_level(opt), true);
+             dict_store(out.zip, out.dict);
+         } else if (!opt->quiet) {
+             wprintf(L"Dictionary: too few small files to train one\n");
+         }
+     }
+     zip_set_totals(&out, list);
+     zip_add_list(&out, list);
+     zip_close_output(&out, list->count);
+ }
+ 
+ // Resolve every .lnk in source_folder, returns the number of usable targets (-1 if none were found).
+ // A link whose target is the tree of another link, or inside it, is dropped so nothing is walked twice.
+ static int gather_links(const wchar_t *source_folder, LinkTarget **out) {
+     WIN32_FIND_DATAW ffd;
+     wchar_t pattern[PATH_MAX_LEN];
+     wsprintfW(pattern, L"%s\\*.lnk", source_folder);
+     HANDLE hFind = FindFirstFileW(pattern, &ffd);
+     *out = NULL;
+     if (hFind == INVALID_HANDLE_VALUE) return -1;
+     LinkTarget *links = NULL;
+     int count = 0, cap = 0;
+     do {
+         if (count >= cap) {
+             cap = cap ? cap * 2 : 16;
+             links = realloc(links, cap * sizeof(LinkTarget));
+         }
+         wcscpy(links[count++].name, ffd.cFileName);
+     } while (FindNextFileW(hFind, &ffd));
+     FindClose(hFind);
+ 
+     LinkBatch batch = { .folder = source_folder, .links = links, .count = count };
+     batch.resolved = calloc(count, sizeof(bool));
+     HANDLE workers[LINK_WORKERS_MAX];
+     int started = 0;
+     if (count >= LINK_PARALLEL_MIN) {
+         int want = (int)GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+         if (want > LINK_WORKERS_MAX) want = LINK_WORKERS_MAX;
+         // The calling thread is one of them
+         for (int t = 1; t < want; t++)
+             if ((workers[started] = CreateThread(NULL, 0, link_worker, &batch, 0, NULL)) != NULL) started++;
+     }
+     link_batch_run(&batch);
+     if (started) WaitForMultipleObjects(started, workers, TRUE, INFINITE);
+     for (int t = 0; t < started; t++) CloseHandle(workers[t]);
+ 
+     bool *keep = calloc(count, sizeof(bool));
+     for (int i = 0; i < count; i++) {
+         if (!batch.resolved[i]) continue;
+         int cover = -1;
+         for (int j = 0; j < count && cover < 0; j++) {
+             // Of two links to the same tree the first one stays
+             if (j != i && batch.resolved[j] && link_covers(links[j].target, links[i].target) &&
+                 (j < i || !link_covers(links[i].target, links[j].target)))
+                 cover = j;
+         }
+         keep[i] = cover < 0;
+         if (cover >= 0)
+             wprintf(L"Skipping %s: %s is already archived through %s\n", links[i].name, links[i].target,
+                     links[cover].name);
+     }
+     int kept = 0;
      for (int i = 0; i < count; i++) {
-         DWORD attr = GetFileAttributesW(entries[i].full);
-         // Skip hidden/system
-         if (attr & (FILE_ATTRIBUTE_HIDDEN | FILE_ATTRIBUTE_SYSTEM))
+         if (!keep[i]) continue;
+         LinkTarget *l = &links[kept++];
+         if (l != &links[i]) *l = links[i];
+         wchar_t *dot = wcsrchr(l->name, L'.'); if (dot) *dot = L'\0';
+         const wchar_t suf[] = L" - Ярлык"; size_t ln = wcslen(l->name), sl = wcslen(suf);
+         if (ln>sl && wcscmp(l->name+ln-sl, suf)==0) l->name[ln-sl]=L'\0';
+     }
+     free(keep);
+     free(batch.resolved);
+     *out = links;
+     return kept;
+ }
+ 
+ typedef struct StreamProducer {
+     const LinkTarget *links;
+     int count;
+     bool prefixed;   // prefix relative names with the link folder name
+     EntryQueue *queue;
+ } StreamProducer;
+ 
+ static DWORD WINAPI stream_producer(LPVOID param) {
+     StreamProducer *p = param;
+     EntryList list = { .queue = p->queue, .batch_limit = STREAM_BATCH };
+     for (int i = 0; i < p->count; i++) {
+         int32_t prefix = p->prefixed ? list_add_prefix(&list, p->links[i].name) : -1;
+         int64_t start = trace_begin();
+         collect_entries(p->links[i].target, p->links[i].target, &list, prefix);
+         trace_end(TRACE_WALK, start, 0);
+     }
+     if (list.count > 0) {
+         list_flush(&list);
+     }
+     list_free(&list);
+     queue_close(p->queue);
+     return 0;
+ }
+ 
+ // Walk links on a producer thread while the calling thread compresses, returns the entry count
+ static int stream_archive(const wchar_t *zip_path_w, const wchar_t *manifest_path, const LinkTarget *links,
+                           int count, bool prefixed, const ArchiveOptions *opt) {
+     EntryQueue queue;
+     queue_init(&queue);
+     StreamProducer producer = { links, count, prefixed, &queue };
+     HANDLE thread = CreateThread(NULL, 0, stream_producer, &producer, 0, NULL);
+     if (!thread) {
+         // No producer thread, fall back to walking everything up front
+         EntryList list = {0};
+         for (int i = 0; i < count; i++)
+             collect_entries(links[i].target, links[i].target, &list,
+                             prefixed ? list_add_prefix(&list, links[i].name) : -1);
+         int total = list.count;
+         zip_entries(zip_path_w, manifest_path, &list, opt);
+         list_free(&list);
+         return total;
+     }
+     ZipOutput out;
+     bool opened = zip_open_output(&out, zip_path_w, manifest_path, opt);
+     int done = 0;
+     EntryList *batch;
+     // Keep draining even if the output failed so the producer can finish
+     while ((batch = queue_pop(&queue)) != NULL) {
+         if (opened) zip_add_list(&out, batch);
+         done += batch->count;
+         list_free(batch);
+         free(batch);
+     }
+     WaitForSingleObject(thread, INFINITE);
+     CloseHandle(thread);
+     if (opened) zip_close_output(&out, done);
+     return done;
+ }
+ 
+ // --split --jobs: links are archived concurrently, volume_limit per source volume, biggest tree first
+ typedef struct SplitJob {
+     const LinkTarget *link;
+     int volume;          // index into the distinct source volumes
+     EntryList entries;   // walked tree, empty when streaming
+     int64_t files;
+     int64_t bytes;
+     bool started;
+ } SplitJob;
+ 
+ typedef struct SplitScheduler {
+     SplitJob *jobs;
+     SplitJob **order;     // jobs in the order they are handed out
+     int count;
+     int *volume_active;
+     int volume_limit;
+     bool archive_phase;   // false while walking, true while archiving
+     int finished;
+     const ArchiveOptions *opt;
+     const wchar_t *output;
+     bool quiet;           // the caller's setting, the jobs themselves always run quiet
+     Progress *progress;   // one reporter for all links, NULL while walking or streaming
+     SRWLOCK lock;
+     CONDITION_VARIABLE changed;
+ } SplitScheduler;
+ 
+ static void split_paths(const SplitScheduler *s, const SplitJob *job, wchar_t *zip_path, wchar_t *manifest_path) {
+     wsprintfW(zip_path, L"%s\\%s.zip", s->output, job->link->name);
+     // With --split the manifest option names a directory holding one manifest per link
+     if (s->opt->manifest) wsprintfW(manifest_path, L"%s\\%s.manifest", s->opt->manifest, job->link->name);
+ }
+ 
+ static void split_run(SplitScheduler *s, SplitJob *job) {
+     const ArchiveOptions *opt = s->opt;
+     wchar_t zip_path[PATH_MAX_LEN], manifest_path[PATH_MAX_LEN];
+     split_paths(s, job, zip_path, manifest_path);
+     const wchar_t *manifest = opt->manifest ? manifest_path : NULL;
+     if (!s->archive_phase) {
+         int32_t none = -1;
+         collect_links(job->link, &none, 1, &job->entries, opt, manifest, zip_path);
+         for (int i = 0; i < job->entries.count; i++) {
+             if (job->entries.items[i].attr & FILE_ATTRIBUTE_DIRECTORY) continue;
+             job->files++;
+             job->bytes += job->entries.items[i].size;
+         }
+         return;
+     }
+     if (opt->stream)
+         stream_archive(zip_path, manifest, job->link, 1, false, opt);
+     else
+         zip_entries(zip_path, manifest, &job->entries, opt);
+     list_free(&job->entries);
+ }
+ 
+ static DWORD WINAPI split_worker(LPVOID param) {
+     SplitScheduler *s = param;
+     AcquireSRWLockExclusive(&s->lock);
+     for (;;) {
+         SplitJob *job = NULL;
+         bool waiting = false;
+         for (int i = 0; i < s->count && !job; i++) {
+             SplitJob *j = s->order[i];
+             if (j->started) continue;
+             waiting = true;
+             if (s->volume_active[j->volume] < s->volume_limit) job = j;
+         }
+         if (!job) {
+             if (!waiting) break;
+             SleepConditionVariableSRW(&s->changed, &s->lock, INFINITE, 0);
              continue;
-         // Skip desktop.ini by name
-         {
-             const wchar_t *fname = wcsrchr(entries[i].full, L'\\');
-             if (fname && _wcsicmp(fname + 1, L"desktop.ini") == 0)
-                 continue;
          }
-         char fullUtf[PATH_MAX_LEN], relUtf[PATH_MAX_LEN];
-         WideCharToMultiByte(CP_UTF8, 0, entries[i].full, -1, fullUtf, PATH_MAX_LEN, NULL, NULL);
-         WideCharToMultiByte(CP_UTF8, 0, entries[i].rel, -1, relUtf, PATH_MAX_LEN, NULL, NULL);
-         int pct = (i * 100) / count;
-         wprintf(L"[%3d%%] %s\r", pct, entries[i].rel);
-         if (!(attr & FILE_ATTRIBUTE_DIRECTORY)) {
-             mz_zip_writer_add_file(zip, fullUtf, relUtf);
+         job->started = true;
+         s->volume_active[job->volume]++;
+         ReleaseSRWLockExclusive(&s->lock);
+ 
+         split_run(s, job);
+ 
+         AcquireSRWLockExclusive(&s->lock);
+         s->volume_active[job->volume]--;
+         s->finished++;
+         if (s->archive_phase && s->progress) {
+             progress_begin(s->progress, job->link->name);
+             InterlockedAdd64(&s->progress->files_done, job->files);
+             InterlockedAdd64(&s->progress->bytes_in, job->bytes);
+         } else if (s->archive_phase && !s->quiet) {
+             wprintf(L"[%d/%d] %s\n", s->finished, s->count, job->link->name);
          }
+         WakeAllConditionVariable(&s->changed);
      }
-     wprintf(L"\nDone: %d items -> %s\n", count, zip_path_w);
-     mz_zip_writer_close(zip);
-     mz_zip_writer_delete(&zip);
+     ReleaseSRWLockExclusive(&s->lock);
+     return 0;
  }
  
- int wmain(int argc, wchar_t *argv[]) {
-     setlocale(LC_ALL, "");
-     bool split = false;
-     int arg = 1;
-     if (argc > 1 && wcscmp(argv[1], L"--split") == 0) {
-         split = true;
-         arg++;
+ static void split_pass(SplitScheduler *s, bool archive_phase, int jobs) {
+     s->archive_phase = archive_phase;
+     s->finished = 0;
+     for (int i = 0; i < s->count; i++) s->jobs[i].started = false;
+     HANDLE *threads = malloc(jobs * sizeof(HANDLE));
+     int started = 0;
+     for (int i = 0; i < jobs; i++) {
+         threads[started] = CreateThread(NULL, 0, split_worker, s, 0, NULL);
+         if (threads[started]) started++;
      }
-     if ((!split && argc != 3) || (split && argc != 4)) {
-         fwprintf(stderr, L"Usage: %s [--split] <source_folder> <output_%s>\n",
-                 argv[0], split ? L"directory" : L"zip");
-         return 1;
+     // No threads at all: do the work on this one
+     if (started == 0) split_worker(s);
+     WaitForMultipleObjects(started, threads, TRUE, INFINITE);
+     for (int i = 0; i < started; i++) CloseHandle(threads[i]);
+     free(threads);
+ }
+ 
+ static int split_job_cmp(const void *a, const void *b) {
+     int64_t x = (*(SplitJob *const *)a)->bytes, y = (*(SplitJob *const *)b)->bytes;
+     return x < y ? 1 : x > y ? -1 : 0;
+ }
+ 
+ static void split_archive_concurrent(const wchar_t *output, const LinkTarget *links, int count,
+                                      const ArchiveOptions *opt, int jobs, int volume_limit) {
+     SplitScheduler s = { .count = count, .volume_limit = volume_limit, .output = output };
+     s.jobs = calloc(count, sizeof(SplitJob));
+     s.order = malloc(count * sizeof(SplitJob *));
+     s.volume_active = calloc(count, sizeof(int));
+     InitializeSRWLock(&s.lock);
+     InitializeConditionVariable(&s.changed);
+     // Group links by the volume their target lives on
+     wchar_t (*volumes)[PATH_MAX_LEN] = malloc(count * sizeof(*volumes));
+     int volume_count = 0;
+     for (int i = 0; i < count; i++) {
+         wchar_t vol[PATH_MAX_LEN];
+         if (!GetVolumePathNameW(links[i].target, vol, PATH_MAX_LEN)) wcscpy(vol, links[i].target);
+         int v = 0;
+         while (v < volume_count && _wcsicmp(volumes[v], vol) != 0) v++;
+         if (v == volume_count) wcscpy(volumes[volume_count++], vol);
+         s.jobs[i].link = &links[i];
+         s.jobs[i].volume = v;
+         s.order[i] = &s.jobs[i];
      }
-     LPCWSTR source_folder = argv[arg];
-     LPCWSTR output = argv[arg + 1];
+     free(volumes);
+ 
+     // Concurrent jobs would garble the per-file progress line, report per link instead
+     ArchiveOptions job_opt = *opt;
+     job_opt.quiet = true;
+     s.opt = &job_opt;
+     s.quiet = opt->quiet;
+     if (!opt->stream) {
+         split_pass(&s, false, jobs);
+         qsort(s.order, count, sizeof(SplitJob *), split_job_cmp);
+         // The walk gave the totals, the reporter advances as links finish
+         if (!opt->quiet && (s.progress = progress_start()) != NULL) {
+             for (int i = 0; i < count; i++) {
+                 s.progress->files_total += s.jobs[i].files;
+                 s.progress->bytes_total += s.jobs[i].bytes;
+             }
+         }
+     }
+     split_pass(&s, true, jobs);
+     progress_stop(&s.progress);
+     free(s.volume_active);
+     free(s.order);
+     free(s.jobs);
+ }
  
+ static int archive_links(const wchar_t *source_folder, const wchar_t *output, LinkTarget *links, int link_count,
+                          bool split, int jobs, int volume_jobs, const ArchiveOptions *opt) {
      if (split) {
          // Ensure output directory exists
          if (!CreateDirectoryW(output, NULL) && GetLastError() != ERROR_ALREADY_EXISTS) {
              fwprintf(stderr, L"Cannot create or access output dir %s\n", output);
              return 1;
          }
-         // Enumerate .lnk files
-         WIN32_FIND_DATAW ffd;
-         wchar_t pattern[PATH_MAX_LEN];
-         wsprintfW(pattern, L"%s\\*.lnk", source_folder);
-         HANDLE hFind = FindFirstFileW(pattern, &ffd);
-         if (hFind == INVALID_HANDLE_VALUE) {
+         if (link_count < 0) {
              wprintf(L"No .lnk files found in %s\n", source_folder);
              return 1;
          }
-         do {
-             wchar_t link_path[PATH_MAX_LEN]; wsprintfW(link_path, L"%s\\%s", source_folder, ffd.cFileName);
-             wchar_t target_dir[PATH_MAX_LEN]; if (!resolve_link(link_path, target_dir, PATH_MAX_LEN)) continue;
-             wchar_t link_name[PATH_MAX_LEN]; wcscpy(link_name, ffd.cFileName);
-             wchar_t *dot = wcsrchr(link_name, L'.'); if (dot) *dot = L'\0';
-             const wchar_t suf[] = L" - Ярлык"; size_t ln = wcslen(link_name), sl = wcslen(suf);
-             if (ln>sl && wcscmp(link_name+ln-sl, suf)==0) link_name[ln-sl]=L'\0';
-             FileEntry *temp = malloc(16*sizeof(FileEntry)); int cnt=0, cap=16;
-             collect_entries(target_dir, target_dir, &temp, &cnt, &cap);
-             wchar_t zip_path[PATH_MAX_LEN]; wsprintfW(zip_path, L"%s\\%s.zip", output, link_name);
-             zip_entries(zip_path, temp, cnt);
-             free(temp);
-         } while (FindNextFileW(hFind, &ffd));
-         FindClose(hFind);
+         if (jobs > 1 && link_count > 1) {
+             split_archive_concurrent(output, links, link_count, opt, jobs, volume_jobs);
+             return 0;
+         }
+         for (int i = 0; i < link_count; i++) {
+             wchar_t zip_path[PATH_MAX_LEN]; wsprintfW(zip_path, L"%s\\%s.zip", output, links[i].name);
+             // With --split the manifest option names a directory holding one manifest per link
+             wchar_t manifest_path[PATH_MAX_LEN];
+             if (opt->manifest) wsprintfW(manifest_path, L"%s\\%s.manifest", opt->manifest, links[i].name);
+             const wchar_t *manifest = opt->manifest ? manifest_path : NULL;
+             if (opt->stream) {
+                 stream_archive(zip_path, manifest, &links[i], 1, false, opt);
+                 continue;
+             }
+             EntryList temp = {0};
+             int32_t none = -1;
+             collect_links(&links[i], &none, 1, &temp, opt, manifest, zip_path);
+             zip_entries(zip_path, manifest, &temp, opt);
+             list_free(&temp);
+         }
+     } else if (opt->stream) {
+         if (stream_archive(output, opt->manifest, links, link_count, true, opt) == 0) {
+             wprintf(L"No files to archive.\n");
+             return 1;
+         }
      } else {
-         FileEntry *entries = malloc(16 * sizeof(FileEntry)); int count=0, cap=16;
-         WIN32_FIND_DATAW ffd;
-         wchar_t link_pattern[PATH_MAX_LEN]; wsprintfW(link_pattern, L"%s\\*.lnk", source_folder);
-         HANDLE hFind = FindFirstFileW(link_pattern, &ffd);
-         if (hFind != INVALID_HANDLE_VALUE) {
-             do {
-                 wchar_t link_path[PATH_MAX_LEN]; wsprintfW(link_path, L"%s\\%s", source_folder, ffd.cFileName);
-                 wchar_t target_dir[PATH_MAX_LEN]; if (!resolve_link(link_path, target_dir, PATH_MAX_LEN)) continue;
-                 wchar_t link_name[PATH_MAX_LEN]; wcscpy(link_name, ffd.cFileName);
-                 wchar_t *dot = wcsrchr(link_name, L'.'); if (dot) *dot = L'\0';
-                 const wchar_t suf[] = L" - Ярлык"; size_t ln=wcslen(link_name), sl=wcslen(suf);
-                 if (ln>sl && wcscmp(link_name+ln-sl,suf)==0) link_name[ln-sl]=L'\0';
-                 FileEntry *temp = malloc(16*sizeof(FileEntry)); int tcount=0, tcap=16;
-                 collect_entries(target_dir, target_dir, &temp, &tcount, &tcap);
-                 for (int j=0; j<tcount; j++) {
-                     if (count>=cap) { cap*=2; entries=realloc(entries, cap*sizeof(FileEntry)); }
-                     wcscpy(entries[count].full, temp[j].full);
-                     wsprintfW(entries[count].rel, L"%s\\%s", link_name, temp[j].rel);
-                     count++;
-                 }
-                 free(temp);
-             } while (FindNextFileW(hFind, &ffd));
-             FindClose(hFind);
+         EntryList entries = {0};
+         // Entries go straight into the shared list, relative names get the link folder prefix
+         int32_t *prefixes = malloc((link_count > 0 ? link_count : 1) * sizeof(int32_t));
+         for (int i = 0; i < link_count; i++) prefixes[i] = list_add_prefix(&entries, links[i].name);
+         collect_links(links, prefixes, link_count, &entries, opt, opt->manifest, output);
+         free(prefixes);
+         if (entries.count == 0) {
+             wprintf(L"No files to archive.\n");
+             list_free(&entries);
+             return 1;
          }
-         if (count == 0) { wprintf(L"No files to archive.\n"); return 1; }
-         zip_entries(output, entries, count);
-         free(entries);
+         zip_entries(output, opt->manifest, &entries, opt);
+         list_free(&entries);
      }
      return 0;
  }
  
+ static int archiver_main(int argc, wchar_t *argv[]) {
+     ArchiveOptions opt = { .threads = 1, .walkers = 1, .compress_method = MZ_COMPRESS_METHOD_ZSTD,
+                            .compress_level = MZ_COMPRESS_LEVEL_DEFAULT, .mt_threshold = MT_THRESHOLD_DEFAULT,
+                            .index = true };
+     bool split = false, stats = false, background = false;
+     const wchar_t *trace_path = NULL;
+     int jobs = 1, volume_jobs = 1;
+     bool threads_given = false;
+     int64_t io_rate = 0;
+     const wchar_t *restore_zip = NULL, *restore_dest = NULL;
+     const wchar_t *verify_zip = NULL, *verify_manifest = NULL;
+     int arg = 1;
+     while (arg < argc && wcsncmp(argv[arg], L"--", 2) == 0) {
+         if (wcscmp(argv[arg], L"--split") == 0) {
+             split = true;
+             arg++;
+         } else if (wcscmp(argv[arg], L"--stream") == 0) {
+             opt.stream = true;
+             arg++;
+         } else if (wcscmp(argv[arg], L"--dedup") == 0) {
+             opt.dedup = true;
+             arg++;
+         } else if (wcscmp(argv[arg], L"--solid") == 0) {
+             opt.solid = true;
+             arg++;
+         } else if (wcscmp(argv[arg], L"--resume") == 0) {
+             opt.resume = true;
+             arg++;
+         } else if (wcscmp(argv[arg], L"--seekable") == 0) {
+             opt.seekable = true;
+             arg++;
+         } else if (wcscmp(argv[arg], L"--dict") == 0) {
+             opt.dict = true;
+             arg++;
+         } else if (wcscmp(argv[arg], L"--usn") == 0) {
+             opt.usn = true;
+             arg++;
+         } else if (wcscmp(argv[arg], L"--snapshot") == 0) {
+             opt.snapshot = true;
+             arg++;
+         } else if (wcscmp(argv[arg], L"--stats") == 0) {
+             stats = true;
+             arg++;
+         } else if (wcscmp(argv[arg], L"--io-rate") == 0 && arg + 1 < argc) {
+             // In MB per second, for reads and archive writes together
+             int64_t mb = _wtoi64(argv[arg + 1]);
+             io_rate = mb > 0 ? mb << 20 : 0;
+             arg += 2;
+         } else if (wcscmp(argv[arg], L"--background") == 0) {
+             background = true;
+             arg++;
+         } else if (wcscmp(argv[arg], L"--trace") == 0 && arg + 1 < argc) {
+             trace_path = argv[arg + 1];
+             arg += 2;
+         } else if (wcscmp(argv[arg], L"--no-index") == 0) {
+             opt.index = false;
+             arg++;
+         } else if (wcscmp(argv[arg], L"--get") == 0 && arg + 3 < argc) {
+             return get_entry(argv[arg + 1], argv[arg + 2], argv[arg + 3]);
+         } else if (wcscmp(argv[arg], L"--range") == 0 && arg + 5 < argc) {
+             return range_entry(argv[arg + 1], argv[arg + 2], _wtoi64(argv[arg + 3]), _wtoi64(argv[arg + 4]), argv[arg + 5]);
+         } else if (wcscmp(argv[arg], L"--restore") == 0 && arg + 2 < argc) {
+             // Run once all options are read, --threads may come after it
+             restore_zip = argv[arg + 1];
+             restore_dest = argv[arg + 2];
+             arg += 3;
+         } else if (wcscmp(argv[arg], L"--verify") == 0 && arg + 1 < argc) {
+             // Like --restore it runs after the loop; the manifest is the next argument unless that is an option
+             verify_zip = argv[arg + 1];
+             verify_manifest = arg + 2 < argc && wcsncmp(argv[arg + 2], L"--", 2) != 0 ? argv[arg + 2] : NULL;
+             arg += verify_manifest ? 3 : 2;
+         } else if (wcscmp(argv[arg], L"--undedup") == 0 && arg + 2 < argc) {
+             return dedup_extract(argv[arg + 1], argv[arg + 2]);
+         } else if (wcscmp(argv[arg], L"--direct-io") == 0) {
+             opt.direct_io = true;
+             arg++;
+         } else if (wcscmp(argv[arg], L"--adaptive") == 0) {
+             opt.adaptive = true;
+             arg++;
+         } else if (wcscmp(argv[arg], L"--incremental") == 0 && arg + 1 < argc) {
+             opt.manifest = argv[arg + 1];
+             arg += 2;
+         } else if (wcscmp(argv[arg], L"--volume-size") == 0 && arg + 1 < argc) {
+             // In MB like --mt-threshold
+             int64_t mb = _wtoi64(argv[arg + 1]);
+             opt.volume_size = mb > 0 ? mb << 20 : 0;
+             arg += 2;
+         } else if (wcscmp(argv[arg], L"--volume-cmd") == 0 && arg + 1 < argc) {
+             opt.volume_cmd = argv[arg + 1];
+             arg += 2;
+         } else if (wcscmp(argv[arg], L"--mt-threshold") == 0 && arg + 1 < argc) {
+             // In MB, 0 turns multithreaded entries off
+             int64_t mb = _wtoi64(argv[arg + 1]);
+             opt.mt_threshold = mb > 0 ? mb << 20 : INT64_MAX;
+             arg += 2;
+         } else if (wcscmp(argv[arg], L"--jobs") == 0 && arg + 1 < argc) {
+             jobs = _wtoi(argv[arg + 1]);
+             if (jobs <= 0) jobs = 1;
+             arg += 2;
+         } else if (wcscmp(argv[arg], L"--volume-jobs") == 0 && arg + 1 < argc) {
+             volume_jobs = _wtoi(argv[arg + 1]);
+             if (volume_jobs <= 0) volume_jobs = 1;
+             arg += 2;
+         } else if (wcscmp(argv[arg], L"--walkers") == 0 && arg + 1 < argc) {
+             opt.walkers = _wtoi(argv[arg + 1]);
+             if (opt.walkers <= 0) opt.walkers = (int)GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+             arg += 2;
+         } else if (wcscmp(argv[arg], L"--threads") == 0 && arg + 1 < argc) {
+             opt.threads = _wtoi(argv[arg + 1]);
+             threads_given = true;
+             if (opt.threads <= 0) opt.threads = (int)GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+             arg += 2;
+         } else {
+             break;
+         }
+     }
+     if (restore_zip && verify_zip) {
+         fwprintf(stderr, L"--restore and --verify cannot be combined\n");
+         return 1;
+     }
+     if (restore_zip || verify_zip) {
+         if (arg < argc) {
+             fwprintf(stderr, L"Unexpected argument %s with %s\n", argv[arg], restore_zip ? L"--restore" : L"--verify");
+             return 1;
+         }
+         int threads = threads_given ? opt.threads : 0;
+         return restore_zip ? restore_archive(restore_zip, restore_dest, threads)
+                            : verify_archive(verify_zip, verify_manifest, threads);
+     }
+     if (opt.dedup && (opt.manifest || opt.seekable)) {
+         fwprintf(stderr, L"--dedup cannot be combined with --incremental or --seekable\n");
+         return 1;
+     }
+     if (opt.solid && (opt.manifest || opt.dedup || opt.dict || opt.stream)) {
+         fwprintf(stderr, L"--solid cannot be combined with --incremental, --dedup, --dict or --stream\n");
+         return 1;
+     }
+     if (opt.dict && (opt.dedup || opt.stream)) {
+         fwprintf(stderr, L"--dict cannot be combined with --dedup or --stream\n");
+         return 1;
+     }
+     if (opt.resume && (opt.manifest || opt.dedup || opt.solid)) {
+         fwprintf(stderr, L"--resume cannot be combined with --incremental, --dedup or --solid\n");
+         return 1;
+     }
+     if (opt.volume_size > 0 && (opt.manifest || opt.resume || opt.direct_io)) {
+         fwprintf(stderr, L"--volume-size cannot be combined with --incremental, --resume or --direct-io\n");
+         return 1;
+     }
+     if (opt.volume_cmd && (opt.volume_size == 0 || wcslen(opt.volume_cmd) >= PATH_MAX_LEN)) {
+         fwprintf(stderr, L"--volume-cmd needs --volume-size and a command shorter than %d characters\n", PATH_MAX_LEN);
+         return 1;
+     }
+     if (opt.usn && (!opt.manifest || opt.stream)) {
+         fwprintf(stderr, L"--usn needs --incremental and cannot be combined with --stream\n");
+         return 1;
+     }
+     if (argc - arg != 2) {
+         fwprintf(stderr, L"Usage: %s [--split [--jobs N] [--volume-jobs N]] [--stream] [--adaptive] [--direct-io] [--dedup] [--dict] [--solid] [--seekable] [--resume] [--volume-size MB [--volume-cmd <command>]] [--mt-threshold MB] [--no-index] [--snapshot] [--stats] [--trace <file.json>] [--io-rate MB] [--background] [--threads N] [--walkers N] [--incremental <manifest> [--usn]] <source_folder> <output_%s>\n",
+                 argv[0], split ? L"directory" : L"zip");
+         return 1;
+     }
+     LPCWSTR source_folder = argv[arg];
+     LPCWSTR output = argv[arg + 1];
+     // A streamed archive goes out once, front to back, and leaves no file to index
+     if (sink_target(output)) {
+         if (split || opt.manifest || opt.resume || opt.volume_size > 0 || opt.direct_io) {
+             fwprintf(stderr, L"Streaming to %s cannot be combined with --split, --incremental, --resume, --volume-size or --direct-io\n", output);
+             return 1;
+         }
+         opt.index = false;
+         if (wcscmp(output, L"-") == 0 && !sink_stdout_claim()) return 1;
+     }
+     // Volumes are named by replacing the extension
+     const wchar_t *dot = wcsrchr(output, L'.');
+     if (opt.volume_size > 0 && !split && (!dot || wcschr(dot, L'\\'))) {
+         fwprintf(stderr, L"--volume-size needs an output name with an extension\n");
+         return 1;
+     }
+ 
+     if (stats || trace_path) trace_start(trace_path != NULL);
+     if (io_rate > 0 || background) governor_start(io_rate, background);
+     LinkTarget *links = NULL;
+     int link_count = gather_links(source_folder, &links);
+     SnapshotSet snapshots = {0};
+     if (opt.snapshot) snapshot_links(&snapshots, links, link_count);
+     int rc = archive_links(source_folder, output, links, link_count, split, jobs, volume_jobs, &opt);
+     snapshot_release(&snapshots);
+     free(links);
+     if (tracer) {
+         if (stats) trace_report();
+         if (trace_path && (!tracer->events || !trace_write(trace_path)))
+             fwprintf(stderr, L"Cannot write trace %s\n", trace_path);
+         free(tracer->events);
+         free(tracer);
+         tracer = NULL;
+     }
+     governor_stop();
+     return rc;
+ }
+ 
+ int wmain(int argc, wchar_t *argv[]) {
+     setlocale(LC_ALL, "");
+ #if defined(ARCHIVER_BENCH)
+     return bench_main(argc, argv);
+ #else
+     return archiver_main(argc, argv);
+ #endif
+ }
+ 
  #if !defined(__MINGW64_VERSION_MAJOR__)
  int main(int argc, char **argv) {
      int wargc;
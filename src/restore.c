@@ -0,0 +1,1114 @@
+ // Reading archives back: --restore, --verify, --get and --range, and the <archive>.idx sidecar --get searches
+ #include "archiver.h"
+ 
+ // --restore: the central directory is read once, then workers extract the entries in parallel
+ typedef struct RestoreItem {
+     int64_t cd_pos;
+     char *name;
+     int64_t size;
+     uint32_t attr;       // Windows attributes, 0 when the archive came from elsewhere
+     time_t mtime, atime, ctime;
+     bool dir;
+     bool dict;           // compressed against the archive's dictionary
+ } RestoreItem;
+ 
+ typedef struct Restore {
+     RestoreItem *items;
+     int count;
+     const wchar_t *dest;
+     char zip_utf[PATH_MAX_LEN];
+     uint8_t *view;       // whole archive mapped, NULL to read through mz_stream_os
+     int64_t view_len;
+     volatile LONG next;
+     volatile LONG failed;
+     Progress *progress;
+     ZSTD_DDict *ddict;   // archives written with --dict, NULL otherwise
+ } Restore;
+ 
+ // Entry names are trusted only when they stay inside dest
+ bool restore_name_safe(const char *name) {
+     if (!*name || name[0] == '/' || name[0] == '\\' || strchr(name, ':')) return false;
+     for (const char *p = name; *p;) {
+         const char *end = p + strcspn(p, "/\\");
+         if (end - p == 2 && p[0] == '.' && p[1] == '.') return false;
+         p = *end ? end + 1 : end;
+     }
+     return true;
+ }
+ 
+ static void restore_path(const Restore *r, const char *name, wchar_t *out) {
+     wchar_t rel[PATH_MAX_LEN];
+     MultiByteToWideChar(CP_UTF8, 0, name, -1, rel, PATH_MAX_LEN);
+     wsprintfW(out, L"%s\\%s", r->dest, rel);
+     for (wchar_t *p = out; *p; p++) if (*p == L'/') *p = L'\\';
+ }
+ 
+ // Written with --volume-size: <archive> holds the central directory, the data starts in .z01
+ static bool archive_spanned(const wchar_t *zip_path) {
+     wchar_t first[PATH_MAX_LEN];
+     volume_path(zip_path, 1, first);
+     return wcscmp(first, zip_path) != 0 && GetFileAttributesW(first) != INVALID_FILE_ATTRIBUTES;
+ }
+ 
+ // A file stream, for a spanned archive under a split stream that moves between the volumes
+ static void *archive_read_stream(const char *zip_utf) {
+     wchar_t path[PATH_MAX_LEN];
+     MultiByteToWideChar(CP_UTF8, 0, zip_utf, -1, path, PATH_MAX_LEN);
+     void *file = mz_stream_os_create();
+     if (!archive_spanned(path)) return file;
+     void *split = mz_stream_split_create();
+     mz_stream_set_base(split, file);
+     return split;
+ }
+ 
+ static void *restore_open_zip(const Restore *r, void **stream) {
+     if (r->view) {
+         *stream = mz_stream_mem_create();
+         mz_stream_mem_set_buffer(*stream, r->view, (int32_t)r->view_len);
+     } else {
+         *stream = archive_read_stream(r->zip_utf);
+     }
+     void *zip = mz_zip_create();
+     if (mz_stream_open(*stream, r->zip_utf, MZ_OPEN_MODE_READ) != MZ_OK ||
+         mz_zip_open(zip, *stream, MZ_OPEN_MODE_READ) != MZ_OK) {
+         mz_zip_delete(&zip);
+         stream_chain_delete(stream);
+         return NULL;
+     }
+     return zip;
+ }
+ 
+ static void restore_close_zip(void **zip, void **stream) {
+     mz_zip_close(*zip);
+     mz_zip_delete(zip);
+     mz_stream_close(*stream);
+     stream_chain_delete(stream);
+ }
+ 
+ static FILETIME unix_to_filetime(time_t t) {
+     uint64_t ntfs = 0;
+     mz_zip_unix_to_ntfs_time(t, &ntfs);
+     return (FILETIME){ (DWORD)ntfs, (DWORD)(ntfs >> 32) };
+ }
+ 
+ static bool restore_entry(Restore *r, void *zip, const RestoreItem *it, uint8_t *buf, ZSTD_DCtx *dctx) {
+     wchar_t path[PATH_MAX_LEN];
+     restore_path(r, it->name, path);
+     if (mz_zip_goto_entry(zip, it->cd_pos) != MZ_OK || (!it->dict && mz_zip_entry_read_open(zip, 0, NULL) != MZ_OK))
+         return false;
+     HANDLE h = CreateFileW(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+     if (h == INVALID_HANDLE_VALUE) {
+         if (!it->dict) mz_zip_entry_close(zip);
+         return false;
+     }
+     // Reserve the whole extent now so the filesystem can allocate it contiguously
+     if (it->size > 0) {
+         FILE_ALLOCATION_INFO alloc = { 0 };
+         alloc.AllocationSize.QuadPart = it->size;
+         SetFileInformationByHandle(h, FileAllocationInfo, &alloc, sizeof(alloc));
+     }
+     bool ok = true;
+     int64_t done = 0;
+     if (it->dict) {
+         ok = dict_extract(zip, r->ddict, dctx, h);
+         done = ok ? it->size : 0;
+     } else {
+         int32_t n;
+         while (ok && (n = mz_zip_entry_read(zip, buf, READ_CHUNK)) > 0) {
+             DWORD put = 0;
+             ok = WriteFile(h, buf, (DWORD)n, &put, NULL) && put == (DWORD)n;
+             done += n;
+         }
+         // Closing after the last byte is where minizip-ng checks the CRC
+         if (n < 0 || mz_zip_entry_close(zip) != MZ_OK) ok = false;
+     }
+     FILETIME c = unix_to_filetime(it->ctime), a = unix_to_filetime(it->atime), m = unix_to_filetime(it->mtime);
+     SetFileTime(h, &c, &a, &m);
+     CloseHandle(h);
+     if (ok && it->attr)
+         SetFileAttributesW(path, it->attr & (FILE_ATTRIBUTE_READONLY | FILE_ATTRIBUTE_HIDDEN |
+                                              FILE_ATTRIBUTE_SYSTEM | FILE_ATTRIBUTE_ARCHIVE));
+     progress_end(r->progress, done, 0);
+     return ok;
+ }
+ 
+ static DWORD WINAPI restore_worker(LPVOID param) {
+     Restore *r = param;
+     void *stream = NULL;
+     void *zip = restore_open_zip(r, &stream);
+     uint8_t *buf = malloc(READ_CHUNK);
+     ZSTD_DCtx *dctx = r->ddict ? ZSTD_createDCtx() : NULL;
+     for (;;) {
+         LONG i = InterlockedIncrement(&r->next) - 1;
+         if (i >= r->count) break;
+         const RestoreItem *it = &r->items[i];
+         if (it->dir) continue;
+         if (r->progress) {
+             wchar_t name[PATH_MAX_LEN];
+             MultiByteToWideChar(CP_UTF8, 0, it->name, -1, name, PATH_MAX_LEN);
+             progress_begin(r->progress, name);
+         }
+         if (!zip || !buf || !restore_entry(r, zip, it, buf, dctx)) {
+             wchar_t path[PATH_MAX_LEN];
+             restore_path(r, it->name, path);
+             fwprintf(stderr, L"Cannot restore %s\n", path);
+             InterlockedIncrement(&r->failed);
+         }
+     }
+     ZSTD_freeDCtx(dctx);
+     free(buf);
+     if (zip) restore_close_zip(&zip, &stream);
+     return 0;
+ }
+ 
+ static int solid_extract(const char *zip_utf, const wchar_t *dest, int threads, int *failed);
+ 
+ // Map a single file archive whole for the workers; spanned and 2 GB or larger ones stay on mz_stream_os
+ static void restore_map(Restore *r, const wchar_t *zip_path, HANDLE *file, HANDLE *map) {
+     // A spanned archive is read volume by volume, only a single file is mapped
+     *file = archive_spanned(zip_path) ? INVALID_HANDLE_VALUE :
+             CreateFileW(zip_path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+     *map = NULL;
+     LARGE_INTEGER len = { 0 };
+     if (*file != INVALID_HANDLE_VALUE && GetFileSizeEx(*file, &len) && len.QuadPart > 0 && len.QuadPart < INT32_MAX)
+         *map = CreateFileMappingW(*file, NULL, PAGE_READONLY, 0, 0, NULL);
+     if (*map) {
+         r->view = MapViewOfFile(*map, FILE_MAP_READ, 0, 0, 0);
+         r->view_len = len.QuadPart;
+     }
+ }
+ 
+ static void restore_unmap(Restore *r, HANDLE file, HANDLE map) {
+     if (r->view) UnmapViewOfFile(r->view);
+     r->view = NULL;
+     if (map) CloseHandle(map);
+     if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+ }
+ 
+ // threads <= 0 uses one per logical CPU
+ int restore_archive(const wchar_t *zip_path, const wchar_t *dest, int threads) {
+     Restore r = { .dest = dest };
+     WideCharToMultiByte(CP_UTF8, 0, zip_path, -1, r.zip_utf, PATH_MAX_LEN, NULL, NULL);
+ 
+     // Archives written with --dedup rebuild their files from the chunk pack
+     void *reader = mz_zip_reader_create();
+     bool dedup = mz_zip_reader_open_file(reader, r.zip_utf) == MZ_OK &&
+                  mz_zip_reader_locate_entry(reader, DEDUP_INDEX, 0) == MZ_OK;
+     mz_zip_reader_delete(&reader);
+     if (dedup) return dedup_extract(zip_path, dest);
+ 
+     HANDLE file, map;
+     restore_map(&r, zip_path, &file, &map);
+     void *stream = NULL;
+     void *zip = restore_open_zip(&r, &stream);
+     if (!zip) {
+         fwprintf(stderr, L"Cannot open %s\n", zip_path);
+         restore_unmap(&r, file, map);
+         return 1;
+     }
+     int cap = 0;
+     bool has_dict = false, has_solid = false;
+     for (int32_t err = mz_zip_goto_first_entry(zip); err == MZ_OK; err = mz_zip_goto_next_entry(zip)) {
+         mz_zip_file *fi = NULL;
+         if (mz_zip_entry_get_info(zip, &fi) != MZ_OK || !fi->filename) continue;
+         if (strcmp(fi->filename, DICT_ENTRY) == 0) {
+             has_dict = true;
+             continue;
+         }
+         // Solid blocks and their index are unpacked by solid_extract afterwards
+         if (strncmp(fi->filename, SOLID_PREFIX, strlen(SOLID_PREFIX)) == 0) {
+             has_solid = true;
+             continue;
+         }
+         if (!restore_name_safe(fi->filename)) {
+             fwprintf(stderr, L"Skipping unsafe entry name %hs\n", fi->filename);
+             continue;
+         }
+         if (r.count >= cap) {
+             cap = cap ? cap * 2 : 1024;
+             r.items = realloc(r.items, cap * sizeof(RestoreItem));
+         }
+         uint8_t host = MZ_HOST_SYSTEM(fi->version_madeby);
+         r.items[r.count++] = (RestoreItem){
+             .cd_pos = mz_zip_get_entry(zip),
+             .name = _strdup(fi->filename),
+             .size = fi->uncompressed_size,
+             .attr = host == MZ_HOST_SYSTEM_MSDOS || host == MZ_HOST_SYSTEM_WINDOWS_NTFS ? fi->external_fa : 0,
+             .mtime = fi->modified_date,
+             .atime = fi->accessed_date ? fi->accessed_date : fi->modified_date,
+             .ctime = fi->creation_date ? fi->creation_date : fi->modified_date,
+             .dir = mz_zip_entry_is_dir(zip) == MZ_OK,
+             .dict = dict_marked(fi),
+         };
+     }
+     size_t dict_len = 0;
+     uint8_t *dict_data = has_dict ? dict_read(zip, &dict_len) : NULL;
+     if (dict_data) r.ddict = ZSTD_createDDict(dict_data, dict_len);
+     free(dict_data);
+     restore_close_zip(&zip, &stream);
+ 
+     // Pre-create the tree; entries come grouped by directory, so skip repeats of the last parent
+     CreateDirectoryW(dest, NULL);
+     wchar_t last[PATH_MAX_LEN] = L"";
+     for (int i = 0; i < r.count; i++) {
+         wchar_t path[PATH_MAX_LEN];
+         restore_path(&r, r.items[i].name, path);
+         if (r.items[i].dir) {
+             size_t n = wcslen(path);
+             if (n && path[n - 1] != L'\\') wcscat(path, L"\\");
+         }
+         wchar_t *slash = wcsrchr(path, L'\\');
+         if (!slash) continue;
+         slash[1] = L'\0';
+         if (wcscmp(path, last) == 0) continue;
+         wcscpy(last, path);
+         make_parent_dirs(path);
+     }
+ 
+     if (threads <= 0) threads = (int)GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+     r.progress = progress_start();
+     if (r.progress) {
+         for (int i = 0; i < r.count; i++) {
+             if (r.items[i].dir) continue;
+             r.progress->files_total++;
+             r.progress->bytes_total += r.items[i].size;
+         }
+     }
+     HANDLE *workers = malloc(threads * sizeof(HANDLE));
+     int started = 0;
+     for (int t = 0; t < threads; t++) {
+         workers[started] = CreateThread(NULL, 0, restore_worker, &r, 0, NULL);
+         if (workers[started]) started++;
+     }
+     if (started == 0) restore_worker(&r);
+     WaitForMultipleObjects(started, workers, TRUE, INFINITE);
+     for (int t = 0; t < started; t++) CloseHandle(workers[t]);
+     free(workers);
+     progress_stop(&r.progress);
+ 
+     int files = 0;
+     for (int i = 0; i < r.count; i++) {
+         if (!r.items[i].dir) files++;
+         free(r.items[i].name);
+     }
+     free(r.items);
+     ZSTD_freeDDict(r.ddict);
+     int failed = (int)r.failed;
+     if (has_solid) {
+         int solid_failed = 0;
+         int members = solid_extract(r.zip_utf, dest, threads, &solid_failed);
+         if (members < 0) {
+             fwprintf(stderr, L"Cannot read the solid index of %s\n", zip_path);
+             failed++;
+         } else {
+             files += members;
+             failed += solid_failed;
+         }
+     }
+     restore_unmap(&r, file, map);
+     wprintf(L"Restored %d of %d files to %s\n", files - failed, files, dest);
+     return failed ? 1 : 0;
+ }
+ 
+ // --verify: every entry is decoded and checksummed on a thread pool, optionally against a manifest
+ enum { ZSTD_reset_session_and_parameters = 3 };
+ size_t ZSTD_decompressStream(ZSTD_DCtx *dctx, ZSTD_outBuffer *output, ZSTD_inBuffer *input);
+ size_t ZSTD_DCtx_reset(ZSTD_DCtx *dctx, int reset);
+ size_t ZSTD_DCtx_refDDict(ZSTD_DCtx *dctx, const ZSTD_DDict *ddict);
+ 
+ typedef struct VerifyItem {
+     int64_t cd_pos;
+     char *name;
+     int64_t size;
+     int64_t compressed;
+     uint32_t crc;
+     uint16_t method;
+     bool dict;           // compressed against the archive's dictionary
+ } VerifyItem;
+ 
+ typedef struct Verify {
+     Restore archive;     // only the archive fields: zip_utf, the mapped view and ddict
+     VerifyItem *items;   // largest first, so the pool does not end on one big entry
+     int count;
+     Manifest manifest;   // empty without --verify's manifest argument
+     uint8_t *seen;       // per manifest record, set when the archive has the entry
+     volatile LONG next;
+     volatile LONG failed;
+     volatile LONG differ;
+     volatile LONG64 bytes;
+     Progress *progress;
+ } Verify;
+ 
+ static int verify_item_cmp(const void *a, const void *b) {
+     int64_t x = ((const VerifyItem *)a)->compressed, y = ((const VerifyItem *)b)->compressed;
+     return x < y ? 1 : x > y ? -1 : 0;
+ }
+ 
+ // Decode one entry into nothing but its size and CRC
+ static bool verify_entry(const Verify *v, void *zip, const VerifyItem *it, ZSTD_DCtx *dctx, uint8_t *in, uint8_t *out) {
+     bool zstd = it->method == MZ_COMPRESS_METHOD_ZSTD;
+     bool raw = zstd || it->method == MZ_COMPRESS_METHOD_STORE;
+     if ((it->dict && !v->archive.ddict) || mz_zip_goto_entry(zip, it->cd_pos) != MZ_OK ||
+         mz_zip_entry_read_open(zip, raw, NULL) != MZ_OK)
+         return false;
+     if (zstd) {
+         ZSTD_DCtx_reset(dctx, ZSTD_reset_session_and_parameters);
+         if (it->dict) ZSTD_DCtx_refDDict(dctx, v->archive.ddict);
+     }
+     uint32_t crc = 0;
+     int64_t total = 0;
+     size_t hint = 0;
+     int32_t n;
+     bool ok = true;
+     while (ok && (n = mz_zip_entry_read(zip, in, READ_CHUNK)) > 0) {
+         if (!zstd) {
+             if (raw) crc = crc32_update(crc, in, n);
+             total += n;
+             continue;
+         }
+         ZSTD_inBuffer input = { in, (size_t)n, 0 };
+         while (ok && input.pos < input.size) {
+             ZSTD_outBuffer output = { out, READ_CHUNK, 0 };
+             hint = ZSTD_decompressStream(dctx, &output, &input);
+             ok = !ZSTD_isError(hint);
+             if (ok) crc = crc32_update(crc, out, (int32_t)output.pos);
+             total += output.pos;
+         }
+     }
+     // What the decoder still holds once the input is used up; no progress means a cut frame
+     while (ok && zstd && hint != 0) {
+         ZSTD_inBuffer input = { in, 0, 0 };
+         ZSTD_outBuffer output = { out, READ_CHUNK, 0 };
+         hint = ZSTD_decompressStream(dctx, &output, &input);
+         ok = !ZSTD_isError(hint) && output.pos > 0;
+         if (ok) crc = crc32_update(crc, out, (int32_t)output.pos);
+         total += output.pos;
+     }
+     if (mz_zip_entry_close(zip) != MZ_OK && !raw) ok = false;
+     return ok && n == 0 && total == it->size && (!raw || crc == it->crc);
+ }
+ 
+ static DWORD WINAPI verify_worker(LPVOID param) {
+     Verify *v = param;
+     void *stream = NULL;
+     void *zip = restore_open_zip(&v->archive, &stream);
+     uint8_t *in = malloc(READ_CHUNK), *out = malloc(READ_CHUNK);
+     ZSTD_DCtx *dctx = ZSTD_createDCtx();
+     for (;;) {
+         LONG i = InterlockedIncrement(&v->next) - 1;
+         if (i >= v->count) break;
+         const VerifyItem *it = &v->items[i];
+         if (v->progress) {
+             wchar_t name[PATH_MAX_LEN];
+             MultiByteToWideChar(CP_UTF8, 0, it->name, -1, name, PATH_MAX_LEN);
+             progress_begin(v->progress, name);
+         }
+         ManifestRecord *r = manifest_find(&v->manifest, it->name);
+         if (r) v->seen[r - v->manifest.items] = 1;
+         if (!zip || !in || !out || !dctx || !verify_entry(v, zip, it, dctx, in, out)) {
+             fwprintf(stderr, L"Bad entry %hs\n", it->name);
+             InterlockedIncrement(&v->failed);
+         } else if (r && (r->size != it->size || (r->crc != 0 && r->crc != it->crc))) {
+             // A zero CRC in the manifest was never filled in, only the size is known
+             fwprintf(stderr, L"%hs differs from the manifest\n", it->name);
+             InterlockedIncrement(&v->differ);
+         }
+         InterlockedAdd64(&v->bytes, it->size);
+         progress_end(v->progress, it->size, 0);
+     }
+     ZSTD_freeDCtx(dctx);
+     free(in);
+     free(out);
+     if (zip) restore_close_zip(&zip, &stream);
+     return 0;
+ }
+ 
+ // threads <= 0 uses one per logical CPU
+ int verify_archive(const wchar_t *zip_path, const wchar_t *manifest_path, int threads) {
+     Verify v = { 0 };
+     WideCharToMultiByte(CP_UTF8, 0, zip_path, -1, v.archive.zip_utf, PATH_MAX_LEN, NULL, NULL);
+     if (manifest_path && !manifest_load(&v.manifest, manifest_path)) {
+         fwprintf(stderr, L"Cannot read manifest %s\n", manifest_path);
+         return 1;
+     }
+     HANDLE file, map;
+     restore_map(&v.archive, zip_path, &file, &map);
+     void *stream = NULL;
+     void *zip = restore_open_zip(&v.archive, &stream);
+     if (!zip) {
+         fwprintf(stderr, L"Cannot open %s\n", zip_path);
+         restore_unmap(&v.archive, file, map);
+         manifest_free(&v.manifest);
+         return 1;
+     }
+     int cap = 0;
+     bool has_dict = false;
+     for (int32_t err = mz_zip_goto_first_entry(zip); err == MZ_OK; err = mz_zip_goto_next_entry(zip)) {
+         mz_zip_file *fi = NULL;
+         if (mz_zip_entry_get_info(zip, &fi) != MZ_OK || !fi->filename || mz_zip_entry_is_dir(zip) == MZ_OK) continue;
+         if (strcmp(fi->filename, DICT_ENTRY) == 0) has_dict = true;
+         if (v.count >= cap) {
+             cap = cap ? cap * 2 : 1024;
+             v.items = realloc(v.items, cap * sizeof(VerifyItem));
+         }
+         v.items[v.count++] = (VerifyItem){
+             .cd_pos = mz_zip_get_entry(zip),
+             .name = _strdup(fi->filename),
+             .size = fi->uncompressed_size,
+             .compressed = fi->compressed_size,
+             .crc = fi->crc,
+             .method = fi->compression_method,
+             .dict = dict_marked(fi),
+         };
+     }
+     size_t dict_len = 0;
+     uint8_t *dict_data = has_dict ? dict_read(zip, &dict_len) : NULL;
+     if (dict_data) v.archive.ddict = ZSTD_createDDict(dict_data, dict_len);
+     free(dict_data);
+     restore_close_zip(&zip, &stream);
+     if (v.count > 0) qsort(v.items, v.count, sizeof(VerifyItem), verify_item_cmp);
+     v.seen = calloc(v.manifest.count + 1, 1);
+ 
+     if (threads <= 0) threads = (int)GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+     v.progress = progress_start();
+     if (v.progress) {
+         v.progress->files_total = v.count;
+         for (int i = 0; i < v.count; i++) v.progress->bytes_total += v.items[i].size;
+     }
+     ULONGLONG start = GetTickCount64();
+     HANDLE *workers = malloc(threads * sizeof(HANDLE));
+     int started = 0;
+     for (int t = 0; t < threads; t++) {
+         workers[started] = CreateThread(NULL, 0, verify_worker, &v, 0, NULL);
+         if (workers[started]) started++;
+     }
+     if (started == 0) verify_worker(&v);
+     WaitForMultipleObjects(started, workers, TRUE, INFINITE);
+     for (int t = 0; t < started; t++) CloseHandle(workers[t]);
+     free(workers);
+     progress_stop(&v.progress);
+     double secs = (GetTickCount64() - start) / 1000.0;
+ 
+     int missing = 0;
+     for (int i = 0; i < v.manifest.count; i++) {
+         if (v.seen[i]) continue;
+         // Reported with / like the other messages, which print central directory names
+         char *name = v.manifest.names + v.manifest.items[i].name;
+         for (char *p = name; *p; p++) if (*p == '\\') *p = '/';
+         fwprintf(stderr, L"%hs is in the manifest but not in the archive\n", name);
+         missing++;
+     }
+     double mb = v.bytes / 1048576.0;
+     wprintf(L"Verified %d entries, %.1f MB in %.1f s (%.0f MB/s): %d bad", v.count, mb, secs,
+             secs > 0 ? mb / secs : 0.0, (int)v.failed);
+     if (manifest_path) wprintf(L", %d differ from the manifest, %d missing", (int)v.differ, missing);
+     wprintf(L"\n");
+ 
+     for (int i = 0; i < v.count; i++) free(v.items[i].name);
+     free(v.items);
+     free(v.seen);
+     ZSTD_freeDDict(v.archive.ddict);
+     restore_unmap(&v.archive, file, map);
+     manifest_free(&v.manifest);
+     return v.failed || v.differ || missing ? 1 : 0;
+ }
+ 
+ // <archive>.idx, sorted normalized names for --get: "ARCIDX1\0", uint32 count, uint32 names bytes, then count x
+ // { uint64 cd_pos, uint64 local header offset, uint32 name offset, uint32 name length } and the names
+ #define INDEX_MAGIC "ARCIDX1"
+ 
+ typedef struct IndexRecord {
+     uint64_t cd_pos;
+     uint64_t offset;
+     uint32_t name;
+     uint32_t name_len;
+ } IndexRecord;
+ 
+ typedef struct IndexHeader {
+     char magic[8];
+     uint32_t count;
+     uint32_t names_len;
+ } IndexHeader;
+ 
+ // Lower-cased UTF-8 with forward slashes, returns its length
+ static int index_normalize(const char *name, char *out, int out_size) {
+     wchar_t wide[PATH_MAX_LEN];
+     int n = MultiByteToWideChar(CP_UTF8, 0, name, -1, wide, PATH_MAX_LEN);
+     if (n <= 0) return 0;
+     for (wchar_t *p = wide; *p; p++) *p = *p == L'\\' ? L'/' : towlower(*p);
+     n = WideCharToMultiByte(CP_UTF8, 0, wide, -1, out, out_size, NULL, NULL);
+     return n > 0 ? n - 1 : 0;
+ }
+ 
+ // Sorting needs the names next to the records, --split jobs write indexes concurrently
+ typedef struct IndexSortItem {
+     const char *name;
+     IndexRecord r;
+ } IndexSortItem;
+ 
+ static int index_item_cmp(const void *a, const void *b) {
+     const IndexSortItem *x = a, *y = b;
+     uint32_t n = x->r.name_len < y->r.name_len ? x->r.name_len : y->r.name_len;
+     int c = memcmp(x->name, y->name, n);
+     return c ? c : x->r.name_len < y->r.name_len ? -1 : x->r.name_len > y->r.name_len;
+ }
+ 
+ bool index_write(const wchar_t *zip_path) {
+     char zipUtf[PATH_MAX_LEN];
+     WideCharToMultiByte(CP_UTF8, 0, zip_path, -1, zipUtf, PATH_MAX_LEN, NULL, NULL);
+     void *reader = mz_zip_reader_create();
+     void *zip = NULL;
+     if (mz_zip_reader_open_file(reader, zipUtf) != MZ_OK || mz_zip_reader_get_zip_handle(reader, &zip) != MZ_OK) {
+         mz_zip_reader_delete(&reader);
+         return false;
+     }
+     IndexRecord *records = NULL;
+     int count = 0, cap = 0;
+     TextBuf names = { 0 };
+     for (int32_t err = mz_zip_reader_goto_first_entry(reader); err == MZ_OK; err = mz_zip_reader_goto_next_entry(reader)) {
+         mz_zip_file *fi = NULL;
+         if (mz_zip_reader_entry_get_info(reader, &fi) != MZ_OK || !fi->filename) continue;
+         char norm[PATH_MAX_LEN * 3];
+         int len = index_normalize(fi->filename, norm, sizeof(norm));
+         if (count >= cap) {
+             cap = cap ? cap * 2 : 1024;
+             records = realloc(records, cap * sizeof(IndexRecord));
+         }
+         records[count++] = (IndexRecord){ (uint64_t)mz_zip_get_entry(zip), (uint64_t)fi->disk_offset,
+                                           (uint32_t)names.len, (uint32_t)len };
+         text_append(&names, norm, len);
+     }
+     mz_zip_reader_close(reader);
+     mz_zip_reader_delete(&reader);
+ 
+     IndexSortItem *items = malloc((size_t)count * sizeof(IndexSortItem) + 1);
+     for (int i = 0; i < count; i++) items[i] = (IndexSortItem){ names.data + records[i].name, records[i] };
+     qsort(items, count, sizeof(IndexSortItem), index_item_cmp);
+     for (int i = 0; i < count; i++) records[i] = items[i].r;
+     free(items);
+ 
+     wchar_t idx_path[PATH_MAX_LEN];
+     wsprintfW(idx_path, L"%s.idx", zip_path);
+     FILE *f = _wfopen(idx_path, L"wb");
+     bool ok = f != NULL;
+     if (f) {
+         IndexHeader hdr = { INDEX_MAGIC, (uint32_t)count, (uint32_t)names.len };
+         ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1 &&
+              (count == 0 || fwrite(records, sizeof(IndexRecord), count, f) == (size_t)count) &&
+              (names.len == 0 || fwrite(names.data, 1, names.len, f) == names.len);
+         if (fclose(f) != 0) ok = false;
+         if (!ok) DeleteFileW(idx_path);
+     }
+     free(records);
+     free(names.data);
+     return ok;
+ }
+ 
+ bool read_at(HANDLE h, int64_t offset, void *buf, DWORD len) {
+     LARGE_INTEGER at = { .QuadPart = offset };
+     DWORD got = 0;
+     return SetFilePointerEx(h, at, NULL, FILE_BEGIN) && io_read(h, buf, len, &got) && got == len;
+ }
+ 
+ // Binary search the sidecar, -1 if the name is not there or there is no usable index
+ static int64_t index_lookup(const wchar_t *zip_path, const char *name) {
+     wchar_t idx_path[PATH_MAX_LEN];
+     wsprintfW(idx_path, L"%s.idx", zip_path);
+     HANDLE h = CreateFileW(idx_path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+     if (h == INVALID_HANDLE_VALUE) return -1;
+     char key[PATH_MAX_LEN * 3], probe[PATH_MAX_LEN * 3];
+     int key_len = index_normalize(name, key, sizeof(key));
+     IndexHeader hdr;
+     int64_t found = -1;
+     if (read_at(h, 0, &hdr, sizeof(hdr)) && memcmp(hdr.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) == 0) {
+         int64_t names_at = sizeof(hdr) + (int64_t)hdr.count * sizeof(IndexRecord);
+         uint32_t lo = 0, hi = hdr.count;
+         while (lo < hi) {
+             uint32_t mid = lo + (hi - lo) / 2;
+             IndexRecord r;
+             if (!read_at(h, sizeof(hdr) + (int64_t)mid * sizeof(IndexRecord), &r, sizeof(r)) ||
+                 r.name_len > sizeof(probe) || !read_at(h, names_at + r.name, probe, r.name_len))
+                 break;
+             uint32_t n = r.name_len < (uint32_t)key_len ? r.name_len : (uint32_t)key_len;
+             int c = memcmp(probe, key, n);
+             if (c == 0) c = r.name_len < (uint32_t)key_len ? -1 : r.name_len > (uint32_t)key_len;
+             if (c == 0) {
+                 found = (int64_t)r.cd_pos;
+                 break;
+             }
+             if (c < 0) lo = mid + 1;
+             else hi = mid;
+         }
+     }
+     CloseHandle(h);
+     return found;
+ }
+ 
+ // Parse the index text in place, members come grouped by block in offset order
+ static SolidMember *solid_parse(char *index, int *count) {
+     *count = 0;
+     if (strncmp(index, SOLID_HEADER "\n", sizeof(SOLID_HEADER)) != 0) return NULL;
+     int cap = 1024;
+     SolidMember *m = malloc(cap * sizeof(SolidMember));
+     for (char *line = index + sizeof(SOLID_HEADER); line && *line;) {
+         char *next = strchr(line, '\n');
+         if (next) *next++ = '\0';
+         int block, name_at = 0;
+         long long offset, size;
+         unsigned long long mtime;
+         unsigned long attr;
+         if (sscanf(line, "%d\t%lld\t%lld\t%llu\t%lx\t%n", &block, &offset, &size, &mtime, &attr, &name_at) == 5 &&
+             name_at > 0) {
+             if (*count >= cap) m = realloc(m, (cap *= 2) * sizeof(SolidMember));
+             m[(*count)++] = (SolidMember){ block, offset, size, mtime, (uint32_t)attr, line + name_at };
+         }
+         line = next;
+     }
+     return m;
+ }
+ 
+ // The index text of a --solid archive, NULL when it is not one
+ static char *solid_read_index(void *reader) {
+     if (mz_zip_reader_locate_entry(reader, SOLID_INDEX, 0) != MZ_OK) return NULL;
+     int32_t len = mz_zip_reader_entry_save_buffer_length(reader);
+     char *index = len >= 0 ? malloc(len + 1) : NULL;
+     if (index && mz_zip_reader_entry_save_buffer(reader, index, len) != MZ_OK) {
+         free(index);
+         return NULL;
+     }
+     if (index) index[len] = '\0';
+     return index;
+ }
+ 
+ // Open a member's block and read up to the member, the reader is then positioned on its first byte
+ static bool solid_seek(void *reader, const SolidMember *m, int *open_block, int64_t *pos, uint8_t *buf) {
+     if (*open_block != m->block || *pos > m->offset) {
+         if (*open_block >= 0) mz_zip_reader_entry_close(reader);
+         *open_block = -1;
+         char name[64];
+         snprintf(name, sizeof(name), SOLID_BLOCK_NAME, m->block);
+         if (mz_zip_reader_locate_entry(reader, name, 0) != MZ_OK || mz_zip_reader_entry_open(reader) != MZ_OK)
+             return false;
+         *open_block = m->block;
+         *pos = 0;
+     }
+     while (*pos < m->offset) {
+         int64_t skip = m->offset - *pos;
+         int32_t n = mz_zip_reader_entry_read(reader, buf, skip < READ_CHUNK ? (int32_t)skip : READ_CHUNK);
+         if (n <= 0) return false;
+         *pos += n;
+     }
+     return true;
+ }
+ 
+ static bool solid_copy(void *reader, const SolidMember *m, int64_t *pos, uint8_t *buf, HANDLE h) {
+     for (int64_t left = m->size; left > 0;) {
+         int32_t n = mz_zip_reader_entry_read(reader, buf, left < READ_CHUNK ? (int32_t)left : READ_CHUNK);
+         DWORD put = 0;
+         if (n <= 0 || !WriteFile(h, buf, (DWORD)n, &put, NULL) || put != (DWORD)n) return false;
+         *pos += n;
+         left -= n;
+     }
+     return true;
+ }
+ 
+ typedef struct SolidRestore {
+     const char *zip_utf;
+     const wchar_t *dest;
+     SolidMember *members;
+     int count;
+     int *starts;           // first member of every block, count entries past the last
+     int blocks;
+     volatile LONG next;
+     volatile LONG failed;
+ } SolidRestore;
+ 
+ // Workers take whole blocks, each block is one sequential decompression
+ static DWORD WINAPI solid_worker(LPVOID param) {
+     SolidRestore *s = param;
+     void *reader = mz_zip_reader_create();
+     bool opened = mz_zip_reader_open_file(reader, s->zip_utf) == MZ_OK;
+     uint8_t *buf = malloc(READ_CHUNK);
+     for (;;) {
+         LONG k = InterlockedIncrement(&s->next) - 1;
+         if (k >= s->blocks) break;
+         int open_block = -1;
+         int64_t pos = 0;
+         for (int i = s->starts[k]; i < s->starts[k + 1]; i++) {
+             const SolidMember *m = &s->members[i];
+             wchar_t rel[PATH_MAX_LEN], path[PATH_MAX_LEN];
+             MultiByteToWideChar(CP_UTF8, 0, m->name, -1, rel, PATH_MAX_LEN);
+             wsprintfW(path, L"%s\\%s", s->dest, rel);
+             for (wchar_t *p = path; *p; p++) if (*p == L'/') *p = L'\\';
+             bool ok = opened && buf && restore_name_safe(m->name);
+             HANDLE h = INVALID_HANDLE_VALUE;
+             if (ok) {
+                 make_parent_dirs(path);
+                 h = CreateFileW(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+                 ok = h != INVALID_HANDLE_VALUE && solid_seek(reader, m, &open_block, &pos, buf) &&
+                      solid_copy(reader, m, &pos, buf, h);
+             }
+             if (h != INVALID_HANDLE_VALUE) {
+                 FILETIME ft = { (DWORD)m->mtime, (DWORD)(m->mtime >> 32) };
+                 SetFileTime(h, NULL, NULL, &ft);
+                 CloseHandle(h);
+                 if (ok && m->attr)
+                     SetFileAttributesW(path, m->attr & (FILE_ATTRIBUTE_READONLY | FILE_ATTRIBUTE_HIDDEN |
+                                                         FILE_ATTRIBUTE_SYSTEM | FILE_ATTRIBUTE_ARCHIVE));
+             }
+             if (!ok) {
+                 fwprintf(stderr, L"Cannot restore %s\n", path);
+                 InterlockedIncrement(&s->failed);
+             }
+         }
+         if (open_block >= 0) mz_zip_reader_entry_close(reader);
+     }
+     free(buf);
+     mz_zip_reader_delete(&reader);
+     return 0;
+ }
+ 
+ // Extract the members of a --solid archive's blocks under dest, returns the number of members or -1
+ static int solid_extract(const char *zip_utf, const wchar_t *dest, int threads, int *failed) {
+     void *reader = mz_zip_reader_create();
+     char *index = mz_zip_reader_open_file(reader, zip_utf) == MZ_OK ? solid_read_index(reader) : NULL;
+     mz_zip_reader_delete(&reader);
+     SolidRestore s = { .zip_utf = zip_utf, .dest = dest };
+     s.members = index ? solid_parse(index, &s.count) : NULL;
+     if (!s.members) {
+         free(index);
+         return -1;
+     }
+     s.starts = malloc((s.count + 1) * sizeof(int));
+     for (int i = 0; i < s.count; i++)
+         if (i == 0 || s.members[i].block != s.members[i - 1].block) s.starts[s.blocks++] = i;
+     s.starts[s.blocks] = s.count;
+ 
+     if (threads > s.blocks) threads = s.blocks;
+     HANDLE *workers = malloc((threads > 0 ? threads : 1) * sizeof(HANDLE));
+     int started = 0;
+     for (int t = 0; t < threads; t++) {
+         workers[started] = CreateThread(NULL, 0, solid_worker, &s, 0, NULL);
+         if (workers[started]) started++;
+     }
+     if (started == 0) solid_worker(&s);
+     WaitForMultipleObjects(started, workers, TRUE, INFINITE);
+     for (int t = 0; t < started; t++) CloseHandle(workers[t]);
+     free(workers);
+     *failed = (int)s.failed;
+     free(s.starts);
+     free(s.members);
+     free(index);
+     return s.count;
+ }
+ 
+ // --get for a solid member: 0 when written, 1 on failure, -1 when name is not a member
+ static int solid_get(const char *zip_utf, const char *name, const wchar_t *out_path) {
+     void *reader = mz_zip_reader_create();
+     char *index = mz_zip_reader_open_file(reader, zip_utf) == MZ_OK ? solid_read_index(reader) : NULL;
+     int count = 0;
+     SolidMember *members = index ? solid_parse(index, &count) : NULL;
+     char key[PATH_MAX_LEN * 3], probe[PATH_MAX_LEN * 3];
+     int key_len = index_normalize(name, key, sizeof(key));
+     const SolidMember *m = NULL;
+     for (int i = 0; i < count && !m; i++) {
+         if (index_normalize(members[i].name, probe, sizeof(probe)) == key_len && memcmp(probe, key, key_len) == 0)
+             m = &members[i];
+     }
+     int rc = -1;
+     if (m) {
+         uint8_t *buf = malloc(READ_CHUNK);
+         HANDLE h = CreateFileW(out_path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+         int open_block = -1;
+         int64_t pos = 0;
+         bool ok = buf && h != INVALID_HANDLE_VALUE && solid_seek(reader, m, &open_block, &pos, buf) &&
+                   solid_copy(reader, m, &pos, buf, h);
+         if (open_block >= 0) mz_zip_reader_entry_close(reader);
+         if (h != INVALID_HANDLE_VALUE) {
+             FILETIME ft = { (DWORD)m->mtime, (DWORD)(m->mtime >> 32) };
+             if (ok) SetFileTime(h, NULL, NULL, &ft);
+             CloseHandle(h);
+             if (!ok) DeleteFileW(out_path);
+         }
+         free(buf);
+         rc = ok ? 0 : 1;
+     }
+     free(members);
+     free(index);
+     mz_zip_reader_delete(&reader);
+     return rc;
+ }
+ 
+ // Move zip to the entry called name, found through the sidecar when there is one
+ static int32_t entry_locate(void *zip, const wchar_t *zip_path, const char *name) {
+     int64_t cd_pos = index_lookup(zip_path, name);
+     if (cd_pos >= 0) return mz_zip_goto_entry(zip, cd_pos);
+     // No sidecar or not listed in it: scan the central directory like the reader does
+     char key[PATH_MAX_LEN * 3], probe[PATH_MAX_LEN * 3];
+     int key_len = index_normalize(name, key, sizeof(key));
+     int32_t err;
+     for (err = mz_zip_goto_first_entry(zip); err == MZ_OK; err = mz_zip_goto_next_entry(zip)) {
+         mz_zip_file *fi = NULL;
+         if (mz_zip_entry_get_info(zip, &fi) == MZ_OK && fi->filename &&
+             index_normalize(fi->filename, probe, sizeof(probe)) == key_len && memcmp(probe, key, key_len) == 0)
+             break;
+     }
+     return err;
+ }
+ 
+ // --get: copy one entry out, located through the sidecar when there is one
+ int get_entry(const wchar_t *zip_path, const wchar_t *entry, const wchar_t *out_path) {
+     char zipUtf[PATH_MAX_LEN], name[PATH_MAX_LEN * 3];
+     WideCharToMultiByte(CP_UTF8, 0, zip_path, -1, zipUtf, PATH_MAX_LEN, NULL, NULL);
+     WideCharToMultiByte(CP_UTF8, 0, entry, -1, name, sizeof(name), NULL, NULL);
+     void *stream = archive_read_stream(zipUtf);
+     void *zip = mz_zip_create();
+     if (mz_stream_open(stream, zipUtf, MZ_OPEN_MODE_READ) != MZ_OK || mz_zip_open(zip, stream, MZ_OPEN_MODE_READ) != MZ_OK) {
+         fwprintf(stderr, L"Cannot open %s\n", zip_path);
+         mz_zip_delete(&zip);
+         stream_chain_delete(&stream);
+         return 1;
+     }
+     int32_t err = entry_locate(zip, zip_path, name);
+     bool ok = false;
+     // Dictionary compressed entries need the archive's dictionary first
+     mz_zip_file *info = NULL;
+     bool dict = err == MZ_OK && mz_zip_entry_get_info(zip, &info) == MZ_OK && dict_marked(info);
+     ZSTD_DDict *ddict = NULL;
+     if (dict) {
+         int64_t pos = mz_zip_get_entry(zip);
+         size_t dict_len = 0;
+         uint8_t *dict_data = dict_read(zip, &dict_len);
+         if (dict_data) ddict = ZSTD_createDDict(dict_data, dict_len);
+         free(dict_data);
+         err = mz_zip_goto_entry(zip, pos);
+     }
+     if (err == MZ_OK && (dict || mz_zip_entry_read_open(zip, 0, NULL) == MZ_OK)) {
+         HANDLE h = CreateFileW(out_path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+         uint8_t *buf = malloc(READ_CHUNK);
+         ok = h != INVALID_HANDLE_VALUE && buf;
+         if (dict) {
+             ZSTD_DCtx *dctx = ZSTD_createDCtx();
+             ok = ok && dict_extract(zip, ddict, dctx, h);
+             ZSTD_freeDCtx(dctx);
+         } else {
+             int32_t n = 0;
+             while (ok && (n = mz_zip_entry_read(zip, buf, READ_CHUNK)) > 0) {
+                 DWORD put = 0;
+                 ok = WriteFile(h, buf, (DWORD)n, &put, NULL) && put == (DWORD)n;
+             }
+             if (n < 0 || mz_zip_entry_close(zip) != MZ_OK) ok = false;
+         }
+         if (h != INVALID_HANDLE_VALUE) {
+             mz_zip_file *fi = NULL;
+             if (ok && mz_zip_entry_get_info(zip, &fi) == MZ_OK) {
+                 FILETIME m = unix_to_filetime(fi->modified_date);
+                 SetFileTime(h, NULL, NULL, &m);
+             }
+             CloseHandle(h);
+             if (!ok) DeleteFileW(out_path);
+         }
+         free(buf);
+     }
+     ZSTD_freeDDict(ddict);
+     mz_zip_close(zip);
+     mz_zip_delete(&zip);
+     mz_stream_close(stream);
+     stream_chain_delete(&stream);
+     // Small files of a --solid archive live inside its blocks
+     int solid = err != MZ_OK ? solid_get(zipUtf, name, out_path) : -1;
+     if (solid >= 0) {
+         err = MZ_OK;
+         ok = solid == 0;
+     }
+     if (err != MZ_OK) fwprintf(stderr, L"%s not found in %s\n", entry, zip_path);
+     else if (!ok) fwprintf(stderr, L"Cannot extract %s to %s\n", entry, out_path);
+     else wprintf(L"%s -> %s\n", entry, out_path);
+     return ok ? 0 : 1;
+ }
+ 
+ // --range state shared by the decode workers
+ typedef struct RangeRead {
+     const wchar_t *zip_path;
+     const wchar_t *out_path;
+     int64_t data;           // archive offset of the entry data
+     const int64_t *frame_at; // frames + 1 offsets of the compressed frames in the entry data
+     int64_t frame_size;
+     int64_t offset;         // requested uncompressed bytes [offset, end)
+     int64_t end;
+     int64_t size;           // uncompressed size of the entry
+     int first, last;        // frames overlapping the range
+     volatile LONG next;
+     volatile LONG failed;
+ } RangeRead;
+ 
+ static bool write_at(HANDLE h, int64_t offset, const void *buf, DWORD len) {
+     LARGE_INTEGER at = { .QuadPart = offset };
+     DWORD put = 0;
+     return SetFilePointerEx(h, at, NULL, FILE_BEGIN) && WriteFile(h, buf, len, &put, NULL) && put == len;
+ }
+ 
+ // Decode claimed frames and write the part of each inside the range, every worker with its own handles
+ static DWORD WINAPI range_worker(LPVOID param) {
+     RangeRead *r = param;
+     HANDLE in = CreateFileW(r->zip_path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+     HANDLE out = CreateFileW(r->out_path, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+     ZSTD_DCtx *dctx = ZSTD_createDCtx();
+     size_t cap = ZSTD_compressBound(SEEK_FRAME);
+     uint8_t *src = malloc(cap), *dst = malloc(SEEK_FRAME);
+     bool ok = in != INVALID_HANDLE_VALUE && out != INVALID_HANDLE_VALUE && dctx && src && dst;
+     for (int f; ok && !r->failed && (f = r->first + (int)InterlockedIncrement(&r->next) - 1) <= r->last;) {
+         int64_t len = r->frame_at[f + 1] - r->frame_at[f];
+         int64_t start = (int64_t)f * r->frame_size;
+         int64_t expect = r->size - start < r->frame_size ? r->size - start : r->frame_size;
+         ok = len > 0 && (size_t)len <= cap && read_at(in, r->data + r->frame_at[f], src, (DWORD)len);
+         size_t n = ok ? ZSTD_decompressDCtx(dctx, dst, SEEK_FRAME, src, (size_t)len) : 0;
+         ok = ok && !ZSTD_isError(n) && (int64_t)n == expect;
+         int64_t from = r->offset > start ? r->offset : start;
+         int64_t to = r->end < start + (int64_t)n ? r->end : start + (int64_t)n;
+         ok = ok && write_at(out, from - r->offset, dst + (from - start), (DWORD)(to - from));
+     }
+     if (!ok) InterlockedExchange(&r->failed, 1);
+     free(src);
+     free(dst);
+     ZSTD_freeDCtx(dctx);
+     if (in != INVALID_HANDLE_VALUE) CloseHandle(in);
+     if (out != INVALID_HANDLE_VALUE) CloseHandle(out);
+     return 0;
+ }
+ 
+ // Offsets of the frames from the entry's seek table, false when it does not match the extra field
+ static bool range_table(HANDLE h, RangeRead *r, int64_t compressed, uint32_t frames, int64_t **frame_at) {
+     uint8_t footer[SEEK_FOOTER], head[8];
+     int64_t footer_at = r->data + compressed - SEEK_FOOTER;
+     if (compressed < 8 + SEEK_FOOTER || !read_at(h, footer_at, footer, sizeof(footer)) ||
+         get_u32(footer) != frames || get_u32(footer + 5) != SEEK_TABLE_MAGIC)
+         return false;
+     // Tables written elsewhere may carry a checksum per frame
+     size_t pair = footer[4] & 0x80 ? 12 : 8;
+     size_t len = (size_t)frames * pair;
+     int64_t table_at = footer_at - (int64_t)len;
+     if (table_at - 8 < r->data || !read_at(h, table_at - 8, head, sizeof(head)) ||
+         get_u32(head) != SEEK_SKIPPABLE_MAGIC || get_u32(head + 4) != len + SEEK_FOOTER)
+         return false;
+     uint8_t *table = malloc(len + 1);
+     int64_t *at = malloc(((size_t)frames + 1) * sizeof(int64_t));
+     bool ok = table && at && read_at(h, table_at, table, (DWORD)len);
+     int64_t size = 0;
+     if (at) at[0] = 0;
+     for (uint32_t f = 0; ok && f < frames; f++) {
+         uint32_t c = get_u32(table + f * pair), d = get_u32(table + f * pair + 4);
+         // Fixed size frames only, the last one may be short
+         ok = d == r->frame_size || (f + 1 == frames && d > 0 && d < r->frame_size);
+         at[f + 1] = at[f] + c;
+         size += d;
+     }
+     ok = ok && size == r->size && at[frames] <= table_at - 8 - r->data;
+     free(table);
+     if (!ok) {
+         free(at);
+         return false;
+     }
+     *frame_at = at;
+     return true;
+ }
+ 
+ // --range: extract length bytes from offset of a --seekable entry, decoding only the frames they touch
+ int range_entry(const wchar_t *zip_path, const wchar_t *entry, int64_t offset, int64_t length,
+                 const wchar_t *out_path) {
+     char zipUtf[PATH_MAX_LEN], name[PATH_MAX_LEN * 3];
+     WideCharToMultiByte(CP_UTF8, 0, zip_path, -1, zipUtf, PATH_MAX_LEN, NULL, NULL);
+     WideCharToMultiByte(CP_UTF8, 0, entry, -1, name, sizeof(name), NULL, NULL);
+     // Frames are read at archive offsets, the volumes of a spanned archive have their own
+     if (archive_spanned(zip_path)) {
+         fwprintf(stderr, L"--range needs a single file archive, %s is spanned\n", zip_path);
+         return 1;
+     }
+     void *stream = mz_stream_os_create();
+     void *zip = mz_zip_create();
+     if (mz_stream_open(stream, zipUtf, MZ_OPEN_MODE_READ) != MZ_OK || mz_zip_open(zip, stream, MZ_OPEN_MODE_READ) != MZ_OK) {
+         fwprintf(stderr, L"Cannot open %s\n", zip_path);
+         mz_zip_delete(&zip);
+         mz_stream_os_delete(&stream);
+         return 1;
+     }
+     RangeRead r = { .zip_path = zip_path, .out_path = out_path, .data = -1 };
+     int32_t err = entry_locate(zip, zip_path, name);
+     mz_zip_file *fi = NULL;
+     uint16_t field_len = 0;
+     const uint8_t *field = err == MZ_OK && mz_zip_entry_get_info(zip, &fi) == MZ_OK ? extra_find(fi, SEEK_FIELD, &field_len) : NULL;
+     uint32_t frames = 0;
+     int64_t compressed = 0;
+     if (field && field_len >= 8 && fi->compression_method == MZ_COMPRESS_METHOD_ZSTD) {
+         r.frame_size = get_u32(field);
+         frames = get_u32(field + 4);
+         r.size = fi->uncompressed_size;
+         compressed = fi->compressed_size;
+         // The raw read leaves the stream at the first byte of the entry data
+         if (r.frame_size > 0 && r.frame_size <= SEEK_FRAME && mz_zip_entry_read_open(zip, 1, NULL) == MZ_OK) {
+             r.data = mz_stream_tell(stream);
+             mz_zip_entry_close(zip);
+         }
+     }
+     mz_zip_close(zip);
+     mz_zip_delete(&zip);
+     mz_stream_close(stream);
+     mz_stream_os_delete(&stream);
+     if (err != MZ_OK) {
+         fwprintf(stderr, L"%s not found in %s\n", entry, zip_path);
+         return 1;
+     }
+     if (!field) {
+         fwprintf(stderr, L"%s was not written with --seekable\n", entry);
+         return 1;
+     }
+     if (offset < 0 || offset >= r.size) {
+         fwprintf(stderr, L"Offset %lld is outside %s (%lld bytes)\n", (long long)offset, entry, (long long)r.size);
+         return 1;
+     }
+     r.offset = offset;
+     r.end = length > 0 && length < r.size - offset ? offset + length : r.size;
+ 
+     int64_t *frame_at = NULL;
+     HANDLE h = CreateFileW(zip_path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+     bool ok = h != INVALID_HANDLE_VALUE && r.data >= 0 && range_table(h, &r, compressed, frames, &frame_at);
+     if (h != INVALID_HANDLE_VALUE) CloseHandle(h);
+     if (!ok) {
+         fwprintf(stderr, L"Cannot read the seek table of %s\n", entry);
+         return 1;
+     }
+     r.frame_at = frame_at;
+     r.first = (int)(r.offset / r.frame_size);
+     r.last = (int)((r.end - 1) / r.frame_size);
+ 
+     // The workers write their pieces through handles of their own, the file gets its final size first
+     h = CreateFileW(out_path, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, CREATE_ALWAYS, 0, NULL);
+     FILE_END_OF_FILE_INFO eof = { 0 };
+     eof.EndOfFile.QuadPart = r.end - r.offset;
+     ok = h != INVALID_HANDLE_VALUE && SetFileInformationByHandle(h, FileEndOfFileInfo, &eof, sizeof(eof));
+     int threads = (int)GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+     if (threads > r.last - r.first + 1) threads = r.last - r.first + 1;
+     HANDLE *workers = malloc(threads * sizeof(HANDLE));
+     int started = 0;
+     for (int t = 0; ok && t < threads; t++) {
+         workers[started] = CreateThread(NULL, 0, range_worker, &r, 0, NULL);
+         if (workers[started]) started++;
+     }
+     if (ok && started == 0) range_worker(&r);
+     WaitForMultipleObjects(started, workers, TRUE, INFINITE);
+     for (int t = 0; t < started; t++) CloseHandle(workers[t]);
+     free(workers);
+     free(frame_at);
+     ok = ok && !r.failed;
+     if (h != INVALID_HANDLE_VALUE) {
+         CloseHandle(h);
+         if (!ok) DeleteFileW(out_path);
+     }
+     if (!ok) {
+         fwprintf(stderr, L"Cannot extract %s to %s\n", entry, out_path);
+         return 1;
+     }
+     wprintf(L"%s [%lld, %lld) -> %s, %d of %u frames\n", entry, (long long)r.offset, (long long)r.end, out_path,
+             r.last - r.first + 1, frames);
+     return 0;
+ }
@@ -0,0 +1,337 @@
+ // Streamed output to stdout, a named pipe, TCP or an HTTP(S) PUT; a sender thread drains a bounded ring
+ #include "archiver.h"
+ 
+ #define SINK_BUF ((int32_t)2 << 20)
+ #define SINK_RING 8
+ #define SINK_PIPE_PREFIX L"\\\\.\\pipe\\"
+ 
+ typedef enum SinkKind { SINK_FILE, SINK_SOCKET, SINK_HTTP } SinkKind;
+ 
+ // Standard output as it was before console messages moved to stderr
+ static HANDLE sink_stdout = INVALID_HANDLE_VALUE;
+ 
+ typedef struct SinkStream {
+     mz_stream stream;
+     SinkKind kind;
+     HANDLE h;                // standard output or the pipe
+     bool server;             // the pipe was created here and waited for its reader
+     SOCKET sock;
+     bool wsa;
+     HINTERNET session, connect, request;
+     uint8_t *ring[SINK_RING];
+     int32_t fill[SINK_RING];
+     int head;                // slot the writer fills
+     int tail;                // oldest slot queued for the sender
+     int queued;              // slots handed to the sender and not yet sent
+     bool closing;
+     SRWLOCK lock;
+     CONDITION_VARIABLE data;
+     CONDITION_VARIABLE space;
+     HANDLE thread;
+     int64_t pos;
+     int32_t error;
+ } SinkStream;
+ 
+ // Output names that stream instead of naming a file
+ bool sink_target(const wchar_t *path) {
+     return wcscmp(path, L"-") == 0 || _wcsnicmp(path, SINK_PIPE_PREFIX, wcslen(SINK_PIPE_PREFIX)) == 0 ||
+            _wcsnicmp(path, L"tcp://", 6) == 0 || _wcsnicmp(path, L"http://", 7) == 0 ||
+            _wcsnicmp(path, L"https://", 8) == 0;
+ }
+ 
+ // Keep the real standard output for the archive and send console messages to stderr
+ bool sink_stdout_claim(void) {
+     HANDLE h = GetStdHandle(STD_OUTPUT_HANDLE);
+     if (!h || h == INVALID_HANDLE_VALUE || GetFileType(h) == FILE_TYPE_CHAR) {
+         fwprintf(stderr, L"Standard output is a console, redirect it to stream the archive\n");
+         return false;
+     }
+     if (!DuplicateHandle(GetCurrentProcess(), h, GetCurrentProcess(), &sink_stdout, 0, FALSE, DUPLICATE_SAME_ACCESS)) {
+         fwprintf(stderr, L"Cannot take over standard output\n");
+         return false;
+     }
+     fflush(stdout);
+     _dup2(_fileno(stderr), _fileno(stdout));
+     return true;
+ }
+ 
+ // Connect to a listening pipe, or create it and wait for a reader
+ static bool sink_open_pipe(SinkStream *ss, const wchar_t *name) {
+     ss->h = CreateFileW(name, GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+     if (ss->h == INVALID_HANDLE_VALUE && GetLastError() == ERROR_PIPE_BUSY && WaitNamedPipeW(name, NMPWAIT_WAIT_FOREVER))
+         ss->h = CreateFileW(name, GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+     if (ss->h != INVALID_HANDLE_VALUE || GetLastError() != ERROR_FILE_NOT_FOUND) return ss->h != INVALID_HANDLE_VALUE;
+     ss->h = CreateNamedPipeW(name, PIPE_ACCESS_OUTBOUND | FILE_FLAG_FIRST_PIPE_INSTANCE, PIPE_TYPE_BYTE | PIPE_WAIT,
+                              1, SINK_BUF, 0, 0, NULL);
+     if (ss->h == INVALID_HANDLE_VALUE) return false;
+     ss->server = true;
+     wprintf(L"Waiting for a reader on %s\n", name);
+     return ConnectNamedPipe(ss->h, NULL) || GetLastError() == ERROR_PIPE_CONNECTED;
+ }
+ 
+ // host:port, an IPv6 host in brackets
+ static bool sink_open_tcp(SinkStream *ss, const wchar_t *address) {
+     const wchar_t *colon = wcsrchr(address, L':');
+     size_t len = colon ? (size_t)(colon - address) : 0;
+     if (len > 2 && address[0] == L'[' && address[len - 1] == L']') {
+         address++;
+         len -= 2;
+     }
+     wchar_t host[256];
+     if (len == 0 || len >= 256 || !colon[1]) return false;
+     wmemcpy(host, address, len);
+     host[len] = L'\0';
+     WSADATA wsa;
+     if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) return false;
+     ss->wsa = true;
+     ADDRINFOW hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM, .ai_protocol = IPPROTO_TCP };
+     ADDRINFOW *res = NULL;
+     if (GetAddrInfoW(host, colon + 1, &hints, &res) != 0) return false;
+     for (ADDRINFOW *ai = res; ai && ss->sock == INVALID_SOCKET; ai = ai->ai_next) {
+         ss->sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+         if (ss->sock != INVALID_SOCKET && connect(ss->sock, ai->ai_addr, (int)ai->ai_addrlen) == SOCKET_ERROR) {
+             closesocket(ss->sock);
+             ss->sock = INVALID_SOCKET;
+         }
+     }
+     FreeAddrInfoW(res);
+     return ss->sock != INVALID_SOCKET;
+ }
+ 
+ // PUT with a chunked body, the archive size is only known at the end
+ static bool sink_open_http(SinkStream *ss, const wchar_t *url) {
+     wchar_t host[256];
+     URL_COMPONENTS uc = { .dwStructSize = sizeof(uc), .lpszHostName = host, .dwHostNameLength = 256,
+                           .dwUrlPathLength = (DWORD)-1, .dwExtraInfoLength = (DWORD)-1 };
+     if (!WinHttpCrackUrl(url, 0, 0, &uc)) return false;
+     // The query runs on after the path, both go out as the object name
+     const wchar_t *object = uc.dwUrlPathLength ? uc.lpszUrlPath : L"/";
+     ss->session = WinHttpOpen(L"archiver", WINHTTP_ACCESS_TYPE_DEFAULT_PROXY, WINHTTP_NO_PROXY_NAME,
+                               WINHTTP_NO_PROXY_BYPASS, 0);
+     if (!ss->session || !(ss->connect = WinHttpConnect(ss->session, host, uc.nPort, 0))) return false;
+     ss->request = WinHttpOpenRequest(ss->connect, L"PUT", object, NULL, WINHTTP_NO_REFERER, WINHTTP_DEFAULT_ACCEPT_TYPES,
+                                      uc.nScheme == INTERNET_SCHEME_HTTPS ? WINHTTP_FLAG_SECURE : 0);
+     return ss->request &&
+            WinHttpSendRequest(ss->request, L"Content-Type: application/zip\r\nTransfer-Encoding: chunked\r\n", (DWORD)-1,
+                               WINHTTP_NO_REQUEST_DATA, 0, WINHTTP_IGNORE_REQUEST_TOTAL_LENGTH, 0);
+ }
+ 
+ static bool sink_send(SinkStream *ss, const uint8_t *buf, int32_t len) {
+     if (ss->kind == SINK_HTTP) {
+         // One chunk per buffer, the empty one ends the body
+         char head[16];
+         DWORD done;
+         int n = snprintf(head, sizeof(head), "%X\r\n", (unsigned)len);
+         return WinHttpWriteData(ss->request, head, n, &done) && (len == 0 || WinHttpWriteData(ss->request, buf, len, &done)) &&
+                WinHttpWriteData(ss->request, "\r\n", 2, &done);
+     }
+     while (len > 0) {
+         int32_t n;
+         if (ss->kind == SINK_SOCKET) {
+             n = send(ss->sock, (const char *)buf, len, 0);
+             if (n == SOCKET_ERROR) return false;
+         } else {
+             DWORD done = 0;
+             if (!WriteFile(ss->h, buf, (DWORD)len, &done, NULL) || done == 0) return false;
+             n = (int32_t)done;
+         }
+         buf += n;
+         len -= n;
+     }
+     return true;
+ }
+ 
+ static DWORD WINAPI sink_sender(LPVOID param) {
+     SinkStream *ss = param;
+     AcquireSRWLockExclusive(&ss->lock);
+     for (;;) {
+         while (ss->queued == 0 && !ss->closing) SleepConditionVariableSRW(&ss->data, &ss->lock, INFINITE, 0);
+         if (ss->queued == 0) break;
+         int slot = ss->tail;
+         ReleaseSRWLockExclusive(&ss->lock);
+         int64_t start = trace_begin();
+         bool ok = sink_send(ss, ss->ring[slot], ss->fill[slot]);
+         trace_end(TRACE_WRITE, start, ss->fill[slot]);
+         AcquireSRWLockExclusive(&ss->lock);
+         if (!ok) {
+             ss->error = MZ_WRITE_ERROR;
+             WakeConditionVariable(&ss->space);
+             break;
+         }
+         ss->tail = (ss->tail + 1) % SINK_RING;
+         ss->queued--;
+         WakeConditionVariable(&ss->space);
+     }
+     ReleaseSRWLockExclusive(&ss->lock);
+     return 0;
+ }
+ 
+ // Hand the full current slot to the sender and wait for a free one, this is the backpressure
+ static bool sink_publish(SinkStream *ss) {
+     AcquireSRWLockExclusive(&ss->lock);
+     ss->queued++;
+     WakeConditionVariable(&ss->data);
+     while (ss->queued == SINK_RING && ss->error == MZ_OK)
+         SleepConditionVariableSRW(&ss->space, &ss->lock, INFINITE, 0);
+     bool ok = ss->error == MZ_OK;
+     ReleaseSRWLockExclusive(&ss->lock);
+     ss->head = (ss->head + 1) % SINK_RING;
+     ss->fill[ss->head] = 0;
+     return ok;
+ }
+ 
+ // Tell the far end the archive is complete: end the chunked body and check the reply,
+ // half-close the socket, or let the pipe reader drain the pipe before disconnecting
+ static bool sink_finish(SinkStream *ss) {
+     if (ss->kind == SINK_SOCKET) return shutdown(ss->sock, SD_SEND) != SOCKET_ERROR;
+     if (ss->kind == SINK_FILE) return !ss->server || FlushFileBuffers(ss->h);
+     DWORD status = 0, len = sizeof(status);
+     return sink_send(ss, NULL, 0) && WinHttpReceiveResponse(ss->request, NULL) &&
+            WinHttpQueryHeaders(ss->request, WINHTTP_QUERY_STATUS_CODE | WINHTTP_QUERY_FLAG_NUMBER,
+                                WINHTTP_HEADER_NAME_BY_INDEX, &status, &len, WINHTTP_NO_HEADER_INDEX) &&
+            status >= 200 && status < 300;
+ }
+ 
+ static void sink_release(SinkStream *ss) {
+     if (ss->request) WinHttpCloseHandle(ss->request);
+     if (ss->connect) WinHttpCloseHandle(ss->connect);
+     if (ss->session) WinHttpCloseHandle(ss->session);
+     ss->request = ss->connect = ss->session = NULL;
+     if (ss->sock != INVALID_SOCKET) closesocket(ss->sock);
+     ss->sock = INVALID_SOCKET;
+     if (ss->wsa) WSACleanup();
+     ss->wsa = false;
+     if (ss->server) DisconnectNamedPipe(ss->h);
+     ss->server = false;
+     if (ss->h != INVALID_HANDLE_VALUE && ss->h != sink_stdout) CloseHandle(ss->h);
+     ss->h = INVALID_HANDLE_VALUE;
+ }
+ 
+ static int32_t sink_open(void *stream, const char *path, int32_t mode) {
+     SinkStream *ss = stream;
+     if (!(mode & MZ_OPEN_MODE_CREATE) || (mode & MZ_OPEN_MODE_APPEND)) return MZ_SUPPORT_ERROR;
+     wchar_t target[PATH_MAX_LEN];
+     MultiByteToWideChar(CP_UTF8, 0, path, -1, target, PATH_MAX_LEN);
+     bool ok;
+     if (wcscmp(target, L"-") == 0) {
+         ss->kind = SINK_FILE;
+         ok = (ss->h = sink_stdout) != INVALID_HANDLE_VALUE;
+     } else if (_wcsnicmp(target, SINK_PIPE_PREFIX, wcslen(SINK_PIPE_PREFIX)) == 0) {
+         ss->kind = SINK_FILE;
+         ok = sink_open_pipe(ss, target);
+     } else if (_wcsnicmp(target, L"tcp://", 6) == 0) {
+         ss->kind = SINK_SOCKET;
+         ok = sink_open_tcp(ss, target + 6);
+     } else {
+         ss->kind = SINK_HTTP;
+         ok = sink_open_http(ss, target);
+     }
+     ss->head = ss->tail = ss->queued = 0;
+     ss->fill[0] = 0;
+     ss->closing = false;
+     ss->pos = 0;
+     ss->error = MZ_OK;
+     if (ok) ss->thread = CreateThread(NULL, 0, sink_sender, ss, 0, NULL);
+     if (!ss->thread) {
+         sink_release(ss);
+         return MZ_OPEN_ERROR;
+     }
+     return MZ_OK;
+ }
+ 
+ static int32_t sink_is_open(void *stream) {
+     return ((SinkStream *)stream)->thread ? MZ_OK : MZ_OPEN_ERROR;
+ }
+ 
+ static int32_t sink_read(void *stream, void *buf, int32_t size) {
+     return MZ_SUPPORT_ERROR;
+ }
+ 
+ static int32_t sink_write(void *stream, const void *buf, int32_t size) {
+     SinkStream *ss = stream;
+     const uint8_t *src = buf;
+     int32_t written = 0;
+     while (written < size) {
+         int32_t n = size - written;
+         if (n > SINK_BUF - ss->fill[ss->head]) n = SINK_BUF - ss->fill[ss->head];
+         memcpy(ss->ring[ss->head] + ss->fill[ss->head], src + written, n);
+         ss->fill[ss->head] += n;
+         written += n;
+         ss->pos += n;
+         if (ss->fill[ss->head] == SINK_BUF && !sink_publish(ss)) return MZ_WRITE_ERROR;
+     }
+     return written;
+ }
+ 
+ static int64_t sink_tell(void *stream) {
+     return ((SinkStream *)stream)->pos;
+ }
+ 
+ static int32_t sink_seek(void *stream, int64_t offset, int32_t origin) {
+     SinkStream *ss = stream;
+     // The end is the current position, everything before it is gone
+     int64_t pos = origin == MZ_SEEK_SET ? offset : ss->pos + offset;
+     return pos == ss->pos ? MZ_OK : MZ_SEEK_ERROR;
+ }
+ 
+ static int32_t sink_close(void *stream) {
+     SinkStream *ss = stream;
+     if (!ss->thread) return MZ_OK;
+     AcquireSRWLockExclusive(&ss->lock);
+     // The slot being filled is never queued, so it always fits
+     if (ss->fill[ss->head] > 0) ss->queued++;
+     ss->closing = true;
+     WakeConditionVariable(&ss->data);
+     ReleaseSRWLockExclusive(&ss->lock);
+     WaitForSingleObject(ss->thread, INFINITE);
+     CloseHandle(ss->thread);
+     ss->thread = NULL;
+     int32_t err = ss->error;
+     if (err == MZ_OK && !sink_finish(ss)) err = MZ_CLOSE_ERROR;
+     sink_release(ss);
+     return err;
+ }
+ 
+ static int32_t sink_error(void *stream) {
+     return ((SinkStream *)stream)->error;
+ }
+ 
+ static void sink_destroy(void **stream) {
+     SinkStream *ss = *stream;
+     if (!ss) return;
+     sink_close(ss);
+     free(ss->ring[0]);
+     free(ss);
+     *stream = NULL;
+ }
+ 
+ static int32_t sink_get_prop(void *stream, int32_t prop, int64_t *value) {
+     return MZ_EXIST_ERROR;
+ }
+ 
+ static int32_t sink_set_prop(void *stream, int32_t prop, int64_t value) {
+     return MZ_EXIST_ERROR;
+ }
+ 
+ static mz_stream_vtbl sink_stream_vtbl = {
+     sink_open, sink_is_open, sink_read, sink_write, sink_tell, sink_seek,
+     sink_close, sink_error, sink_create, sink_destroy, sink_get_prop, sink_set_prop,
+ };
+ 
+ void *sink_create(void) {
+     SinkStream *ss = calloc(1, sizeof(*ss));
+     if (!ss) return NULL;
+     ss->stream.vtbl = &sink_stream_vtbl;
+     ss->h = INVALID_HANDLE_VALUE;
+     ss->sock = INVALID_SOCKET;
+     InitializeSRWLock(&ss->lock);
+     InitializeConditionVariable(&ss->data);
+     InitializeConditionVariable(&ss->space);
+     ss->ring[0] = malloc((size_t)SINK_BUF * SINK_RING);
+     if (!ss->ring[0]) {
+         free(ss);
+         return NULL;
+     }
+     for (int i = 1; i < SINK_RING; i++) ss->ring[i] = ss->ring[0] + (size_t)SINK_BUF * i;
+     return ss;
+ }
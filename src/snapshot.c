@@ -0,0 +1,133 @@
+ // --snapshot: one VSS shadow copy per source volume through WMI, link targets are moved onto the copies
+ #include "archiver.h"
+ 
+ static bool snapshot_connect(SnapshotSet *set) {
+     HRESULT hr = CoInitializeEx(NULL, COINIT_MULTITHREADED);
+     if (FAILED(hr)) return false;
+     set->com = true;
+     // Fails harmlessly when security was already set up for this process
+     CoInitializeSecurity(NULL, -1, NULL, NULL, RPC_C_AUTHN_LEVEL_DEFAULT, RPC_C_IMP_LEVEL_IMPERSONATE, NULL,
+                          EOAC_NONE, NULL);
+     IWbemLocator *loc = NULL;
+     hr = CoCreateInstance(&CLSID_WbemLocator, NULL, CLSCTX_INPROC_SERVER, &IID_IWbemLocator, (void **)&loc);
+     if (FAILED(hr)) return false;
+     BSTR ns = SysAllocString(L"ROOT\\CIMV2");
+     hr = loc->lpVtbl->ConnectServer(loc, ns, NULL, NULL, NULL, 0, NULL, NULL, &set->svc);
+     SysFreeString(ns);
+     loc->lpVtbl->Release(loc);
+     if (FAILED(hr)) return false;
+     CoSetProxyBlanket((IUnknown *)set->svc, RPC_C_AUTHN_WINNT, RPC_C_AUTHZ_NONE, NULL, RPC_C_AUTHN_LEVEL_CALL,
+                       RPC_C_IMP_LEVEL_IMPERSONATE, NULL, EOAC_NONE);
+     return true;
+ }
+ 
+ static bool wmi_put_string(IWbemClassObject *obj, const wchar_t *name, const wchar_t *value) {
+     VARIANT v;
+     VariantInit(&v);
+     v.vt = VT_BSTR;
+     v.bstrVal = SysAllocString(value);
+     HRESULT hr = obj->lpVtbl->Put(obj, name, 0, &v, 0);
+     VariantClear(&v);
+     return SUCCEEDED(hr);
+ }
+ 
+ static bool wmi_get_string(IWbemClassObject *obj, const wchar_t *name, wchar_t *out, size_t cap) {
+     VARIANT v;
+     VariantInit(&v);
+     bool ok = SUCCEEDED(obj->lpVtbl->Get(obj, name, 0, &v, NULL, NULL)) && v.vt == VT_BSTR && v.bstrVal;
+     if (ok) {
+         wcsncpy(out, v.bstrVal, cap - 1);
+         out[cap - 1] = L'\0';
+     }
+     VariantClear(&v);
+     return ok;
+ }
+ 
+ // Create a client-accessible shadow copy of volume and find its device path
+ static bool snapshot_create(SnapshotSet *set, const wchar_t *volume, Snapshot *snap) {
+     IWbemServices *svc = set->svc;
+     IWbemClassObject *cls = NULL, *in_def = NULL, *in = NULL, *result = NULL;
+     BSTR cls_name = SysAllocString(L"Win32_ShadowCopy"), method = SysAllocString(L"Create");
+     bool ok = SUCCEEDED(svc->lpVtbl->GetObject(svc, cls_name, 0, NULL, &cls, NULL)) &&
+               SUCCEEDED(cls->lpVtbl->GetMethod(cls, L"Create", 0, &in_def, NULL)) &&
+               SUCCEEDED(in_def->lpVtbl->SpawnInstance(in_def, 0, &in)) &&
+               wmi_put_string(in, L"Volume", volume) && wmi_put_string(in, L"Context", L"ClientAccessible") &&
+               SUCCEEDED(svc->lpVtbl->ExecMethod(svc, cls_name, method, 0, NULL, in, &result, NULL));
+     if (ok) {
+         VARIANT rv;
+         VariantInit(&rv);
+         ok = SUCCEEDED(result->lpVtbl->Get(result, L"ReturnValue", 0, &rv, NULL, NULL)) && rv.lVal == 0 &&
+              wmi_get_string(result, L"ShadowID", snap->id, 64);
+         if (!ok && rv.vt != 0)
+             fwprintf(stderr, L"Win32_ShadowCopy.Create(%s) returned %ld\n", volume, (long)rv.lVal);
+         VariantClear(&rv);
+     }
+     if (result) result->lpVtbl->Release(result);
+     if (in) in->lpVtbl->Release(in);
+     if (in_def) in_def->lpVtbl->Release(in_def);
+     if (cls) cls->lpVtbl->Release(cls);
+     SysFreeString(method);
+     SysFreeString(cls_name);
+     if (!ok) return false;
+ 
+     wchar_t query_text[160];
+     wsprintfW(query_text, L"SELECT DeviceObject FROM Win32_ShadowCopy WHERE ID='%s'", snap->id);
+     BSTR wql = SysAllocString(L"WQL"), query = SysAllocString(query_text);
+     IEnumWbemClassObject *found = NULL;
+     IWbemClassObject *obj = NULL;
+     ULONG n = 0;
+     ok = SUCCEEDED(svc->lpVtbl->ExecQuery(svc, wql, query, WBEM_FLAG_FORWARD_ONLY | WBEM_FLAG_RETURN_IMMEDIATELY,
+                                           NULL, &found)) &&
+          SUCCEEDED(found->lpVtbl->Next(found, WBEM_INFINITE, 1, &obj, &n)) && n == 1 &&
+          wmi_get_string(obj, L"DeviceObject", snap->device, PATH_MAX_LEN);
+     if (obj) obj->lpVtbl->Release(obj);
+     if (found) found->lpVtbl->Release(found);
+     SysFreeString(query);
+     SysFreeString(wql);
+     wcscpy(snap->volume, volume);
+     return ok;
+ }
+ 
+ static void snapshot_delete(SnapshotSet *set, const Snapshot *snap) {
+     wchar_t path_text[128];
+     wsprintfW(path_text, L"Win32_ShadowCopy.ID='%s'", snap->id);
+     BSTR path = SysAllocString(path_text);
+     if (FAILED(set->svc->lpVtbl->DeleteInstance(set->svc, path, 0, NULL, NULL)))
+         fwprintf(stderr, L"Cannot delete shadow copy %s of %s\n", snap->id, snap->volume);
+     SysFreeString(path);
+ }
+ 
+ // Snapshot every volume the links touch and point the links into the snapshots
+ void snapshot_links(SnapshotSet *set, LinkTarget *links, int count) {
+     if (count <= 0) return;
+     if (!snapshot_connect(set)) {
+         fwprintf(stderr, L"Cannot reach WMI, reading the live volumes\n");
+         return;
+     }
+     set->items = calloc(count, sizeof(Snapshot));
+     for (int i = 0; i < count; i++) {
+         wchar_t volume[PATH_MAX_LEN];
+         if (!GetVolumePathNameW(links[i].target, volume, PATH_MAX_LEN)) continue;
+         int s = 0;
+         while (s < set->count && _wcsicmp(set->items[s].volume, volume) != 0) s++;
+         if (s == set->count) {
+             if (!snapshot_create(set, volume, &set->items[s])) {
+                 fwprintf(stderr, L"Cannot snapshot %s (needs an elevated prompt), reading it live\n", volume);
+                 continue;
+             }
+             wprintf(L"Snapshot of %s: %s\n", volume, set->items[s].device);
+             set->count++;
+         }
+         wchar_t moved[PATH_MAX_LEN];
+         wsprintfW(moved, L"%s\\%s", set->items[s].device, links[i].target + wcslen(volume));
+         wcscpy(links[i].target, moved);
+     }
+ }
+ 
+ void snapshot_release(SnapshotSet *set) {
+     for (int i = 0; i < set->count; i++) snapshot_delete(set, &set->items[i]);
+     if (set->svc) set->svc->lpVtbl->Release(set->svc);
+     if (set->com) CoUninitialize();
+     free(set->items);
+     memset(set, 0, sizeof(*set));
+ }